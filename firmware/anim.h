@@ -0,0 +1,60 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Non-blocking LED animations. An animation is a sequence of frames, each is
+// an LED mask shown for a given duration. Frames are switched by a scheduler
+// timer, so the CPU sleeps or handles events while an animation plays.
+// When the last frame's duration expires, the done() callback is called
+
+#pragma once
+
+#include "sched.h"
+
+struct frame {
+  uint16_t mask;      // LEDs to light, see set_leds()
+  uint16_t duration;  // How long to show it, milliseconds
+};
+
+struct anim {
+  struct sched *sched;            // Scheduler to use
+  void (*show)(uint16_t mask);    // Display a frame
+  void (*done)(void);             // Called at the end, can be NULL
+  const struct frame *frames;     // Currently playing frames, or NULL
+  size_t count, pos;              // Number of frames, next frame to show
+  struct timer timer;             // Fires when next frame is due
+};
+
+static inline bool anim_running(const struct anim *a) {
+  return a->frames != NULL;
+}
+
+// Show next frame at time `when`, or finish
+static inline void anim_step(struct anim *a, uint64_t when) {
+  if (a->pos < a->count) {
+    const struct frame *f = &a->frames[a->pos++];
+    a->show(f->mask);
+    sched_add(a->sched, &a->timer, when + f->duration, 0);
+  } else {
+    a->frames = NULL;
+    if (a->done != NULL) a->done();
+  }
+}
+
+static inline void anim_timer_fn(void *arg) {
+  struct anim *a = (struct anim *) arg;
+  anim_step(a, a->timer.expire);  // Frame times do not drift with wake-ups
+}
+
+// Start playing frames now, replacing any running animation
+static inline void anim_play(struct anim *a, const struct frame *frames,
+                             size_t count, uint64_t now) {
+  a->frames = frames, a->count = count, a->pos = 0;
+  a->timer.fn = anim_timer_fn, a->timer.arg = a;
+  anim_step(a, now);
+}
+
+// Stop, leaving the current frame on display. done() is not called
+static inline void anim_stop(struct anim *a) {
+  sched_cancel(a->sched, &a->timer);
+  a->frames = NULL;
+}
@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "../../mono.h"
+
 #define BIT(x) (1UL << (x))
 #define CLRSET(R, CLEARMASK, SETMASK) (R) = ((R) & ~(CLEARMASK)) | (SETMASK)
 #define PIN(bank, num) ((((bank) - 'A') << 8) | (num))
@@ -17,25 +19,10 @@
 
 #include <stm32l432xx.h>
 
-extern volatile uint64_t g_ticks;  // Milliseconds since boot
-
-// System clock
-enum { AHB_DIV = 1, APB1_DIV = 1, APB2_DIV = 1 };
-enum { PLL_HSI = 16, PLL_M = 1, PLL_N = 10, PLL_R = 2 };  // 80 Mhz
-// #define SYS_FREQUENCY ((PLL_HSI * PLL_N / PLL_M / PLL_R) * 1000000)
-#define SYS_FREQUENCY 16000000
-#define APB2_FREQUENCY (SYS_FREQUENCY / APB2_DIV)
-#define APB1_FREQUENCY (SYS_FREQUENCY / APB1_DIV)
-
 static inline void spin(volatile uint32_t count) {
   while (count--) (void) 0;
 }
 
-static inline void delay_ms(uint64_t milliseconds) {
-  uint64_t expire = g_ticks + milliseconds;
-  while (g_ticks < expire) spin(1);
-}
-
 enum { GPIO_MODE_INPUT, GPIO_MODE_OUTPUT, GPIO_MODE_AF, GPIO_MODE_ANALOG };
 enum { GPIO_OTYPE_PUSH_PULL, GPIO_OTYPE_OPEN_DRAIN };
 enum { GPIO_SPEED_LOW, GPIO_SPEED_MEDIUM, GPIO_SPEED_HIGH, GPIO_SPEED_INSANE };
@@ -57,6 +44,11 @@ static inline void gpio_write(uint16_t pin, bool val) {
   GPIO_TypeDef *gpio = gpio_bank(pin);
   gpio->BSRR = BIT(PINNO(pin)) << (val ? 0 : 16);
 }
+// Set and reset several pins of one bank at once. Low 16 bits of bsrr are
+// pins to set, high 16 bits are pins to reset
+static inline void gpio_write_bank(uint8_t bank, uint32_t bsrr) {
+  GPIO(bank)->BSRR = bsrr;
+}
 static inline void gpio_init(uint16_t pin, uint8_t mode, uint8_t type,
                              uint8_t speed, uint8_t pull, uint8_t af) {
   GPIO_TypeDef *gpio = gpio_bank(pin);
@@ -77,18 +69,31 @@ static inline void gpio_output(uint16_t pin) {
   gpio_init(pin, GPIO_MODE_OUTPUT, GPIO_OTYPE_PUSH_PULL, GPIO_SPEED_HIGH,
             GPIO_PULL_NONE, 0);
 }
+// Make several pins of one bank push-pull outputs, like gpio_output() does,
+// with one read-modify-write per register instead of five per pin
+static inline void gpio_output_bank(uint8_t bank, uint16_t pins) {
+  GPIO_TypeDef *gpio = GPIO(bank);
+  uint32_t mask = 0, ones = 0;  // Two bits per pin: 11 and 01
+  for (int i = 0; i < 16; i++) {
+    if (pins & BIT(i)) mask |= 3UL << (i * 2), ones |= 1UL << (i * 2);
+  }
+  RCC->AHB2ENR |= BIT(bank);  // Enable GPIO clock
+  gpio->OTYPER &= ~(uint32_t) pins;
+  CLRSET(gpio->OSPEEDR, mask, ones * GPIO_SPEED_HIGH);
+  CLRSET(gpio->PUPDR, mask, ones * GPIO_PULL_NONE);
+  CLRSET(gpio->MODER, mask, ones * GPIO_MODE_OUTPUT);
+}
 
 static inline bool uart_init(USART_TypeDef *uart, unsigned long baud) {
   // https://www.st.com/resource/en/datasheet/stm32l432kc.pdf
   uint8_t aftx = 7, afrx = 7;  // Alternate function
   uint16_t rx = 0, tx = 0;     // pins
-  uint32_t freq = 0;           // Bus frequency. UART1 is on APB2, rest on APB1
 
   if (uart == USART1) {
-    freq = APB2_FREQUENCY, RCC->APB2ENR |= RCC_APB2ENR_USART1EN;
+    RCC->APB2ENR |= RCC_APB2ENR_USART1EN;
     tx = PIN('A', 9), rx = PIN('A', 10);
   } else if (uart == USART2) {
-    freq = APB1_FREQUENCY, RCC->APB1ENR1 |= RCC_APB1ENR1_USART2EN;
+    RCC->APB1ENR1 |= RCC_APB1ENR1_USART2EN;
     tx = PIN('A', 2), rx = PIN('A', 15), afrx = 3;
   } else {
     return false;
@@ -97,10 +102,17 @@ static inline bool uart_init(USART_TypeDef *uart, unsigned long baud) {
   gpio_init(tx, GPIO_MODE_AF, GPIO_OTYPE_PUSH_PULL, GPIO_SPEED_HIGH, 0, aftx);
   gpio_init(rx, GPIO_MODE_AF, GPIO_OTYPE_PUSH_PULL, GPIO_SPEED_HIGH, 0, afrx);
   uart->CR1 = 0;                          // Disable this UART
-  uart->BRR = freq / baud;                // Set baud rate
+  uart->BRR = SystemCoreClock / baud;     // APB clocks are not divided
   uart->CR1 |= BIT(0) | BIT(2) | BIT(3);  // Set UE, RE, TE
+  NVIC_EnableIRQ(uart == USART1 ? USART1_IRQn : USART2_IRQn);
   return true;
 }
+// Set baud rate divider, after a clock change. Call when UART is idle
+static inline void uart_set_brr(USART_TypeDef *uart, uint16_t brr) {
+  uart->CR1 &= ~USART_CR1_UE;  // BRR can only be written when disabled
+  uart->BRR = brr;
+  uart->CR1 |= USART_CR1_UE;
+}
 static inline void uart_write_byte(USART_TypeDef *uart, uint8_t byte) {
   uart->TDR = byte;
   while ((uart->ISR & BIT(7)) == 0) spin(1);
@@ -108,7 +120,29 @@ static inline void uart_write_byte(USART_TypeDef *uart, uint8_t byte) {
 static inline void uart_write_buf(USART_TypeDef *uart, char *buf, size_t len) {
   while (len-- > 0) uart_write_byte(uart, *(uint8_t *) buf++);
 }
+
+// Non-blocking transmitter API, for interrupt-driven output
+static inline bool uart_tx_ready(USART_TypeDef *uart) {
+  return uart->ISR & USART_ISR_TXE;  // Data register is empty
+}
+static inline bool uart_tx_done(USART_TypeDef *uart) {
+  return uart->ISR & USART_ISR_TC;  // Last byte has left the shift register
+}
+static inline void uart_tx_byte(USART_TypeDef *uart, uint8_t byte) {
+  uart->TDR = byte;
+}
+// Enable IRQ on "ready for next byte", and on "transmission complete"
+static inline void uart_tx_irq(USART_TypeDef *uart, bool txe, bool tc) {
+  CLRSET(uart->CR1, USART_CR1_TXEIE | USART_CR1_TCIE,
+         (txe ? USART_CR1_TXEIE : 0) | (tc ? USART_CR1_TCIE : 0));
+}
+// Enable IRQ on "received byte is ready"
+static inline void uart_rx_irq(USART_TypeDef *uart, bool on) {
+  CLRSET(uart->CR1, USART_CR1_RXNEIE, on ? USART_CR1_RXNEIE : 0);
+}
+
 static inline int uart_read_ready(USART_TypeDef *uart) {
+  if (uart->ISR & USART_ISR_ORE) uart->ICR = USART_ICR_ORECF;  // Or IRQ storm
   return uart->ISR & BIT(5);  // If RXNE bit is set, data is ready
 }
 static inline uint8_t uart_read_byte(USART_TypeDef *uart) {
@@ -124,39 +158,167 @@ static inline uint32_t rng_read(void) {
   return RNG->DR;
 }
 
-// t: expiration time, prd: period, now: current time. Return true if expired
-static inline bool timer_expired(volatile uint64_t *t, uint64_t prd,
-                                 uint64_t now) {
-  if (now + prd < *t) *t = 0;                    // Time wrapped? Reset timer
-  if (*t == 0) *t = now + prd;                   // Firt poll? Set expiration
-  if (*t > now) return false;                    // Not expired yet, return
-  *t = (now - *t) > prd ? now + prd : *t + prd;  // Next expiration time
-  return true;                                   // Expired, return true
+// t: expiration time, prd: period, now: current time, all 32-bit
+// milliseconds, see mono.h. Return true if expired
+static inline bool timer_expired(volatile uint32_t *t, uint32_t prd,
+                                 uint32_t now) {
+  if (*t == 0) *t = now + prd;                  // Firt poll? Set expiration
+  if (!deadline_passed(*t, now)) return false;  // Not expired yet, return
+  *t = elapsed(*t, now) > prd ? now + prd : *t + prd;  // Next expiration
+  return true;                                         // Expired
 }
 
 // Fill in stack with markers, in order to calculate stack usage later
-extern unsigned char _end[];  // End of data section, start of heap. See link.ld
-extern unsigned char _estack[];           // End of stack - link.ld
-extern unsigned char *_current_heap_end;  // syscalls.c
+extern unsigned char _end[];     // End of bss, there is no heap. See link.ld
+extern unsigned char _estack[];  // End of stack - link.ld
 
 static inline void stack_fill(void) {
   uint32_t dummy, *p = (uint32_t *) _end;
   while (p < &dummy) *p++ = 0xa5a5a5a5;
 }
 
-static inline long stack_used(void) {
-  uint32_t *sp = (uint32_t *) _estack, *end = (uint32_t *) _end, *p = sp - 1;
-  while (p > end && *p != 0xa5a5a5a5) p--;
-  return (sp - p) * sizeof(*p);
+static inline uint32_t *ram_end(void) {  // First RAM word the stack may use
+  return (uint32_t *) _end;
+}
+static inline uint32_t *stack_top(void) {
+  return (uint32_t *) _estack;
+}
+static inline uint32_t *stack_sp(void) {
+  return (uint32_t *) __get_MSP();
+}
+
+// Data that survives reset: startup code does not zero it. See link.ld
+#define NOINIT __attribute__((section(".noinit")))
+
+static inline void cpu_reset(void) {
+  NVIC_SystemReset();
+}
+
+// Flash programming, for the key/value store pages at the end of flash.
+// Pages are erased whole, and written in double words, each once after an
+// erase. The CPU stalls while flash is busy, and runs again when it is done
+#define FLASH_PAGE_SIZE 2048
+extern uint8_t _skv[], _eflash[];  // Key/value store pages - link.ld
+
+static inline uint8_t *flash_kv_base(void) {
+  return _skv;
+}
+static inline unsigned flash_kv_pages(void) {
+  return (unsigned) ((size_t) (_eflash - _skv) / FLASH_PAGE_SIZE);
 }
 
-static inline long ram_used(void) {
-  return (long) (_current_heap_end - _end);
+static inline bool flash_wait(void) {  // Wait, clear and return errors
+  uint32_t err = FLASH_SR_OPERR | FLASH_SR_PROGERR | FLASH_SR_WRPERR |
+                 FLASH_SR_PGAERR | FLASH_SR_SIZERR | FLASH_SR_PGSERR;
+  while (FLASH->SR & FLASH_SR_BSY) spin(1);
+  err &= FLASH->SR;
+  FLASH->SR = err | FLASH_SR_EOP;  // Write 1 to clear
+  return err == 0;
 }
 
-static inline long ram_free(void) {
-  unsigned char endofstack;
-  return (long) (&endofstack - _current_heap_end);
+static inline void flash_unlock(void) {
+  if (FLASH->CR & FLASH_CR_LOCK) {
+    FLASH->KEYR = 0x45670123;
+    FLASH->KEYR = 0xcdef89ab;
+  }
+  flash_wait();  // Also clears errors left from before
+}
+
+static inline bool flash_erase(void *page) {
+  uint32_t n = ((uint32_t) (uintptr_t) page - FLASH_BASE) / FLASH_PAGE_SIZE;
+  bool ok;
+  flash_unlock();
+  CLRSET(FLASH->CR, FLASH_CR_PNB, FLASH_CR_PER | (n << FLASH_CR_PNB_Pos));
+  FLASH->CR |= FLASH_CR_STRT;
+  ok = flash_wait();
+  FLASH->CR &= ~FLASH_CR_PER;
+  FLASH->CR |= FLASH_CR_LOCK;
+  FLASH->ACR &= ~FLASH_ACR_DCEN;  // Data cache may hold the old contents
+  FLASH->ACR |= FLASH_ACR_DCRST;
+  FLASH->ACR &= ~FLASH_ACR_DCRST;
+  FLASH->ACR |= FLASH_ACR_DCEN;
+  return ok;
+}
+
+// Flash ECC. A double word whose programming was cut short by a power loss
+// can hold bits that fail ECC. Reading it sets ECCD, and raises an NMI,
+// which returns to the read. flash_read() fails if that happened, so the
+// caller can skip the data. Any other NMI resets
+static volatile bool s_flash_eccd;
+
+void NMI_Handler(void) {
+  if (FLASH->ECCR & FLASH_ECCR_ECCD) {
+    FLASH->ECCR = (FLASH->ECCR & FLASH_ECCR_ECCCIE) | FLASH_ECCR_ECCD;
+    s_flash_eccd = true;
+  } else {
+    cpu_reset();
+  }
+}
+
+static inline bool flash_read(const void *addr, void *buf, size_t len) {
+  s_flash_eccd = false;
+  memcpy(buf, addr, len);
+  __DSB();  // The NMI comes with the load
+  return !s_flash_eccd;
+}
+
+// Program len bytes, a multiple of 8, to a double word aligned address
+static inline bool flash_write(void *addr, const void *buf, size_t len) {
+  volatile uint32_t *dst = (volatile uint32_t *) addr;
+  bool ok = true;
+  flash_unlock();
+  FLASH->CR |= FLASH_CR_PG;
+  for (size_t i = 0; ok && i < len; i += 8) {
+    uint32_t w[2];
+    memcpy(w, (const uint8_t *) buf + i, sizeof(w));
+    *dst++ = w[0];  // Both words, in order: then programming starts
+    *dst++ = w[1];
+    ok = flash_wait();
+  }
+  FLASH->CR &= ~FLASH_CR_PG;
+  FLASH->CR |= FLASH_CR_LOCK;
+  return ok;
+}
+
+// Make a RAM region inaccessible, to catch stack overflow. base must be
+// aligned to size, a power of two. Other memory keeps the default map
+static inline void mpu_guard(void *base, uint32_t size) {
+  uint32_t log2 = 31U - (uint32_t) __builtin_clz(size);  // Region is 2^log2
+  MPU->RNR = 0;
+  MPU->RBAR = (uint32_t) base;
+  MPU->RASR = MPU_RASR_XN_Msk |  // AP is 0: no access. No execution either
+              ((log2 - 1) << MPU_RASR_SIZE_Pos) | MPU_RASR_ENABLE_Msk;
+  MPU->CTRL = MPU_CTRL_PRIVDEFENA_Msk | MPU_CTRL_ENABLE_Msk;
+  SCB->SHCSR |= SCB_SHCSR_MEMFAULTENA_Msk;
+  __DSB();
+  __ISB();
+}
+
+// Memory faults: guard hit, or anything that escalated. The faulting stack
+// may be exhausted, so switch to a fresh one at the top of RAM first. Then
+// pass what happened to fault_handler(), which must not return
+void fault_handler(uint32_t pc, uint32_t lr, uint32_t sp, uint32_t cfsr,
+                   uint32_t addr);
+
+__attribute__((used)) static void fault_entry(uint32_t *frame) {
+  uint32_t cfsr = SCB->CFSR, addr = 0;
+  if (cfsr & SCB_CFSR_MMARVALID_Msk) addr = SCB->MMFAR;
+  if (cfsr & SCB_CFSR_BFARVALID_Msk) addr = SCB->BFAR;
+  bool stacked = !(cfsr & (SCB_CFSR_MSTKERR_Msk | SCB_CFSR_STKERR_Msk));
+  fault_handler(stacked ? frame[6] : 0, stacked ? frame[5] : 0,  // PC, LR
+                (uint32_t) frame, cfsr, addr);
+}
+
+__attribute__((naked)) void MemManage_Handler(void) {
+  __asm volatile(
+      "mrs r0, msp\n"
+      "ldr r1, =_estack\n"
+      "msr msp, r1\n"
+      "b fault_entry\n");
+}
+
+__attribute__((naked)) void HardFault_Handler(void) {
+  __asm volatile("b MemManage_Handler\n");
 }
 
 static inline void attach_external_irq(uint16_t pin) {
@@ -165,24 +327,427 @@ static inline void attach_external_irq(uint16_t pin) {
   SYSCFG->EXTICR[n / 4] &= ~(15UL << ((n % 4) * 4));
   SYSCFG->EXTICR[n / 4] |= (uint32_t) (bank << ((n % 4) * 4));
   EXTI->IMR1 |= BIT(n);
-  // EXTI->RTSR1 |= BIT(n);  // Trigger on rising edge
+  EXTI->RTSR1 |= BIT(n);  // Trigger on rising edge
   EXTI->FTSR1 |= BIT(n);  // Trigger on falling edge
   NVIC_SetPriority(irq, 3);
   NVIC_EnableIRQ(irq);
 }
 
-static inline void clock_init(void) {
-  SCB->CPACR |= 15 << 20;  // Enable FPU
-  FLASH->ACR |= FLASH_ACR_LATENCY_4WS | FLASH_ACR_ICEN | FLASH_ACR_DCEN;
+// Mask or unmask pin's external interrupt. Edges seen while masked are lost
+static inline void exti_enable(uint16_t pin, bool on) {
+  uint32_t bit = BIT(PINNO(pin));
+  if (on) {
+    EXTI->PR1 = bit;
+    EXTI->IMR1 |= bit;
+  } else {
+    EXTI->IMR1 &= ~bit;
+  }
+}
+
+// Switch system clock at runtime. src is an RCC_CFGR SW value: 0 - MSI,
+// 1 - HSI16, 3 - PLL from HSI16, running at 16 MHz * pll_n / 2. vos is the
+// voltage range, ws flash wait states, hz the resulting frequency. See
+// clock.h for how these are computed. Going faster, voltage and wait
+// states are raised first; going slower, they are lowered last
+static struct clock_state {
+  uint8_t src, msi_range, pll_n, vos, ws;
+  uint32_t hz;
+} s_clock;
+
+static inline void flash_set_ws(uint8_t ws) {
+  CLRSET(FLASH->ACR, FLASH_ACR_LATENCY, ws);
+  while ((FLASH->ACR & FLASH_ACR_LATENCY) != ws) spin(1);
+}
+
+static inline void pwr_set_vos(uint8_t vos) {
+  CLRSET(PWR->CR1, PWR_CR1_VOS, (uint32_t) vos << PWR_CR1_VOS_Pos);
+  while (PWR->SR2 & PWR_SR2_VOSF) spin(1);
+}
+
+static inline void clock_set(uint8_t src, uint8_t msi_range, uint8_t pll_n,
+                             uint8_t vos, uint8_t ws, uint32_t hz) {
+  RCC->APB1ENR1 |= RCC_APB1ENR1_PWREN;
+  if (vos < s_clock.vos || s_clock.vos == 0) pwr_set_vos(vos);
+  if (ws > s_clock.ws || s_clock.hz == 0) flash_set_ws(ws);
 
-  RCC->CR |= RCC_CR_HSION;
-  while (!(RCC->CR & RCC_CR_HSIRDY)) spin(1);
-  RCC->CFGR &= ~(RCC_CFGR_SW);
-  RCC->CFGR |= (RCC_CFGR_SW_HSI);
-  while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_HSI) spin(1);
+  if (src == RCC_CFGR_SW_MSI) {
+    RCC->CR |= RCC_CR_MSION;
+    while (!(RCC->CR & RCC_CR_MSIRDY)) spin(1);
+    CLRSET(RCC->CR, RCC_CR_MSIRANGE,
+           ((uint32_t) msi_range << RCC_CR_MSIRANGE_Pos) | RCC_CR_MSIRGSEL);
+  } else {
+    RCC->CR |= RCC_CR_HSION;
+    while (!(RCC->CR & RCC_CR_HSIRDY)) spin(1);
+  }
+  if (src == RCC_CFGR_SW_PLL) {
+    if ((RCC->CFGR & RCC_CFGR_SWS) == RCC_CFGR_SWS_PLL) {
+      CLRSET(RCC->CFGR, RCC_CFGR_SW, RCC_CFGR_SW_HSI);  // Leave PLL first
+      while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_HSI) spin(1);
+    }
+    RCC->CR &= ~RCC_CR_PLLON;
+    while (RCC->CR & RCC_CR_PLLRDY) spin(1);
+    RCC->PLLCFGR = RCC_PLLCFGR_PLLSRC_HSI | RCC_PLLCFGR_PLLREN |
+                   ((uint32_t) pll_n << RCC_PLLCFGR_PLLN_Pos);  // M 1, R 2
+    RCC->CR |= RCC_CR_PLLON;
+    while (!(RCC->CR & RCC_CR_PLLRDY)) spin(1);
+  }
+  // Wake up from STOP on the same oscillator: MSI keeps its range
+  CLRSET(RCC->CFGR, RCC_CFGR_SW | RCC_CFGR_STOPWUCK,
+         src | (src == RCC_CFGR_SW_MSI ? 0 : RCC_CFGR_STOPWUCK));
+  while ((RCC->CFGR & RCC_CFGR_SWS) != ((uint32_t) src << RCC_CFGR_SWS_Pos)) {
+    spin(1);
+  }
+  if (src != RCC_CFGR_SW_PLL) RCC->CR &= ~RCC_CR_PLLON;
+  if (src == RCC_CFGR_SW_MSI) RCC->CR &= ~RCC_CR_HSION;
 
+  if (ws < s_clock.ws) flash_set_ws(ws);
+  if (vos > s_clock.vos && s_clock.vos != 0) pwr_set_vos(vos);
+  s_clock = (struct clock_state) {src, msi_range, pll_n, vos, ws, hz};
+  SystemCoreClock = hz;  // Required by CMSIS
+}
+
+static inline void clock_init(void) {
+  SCB->CPACR |= 15 << 20;  // Enable FPU
+  FLASH->ACR |= FLASH_ACR_ICEN | FLASH_ACR_DCEN;
+  clock_set(RCC_CFGR_SW_HSI, 0, 0, 1, 0, 16000000);  // Until told otherwise
   // rng_init();
   // RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;    // Enable SYSCFG
-  SystemCoreClock = SYS_FREQUENCY;         // Required by CMSIS
-  SysTick_Config(SystemCoreClock / 1000);  // Sys tick every 1ms
+}
+
+// Cycle counter for profiling, see prof.h, and for boot latency: SystemInit()
+// starts it. Counts CPU clock cycles
+static inline void prof_init(void) {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;  // Enable DWT
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+static inline uint32_t prof_cycles(void) {
+  return DWT->CYCCNT;
+}
+
+// Tokenized log strings go to a non-loaded section at address 0, see
+// link.ld, so the address of a string is its offset in that section
+#define LOGSTR_SECTION __attribute__((section(".logstr")))
+#define LOGSTR_ID(s) ((uint32_t) (uintptr_t) (s))
+
+#define irq_disable() __disable_irq()
+#define irq_enable() __enable_irq()
+
+// Tickless timebase on LPTIM1, clocked from the 32.768 kHz LSE crystal.
+// Unlike SysTick, it keeps counting in STOP2. Nothing runs periodically:
+// time is read on demand, and a one-shot compare wakes us up at a deadline.
+// Overflow interrupt fires every 64s, it extends the 16-bit counter
+#define LPTIM_HZ 1024  // LSE / 32
+
+static volatile uint32_t s_lptim_overflows;
+
+// RTC, clocked from LSE too. Unlike LPTIM1, it counts on in Standby, so it
+// times that. Its calendar is never set: it starts at 2000-01-01 on the
+// first power-up, and serves as a counter of milliseconds since then.
+// Prescalers keep their reset values, 128 x 256, which make 1 Hz. Counters
+// are read directly, bypassing shadow registers: these would need a sync
+// after every wake-up. Call with the backup domain unlocked
+static inline void rtc_init(void) {
+  if (RCC->BDCR & RCC_BDCR_RTCEN) return;  // Runs since the first power-up
+  CLRSET(RCC->BDCR, RCC_BDCR_RTCSEL, RCC_BDCR_RTCSEL_0);  // LSE
+  RCC->BDCR |= RCC_BDCR_RTCEN;
+  RCC->APB1ENR1 |= RCC_APB1ENR1_RTCAPBEN;
+  RTC->WPR = 0xca, RTC->WPR = 0x53;  // Unlock RTC registers
+  RTC->CR |= RTC_CR_BYPSHAD;
+  RTC->WPR = 0xff;
+}
+
+#define BCD2BIN(x) (((x) >> 4) * 10U + ((x) & 15))
+#define BIN2BCD(x) ((((x) / 10U) << 4) | ((x) % 10U))
+
+// Milliseconds since the RTC started, at 1/256 s resolution
+static inline uint64_t rtc_ms(void) {
+  static const uint16_t mdays[] = {0,   31,  59,  90,  120, 151,
+                                   181, 212, 243, 273, 304, 334};
+  uint32_t ssr, tr, dr, y, m, days, secs;
+  do {  // Counters tick while we read: read until two reads match
+    ssr = RTC->SSR, tr = RTC->TR, dr = RTC->DR;
+  } while (ssr != RTC->SSR || tr != RTC->TR || dr != RTC->DR);
+  y = BCD2BIN((dr >> 16) & 0xff), m = BCD2BIN((dr >> 8) & 0x1f);
+  days = y * 365 + (y + 3) / 4 + mdays[(m - 1) % 12] +
+         (m > 2 && y % 4 == 0) + BCD2BIN(dr & 0x3f) - 1;
+  secs = days * 86400U + BCD2BIN((tr >> 16) & 0x3f) * 3600U +
+         BCD2BIN((tr >> 8) & 0x7f) * 60U + BCD2BIN(tr & 0x7f);
+  return (uint64_t) secs * 1000 + (255 - (ssr & 255)) * 1000 / 256;
+}
+
+static inline void lptim_init(void) {
+  RCC->APB1ENR1 |= RCC_APB1ENR1_PWREN;
+  PWR->CR1 |= PWR_CR1_DBP;  // Unlock backup domain, then start LSE
+  RCC->BDCR |= RCC_BDCR_LSEON;
+  while (!(RCC->BDCR & RCC_BDCR_LSERDY)) spin(1);
+
+  RCC->APB1ENR1 |= RCC_APB1ENR1_RTCAPBEN;  // For the backup registers
+  rtc_init();
+
+  CLRSET(RCC->CCIPR, RCC_CCIPR_LPTIM1SEL, RCC_CCIPR_LPTIM1SEL);  // LSE
+  RCC->APB1ENR1 |= RCC_APB1ENR1_LPTIM1EN;
+  LPTIM1->CFGR = 5UL << LPTIM_CFGR_PRESC_Pos;         // Prescaler: 32
+  LPTIM1->IER = LPTIM_IER_ARRMIE | LPTIM_IER_CMPMIE;  // Overflow, deadline
+  LPTIM1->CR = LPTIM_CR_ENABLE;
+  LPTIM1->ARR = 0xffff;
+  while (!(LPTIM1->ISR & LPTIM_ISR_ARROK)) spin(1);
+  LPTIM1->ICR = LPTIM_ICR_ARROKCF;
+  LPTIM1->CR |= LPTIM_CR_CNTSTRT;  // Continuous mode
+  EXTI->IMR2 |= EXTI_IMR2_IM32;    // LPTIM1 wakes us from STOP2
+  NVIC_EnableIRQ(LPTIM1_IRQn);
+}
+
+// RTC alarm A and wakeup timer. Both wake us from STOP2 with an interrupt,
+// through EXTI lines 18 and 20, and from Standby with a reset, see
+// cpu_standby(). Alarm A compares the RTC time of day, with the date
+// masked, so it fires every day. The wakeup timer counts seconds, and
+// reloads: the caller turns it off once it fires
+#define RTC_ALARM BIT(0)   // Alarm A fired
+#define RTC_WAKEUP BIT(1)  // Wakeup timer fired
+
+static inline void rtc_alarm_off(void) {
+  RTC->WPR = 0xca, RTC->WPR = 0x53;
+  RTC->CR &= ~(RTC_CR_ALRAE | RTC_CR_ALRAIE);
+  RTC->ISR = ~(RTC_ISR_ALRAF | RTC_ISR_INIT);
+  RTC->WPR = 0xff;
+}
+
+// Fire at the second of the RTC day, and every day after
+static inline void rtc_alarm_set(uint32_t day_s) {
+  RTC->WPR = 0xca, RTC->WPR = 0x53;
+  RTC->CR &= ~(RTC_CR_ALRAE | RTC_CR_ALRAIE);
+  while (!(RTC->ISR & RTC_ISR_ALRAWF)) spin(1);
+  RTC->ALRMAR = RTC_ALRMAR_MSK4 |  // Any date
+                BIN2BCD(day_s / 3600) << RTC_ALRMAR_HU_Pos |
+                BIN2BCD(day_s / 60 % 60) << RTC_ALRMAR_MNU_Pos |
+                BIN2BCD(day_s % 60) << RTC_ALRMAR_SU_Pos;
+  RTC->ALRMASSR = 0;  // Subseconds are not compared
+  RTC->ISR = ~(RTC_ISR_ALRAF | RTC_ISR_INIT);
+  RTC->CR |= RTC_CR_ALRAE | RTC_CR_ALRAIE;
+  RTC->WPR = 0xff;
+  EXTI->IMR1 |= EXTI_IMR1_IM18, EXTI->RTSR1 |= EXTI_RTSR1_RT18;
+  NVIC_EnableIRQ(RTC_Alarm_IRQn);
+}
+
+static inline void rtc_wakeup_off(void) {
+  RTC->WPR = 0xca, RTC->WPR = 0x53;
+  RTC->CR &= ~(RTC_CR_WUTE | RTC_CR_WUTIE);
+  RTC->ISR = ~(RTC_ISR_WUTF | RTC_ISR_INIT);
+  RTC->WPR = 0xff;
+}
+
+// Fire in sec seconds, 1 .. 65536, and every sec seconds after
+static inline void rtc_wakeup_set(uint32_t sec) {
+  RTC->WPR = 0xca, RTC->WPR = 0x53;
+  RTC->CR &= ~(RTC_CR_WUTE | RTC_CR_WUTIE);
+  while (!(RTC->ISR & RTC_ISR_WUTWF)) spin(1);
+  RTC->WUTR = sec - 1;
+  CLRSET(RTC->CR, RTC_CR_WUCKSEL, RTC_CR_WUCKSEL_2);  // ck_spre, 1 Hz
+  RTC->ISR = ~(RTC_ISR_WUTF | RTC_ISR_INIT);
+  RTC->CR |= RTC_CR_WUTE | RTC_CR_WUTIE;
+  RTC->WPR = 0xff;
+  EXTI->IMR1 |= EXTI_IMR1_IM20, EXTI->RTSR1 |= EXTI_RTSR1_RT20;
+  NVIC_EnableIRQ(RTC_WKUP_IRQn);
+}
+
+// Take fired flags: RTC_ALARM, RTC_WAKEUP. From the interrupt handlers, and
+// on boot, after a wake-up from Standby. Like all RTC registers, ISR is in
+// the backup domain: writes are ignored until standby_wakeup() unlocks it
+static inline unsigned rtc_fired(void) {
+  uint32_t isr = RTC->ISR & (RTC_ISR_ALRAF | RTC_ISR_WUTF);
+  RTC->ISR = ~(isr | RTC_ISR_INIT);
+  EXTI->PR1 = EXTI_PR1_PIF18 | EXTI_PR1_PIF20;
+  return (isr & RTC_ISR_ALRAF ? RTC_ALARM : 0U) |
+         (isr & RTC_ISR_WUTF ? RTC_WAKEUP : 0U);
+}
+
+// RTC backup registers, 32 words. They keep their values over a reset, and
+// are lost only with power. standby_wakeup() unlocks them
+static inline uint32_t bkp_read(unsigned i) {
+  return (&RTC->BKP0R)[i];
+}
+static inline void bkp_write(unsigned i, uint32_t val) {
+  (&RTC->BKP0R)[i] = val;
+}
+
+// Overflow is flagged when the counter reaches 0xffff, so we count ticks
+// as (CNT + 1): it wraps to 0 exactly when the overflow flag is set
+static inline uint16_t lptim_count(void) {
+  uint32_t a, b;  // Counter runs asynchronously: read until two reads match
+  do a = LPTIM1->CNT, b = LPTIM1->CNT;
+  while (a != b);
+  return (uint16_t) (a + 1);
+}
+
+static inline bool lptim_overflow_pending(void) {
+  return LPTIM1->ISR & LPTIM_ISR_ARRM;
+}
+
+void LPTIM1_IRQHandler(void) {
+  uint32_t isr = LPTIM1->ISR;
+  if (isr & LPTIM_ISR_ARRM) s_lptim_overflows++;
+  LPTIM1->ICR = isr & (LPTIM_ICR_ARRMCF | LPTIM_ICR_CMPMCF);
+}
+
+// Lock-free, works with interrupts disabled too. See mono.h
+static inline uint64_t lptim_ticks(void) {
+  return mono_ticks(&s_lptim_overflows, lptim_count, lptim_overflow_pending);
+}
+
+static inline uint64_t now_ms(void) {  // Milliseconds since boot
+  return lptim_ticks() * 1000 / LPTIM_HZ;  // Divisor is a power of two
+}
+
+static inline void delay_ms(uint32_t milliseconds) {
+  uint32_t expire = (uint32_t) now_ms() + milliseconds;
+  while (!deadline_passed(expire, (uint32_t) now_ms())) spin(1);
+}
+
+// Program a wake-up at the given time. If it is more than 64s away, the
+// overflow IRQ wakes us earlier, and the caller re-arms. Return false if the
+// deadline is too close to sleep safely: the caller should not go to sleep
+static inline bool timebase_set_alarm(uint64_t ms) {
+  uint64_t ticks, now = lptim_ticks();
+  if (ms >= UINT64_MAX / LPTIM_HZ) return true;  // No deadline
+  ticks = (ms * LPTIM_HZ + 999) / 1000;
+  if (ticks <= now + 2) return false;  // Compare write takes ~2 LSE ticks
+  if (ticks - now <= 0xffff) {
+    LPTIM1->ICR = LPTIM_ICR_CMPOKCF;
+    LPTIM1->CMP = (uint16_t) (ticks - 1);  // Matches when CNT + 1 == ticks
+    while (!(LPTIM1->ISR & LPTIM_ISR_CMPOK)) spin(1);
+  }
+  return lptim_ticks() < ticks;
+}
+
+// Enter low-power mode until the next interrupt. Call with interrupts
+// disabled: a pending IRQ still wakes the core, and runs after irq_enable().
+// Light sleep is WFI, peripheral clocks keep running. Deep sleep is STOP2:
+// only EXTI and LPTIM1 can wake us up
+static inline void cpu_sleep(bool deep) {
+  if (deep) {
+    CLRSET(PWR->CR1, PWR_CR1_LPMS, PWR_CR1_LPMS_STOP2);
+    SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+  }
+  __DSB();
+  __WFI();
+  if (deep) {
+    SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+    if (s_clock.src != RCC_CFGR_SW_MSI) {  // Woke up on HSI, see STOPWUCK
+      clock_set(s_clock.src, s_clock.msi_range, s_clock.pll_n, s_clock.vos,
+                s_clock.ws, s_clock.hz);
+    }
+  }
+}
+
+// Standby: all is off but the backup domain, that is LSE, RTC and backup
+// registers. RAM and peripheral registers are lost. The button, on the
+// WKUP4 pin PA2, wakes us up, and so do the RTC alarm and wakeup timer,
+// through the internal wake-up line. Wake-up is a reset: SystemInit() and
+// setup() run again, and standby_wakeup() and rtc_fired() tell why. Call
+// with interrupts disabled. Returns only if an interrupt is pending, like
+// cpu_sleep()
+static inline void cpu_standby(void) {
+  LPTIM1->ICR = LPTIM_ICR_ARRMCF | LPTIM_ICR_CMPMCF;  // Stops there anyway
+  NVIC_ClearPendingIRQ(LPTIM1_IRQn);
+  PWR->CR4 |= PWR_CR4_WP4;  // Falling edge: the button pulls the pin low
+  PWR->CR3 |= PWR_CR3_EWUP4 | PWR_CR3_EIWF;  // Button, and RTC
+  PWR->SCR = PWR_SCR_CWUF;  // A wake-up flag left set would wake us at once
+  CLRSET(PWR->CR1, PWR_CR1_LPMS, PWR_CR1_LPMS_STANDBY);
+  SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+  __DSB();
+  __WFI();
+  SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+}
+
+// True if this boot is a wake-up from Standby. Runs first thing after
+// reset, so it also clocks the PWR and RTC registers, and backup registers,
+// and unlocks the backup domain: a reset, Standby exit too, locks it
+static inline bool standby_wakeup(void) {
+  RCC->APB1ENR1 |= RCC_APB1ENR1_PWREN | RCC_APB1ENR1_RTCAPBEN;
+  PWR->CR1 |= PWR_CR1_DBP;
+  return PWR->SR1 & PWR_SR1_SBF;
+}
+
+static inline void standby_clear(void) {  // Next reset is not a wake-up
+  PWR->SCR = PWR_SCR_CSBF | PWR_SCR_CWUF;
+}
+
+// Clock at reset, and at wake-up from Standby: MSI 4 MHz. Before setup()
+// switches clocks, prof_cycles() counts at that rate
+#define BOOT_HZ 4000000
+
+// LED PWM: TIM2 paces DMA transfers of precomputed BSRR words into GPIO
+// banks, so LEDs are duty-cycled with no CPU involvement. Every slot, the
+// update event copies the next word into GPIOA (DMA1 channel 2), and the
+// compare 1 event right after it copies one into GPIOB (DMA1 channel 5).
+// Buffers are read in circles. Runs in Sleep mode, but not in STOP2
+static inline void dma_to_bsrr(DMA_Channel_TypeDef *ch, const uint32_t *buf,
+                               uint16_t len, GPIO_TypeDef *gpio) {
+  ch->CCR = 0;
+  ch->CNDTR = len;
+  ch->CPAR = (uint32_t) &gpio->BSRR;
+  ch->CMAR = (uint32_t) buf;
+  ch->CCR = DMA_CCR_DIR | DMA_CCR_CIRC | DMA_CCR_MINC | DMA_CCR_PSIZE_1 |
+            DMA_CCR_MSIZE_1 | DMA_CCR_EN;  // Memory to GPIO, 32-bit words
+}
+
+static inline void pwm_stop(void) {
+  TIM2->CR1 = 0;
+  TIM2->DIER = 0;
+  DMA1_Channel2->CCR = 0;
+  DMA1_Channel5->CCR = 0;
+}
+
+static inline bool pwm_active(void) {
+  return TIM2->CR1 & TIM_CR1_CEN;
+}
+
+// Start feeding buffers a and b, of len words, to GPIOA and GPIOB,
+// one word per slot, slot_hz slots per second. Restarts if running
+static inline void pwm_start(const uint32_t *a, const uint32_t *b,
+                             uint16_t len, uint32_t slot_hz) {
+  RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+  RCC->APB1ENR1 |= RCC_APB1ENR1_TIM2EN;
+  pwm_stop();
+  CLRSET(DMA1_CSELR->CSELR, DMA_CSELR_C2S | DMA_CSELR_C5S,
+         (4UL << DMA_CSELR_C2S_Pos) | (4UL << DMA_CSELR_C5S_Pos));  // TIM2
+  dma_to_bsrr(DMA1_Channel2, a, len, GPIOA);
+  dma_to_bsrr(DMA1_Channel5, b, len, GPIOB);
+  TIM2->PSC = 0;
+  TIM2->ARR = SystemCoreClock / slot_hz - 1;
+  TIM2->CCR1 = 0;
+  TIM2->CNT = 0;
+  TIM2->DIER = TIM_DIER_UDE | TIM_DIER_CC1DE;  // DMA requests, no IRQs
+  TIM2->CR1 = TIM_CR1_CEN;
+}
+
+// VDD measurement: ADC1 reads VREFINT, channel 0, see power.h. The ADC is
+// powered up for one conversion, from HCLK, and powered down again, so it
+// costs nothing in between. Takes about 100 us at 2 MHz, most of it the
+// calibration. VREFINT_CAL is the reading at 3.0 V, taken in the factory
+#define VREFINT_CAL (*(const uint16_t *) 0x1fff75aaUL)
+
+static inline uint16_t adc_vrefint(void) {
+  uint16_t raw;
+  RCC->AHB2ENR |= RCC_AHB2ENR_ADCEN;
+  ADC1_COMMON->CCR = ADC_CCR_CKMODE_0 | ADC_CCR_VREFEN;  // HCLK / 1
+  ADC1->CR = ADC_CR_ADVREGEN;      // Out of deep power down
+  spin(SystemCoreClock / 100000);  // Regulator start-up: 20 us
+  ADC1->CR |= ADC_CR_ADCAL;
+  while (ADC1->CR & ADC_CR_ADCAL) spin(1);
+  ADC1->ISR = ADC_ISR_ADRDY;
+  ADC1->CR |= ADC_CR_ADEN;
+  while (!(ADC1->ISR & ADC_ISR_ADRDY)) spin(1);
+  ADC1->SMPR1 = 4UL << ADC_SMPR1_SMP0_Pos;  // 47.5 clocks: VREFINT needs 4 us
+  ADC1->SQR1 = 0;                           // One conversion, channel 0
+  ADC1->CR |= ADC_CR_ADSTART;
+  while (!(ADC1->ISR & ADC_ISR_EOC)) spin(1);
+  raw = (uint16_t) ADC1->DR;
+  ADC1->CR |= ADC_CR_ADDIS;
+  while (ADC1->CR & ADC_CR_ADEN) spin(1);
+  ADC1->CR = ADC_CR_DEEPPWD;
+  ADC1_COMMON->CCR = 0;
+  RCC->AHB2ENR &= ~RCC_AHB2ENR_ADCEN;
+  return raw;
 }
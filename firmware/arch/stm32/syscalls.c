@@ -6,18 +6,6 @@ int _fstat(int fd, struct stat *st) {
   return 0;
 }
 
-extern unsigned char _end[];
-unsigned char *_current_heap_end = _end;
-
-void *_sbrk(int incr) {
-  unsigned char *heap_end = (unsigned char *) ((size_t) &heap_end - 256);
-  unsigned char *prev_heap = _current_heap_end;
-  // Check how much space we  got from the heap end to the stack end
-  if (_current_heap_end + incr > heap_end) return (void *) -1;
-  _current_heap_end += incr;
-  return prev_heap;
-}
-
 int _open(const char *path) {
   (void) path;
   return -1;
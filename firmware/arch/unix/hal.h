@@ -1,11 +1,15 @@
 #pragma once
 
 #include <assert.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "../../mono.h"
 
 #define UNIX 1
 #define USART1 NULL
@@ -19,25 +23,328 @@
 // No-op HAL API implementation for a device with GPIO and UART
 #define hal_init()
 #define clock_init()
-#define ram_free() (long) 0
-#define ram_used() (long) 0
-#define stack_used() (long) 0
-#define stack_fill()
 #define spin(x) ((void) 0)
-#define attach_external_irq(pin)
+#define lptim_init()
+#define irq_disable()
+#define irq_enable()
+
+// Simulating RAM above .bss, where the stack grows down from the top.
+// Tests move the stack pointer, and write to the stack, see mem.h
+#define RAM_WORDS 2048
+static uint32_t g_ram[RAM_WORDS];
+static uint32_t *g_sp = g_ram + RAM_WORDS - 64;  // Stack pointer
+#define NOINIT
+
+static inline uint32_t *ram_end(void) {
+  return g_ram;
+}
+static inline uint32_t *stack_top(void) {
+  return g_ram + RAM_WORDS;
+}
+static inline uint32_t *stack_sp(void) {
+  return g_sp;
+}
+static inline void stack_fill(void) {
+  for (uint32_t *p = g_ram; p < g_sp; p++) *p = 0xa5a5a5a5;
+}
+
+// Simulating MPU guard and reset: remember what firmware asked for
+static struct mpu_mock {
+  void *base;
+  uint32_t size;
+} g_mpu;
+static unsigned g_resets;
+static uint32_t g_bkp[32];  // RTC backup registers, survive resets
+
+static inline void mpu_guard(void *base, uint32_t size) {
+  g_mpu.base = base, g_mpu.size = size;
+}
+static inline void cpu_reset(void) {
+  g_resets++;
+}
+// Simulating flash pages of the key/value store. Erased bytes read 0xff,
+// and a double word can only be written once after an erase. Tests can cut
+// the power after a number of bytes: what is being erased or written is
+// left half done, and everything fails from then on. The double word it
+// was cut in fails ECC, like it may on the device: it does not read until
+// erased. Tests can also make one fail
+#define FLASH_PAGE_SIZE 2048
+#define FLASH_KV_PAGES 4
+static struct flash_mock {
+  uint8_t mem[FLASH_KV_PAGES * FLASH_PAGE_SIZE];
+  long budget;                       // Bytes until power is cut. -1: never
+  unsigned erases[FLASH_KV_PAGES];  // Erase count, by page
+  unsigned writes;                   // Double words written
+  bool ecc[FLASH_KV_PAGES * FLASH_PAGE_SIZE / 8];  // Fails ECC, by dword
+} g_flash = {.budget = -1};
+
+static inline uint8_t *flash_kv_base(void) {
+  return g_flash.mem;
+}
+static inline unsigned flash_kv_pages(void) {
+  return FLASH_KV_PAGES;
+}
+
+static inline bool flash_power(void) {  // Take one byte off the budget
+  if (g_flash.budget == 0) return false;
+  if (g_flash.budget > 0) g_flash.budget--;
+  return true;
+}
+
+static inline bool flash_erase(void *page) {
+  size_t ofs = (size_t) ((uint8_t *) page - g_flash.mem);
+  assert(ofs % FLASH_PAGE_SIZE == 0 && ofs < sizeof(g_flash.mem));
+  g_flash.erases[ofs / FLASH_PAGE_SIZE]++;
+  for (size_t i = 0; i < FLASH_PAGE_SIZE; i++) {
+    if (!flash_power()) return g_flash.ecc[(ofs + i) / 8] = true, false;
+    g_flash.mem[ofs + i] = 0xff;
+    if (i % 8 == 7) g_flash.ecc[(ofs + i) / 8] = false;
+  }
+  return true;
+}
+
+static inline bool flash_write(void *addr, const void *buf, size_t len) {
+  size_t ofs = (size_t) ((uint8_t *) addr - g_flash.mem);
+  assert(ofs % 8 == 0 && len % 8 == 0 && ofs + len <= sizeof(g_flash.mem));
+  for (size_t i = 0; i < len; i++) {
+    assert(g_flash.mem[ofs + i] == 0xff);  // Written twice: PROGERR
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (!flash_power()) return g_flash.ecc[(ofs + i) / 8] = true, false;
+    g_flash.mem[ofs + i] = ((const uint8_t *) buf)[i];
+    if (i % 8 == 7) g_flash.writes++;
+  }
+  return true;
+}
+
+static inline bool flash_read(const void *addr, void *buf, size_t len) {
+  size_t ofs = (size_t) ((const uint8_t *) addr - g_flash.mem);
+  assert(ofs + len <= sizeof(g_flash.mem));
+  memcpy(buf, addr, len);
+  for (size_t i = ofs / 8; i * 8 < ofs + len; i++) {
+    if (g_flash.ecc[i]) return false;
+  }
+  return true;
+}
+
+static inline uint32_t bkp_read(unsigned i) {
+  return g_bkp[i];
+}
+static inline void bkp_write(unsigned i, uint32_t val) {
+  g_bkp[i] = val;
+}
+
+// Store to the simulated stack. A store into the guard faults, like on the
+// device: the fault handler gets a data access violation with its address
+void fault_handler(uint32_t pc, uint32_t lr, uint32_t sp, uint32_t cfsr,
+                   uint32_t addr);
+static inline void stack_write(uint32_t *p, uint32_t val) {
+  uint8_t *b = (uint8_t *) p, *guard = (uint8_t *) g_mpu.base;
+  if (guard != NULL && b >= guard && b < guard + g_mpu.size) {
+    fault_handler(0, 0, (uint32_t) (uintptr_t) g_sp, 0x82,  // MMARVALID
+                  (uint32_t) (uintptr_t) p);                // DACCVIOL
+  } else {
+    *p = val;
+  }
+}
+
+// Profiling clock, see prof.h. Host nanoseconds instead of CPU cycles,
+// counted from prof_init(), like DWT CYCCNT is
+#define BOOT_HZ 1000000000
+static uint32_t g_prof_origin;
+
+static inline uint32_t prof_cycles(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t) ((uint64_t) ts.tv_sec * 1000000000U +
+                     (uint64_t) ts.tv_nsec) -
+         g_prof_origin;
+}
+static inline void prof_init(void) {
+  g_prof_origin += prof_cycles();
+}
+
+// Tokenized log strings. Linker provides section start and stop symbols
+extern const char __start_logstr[], __stop_logstr[];
+#define LOGSTR_SECTION __attribute__((section("logstr"), used))
+#define LOGSTR_ID(s) ((uint32_t) ((s) - __start_logstr))
 
 #define gpio_output(pin)
-#define gpio_input(pin)
+#define gpio_output_bank(bank, pins)
 #define gpio_toggle(pin)
 
-extern volatile uint64_t g_ticks;  // Milliseconds since boot
+// Simulating tickless timebase: virtual time only moves when tests move it.
+// Like LPTIM, it is read as a 16-bit counter extended by an overflow count,
+// see mono.h. One millisecond per tick
+static uint64_t s_now;                 // Milliseconds since boot
+static uint64_t s_alarm = UINT64_MAX;  // Next wake-up time
+static volatile uint32_t s_overflows;  // Counted by the overflow interrupt
+static void (*g_time_irq)(void);  // If set, interrupts the next time read
+
+static inline void timebase_irq(void) {  // Overflow interrupt handler
+  s_overflows = (uint32_t) (s_now >> 16);
+}
+
+static inline uint16_t timebase_count(void) {
+  void (*fn)(void) = g_time_irq;
+  g_time_irq = NULL;
+  if (fn != NULL) fn();  // Between overflow count and counter reads
+  return (uint16_t) s_now;
+}
+
+static inline bool timebase_pending(void) {
+  return (uint32_t) (s_now >> 16) != s_overflows;
+}
+
+static inline uint64_t now_ms(void) {
+  return mono_ticks(&s_overflows, timebase_count, timebase_pending);
+}
+
+static inline void delay_ms(uint32_t milliseconds) {
+  s_now += milliseconds;  // Simulate that wait time has expired
+  timebase_irq();
+}
+
+static inline bool timebase_set_alarm(uint64_t ms) {
+  s_alarm = ms;
+  return ms > s_now;
+}
+
+static inline void time_set(uint64_t ms) {
+  s_now = ms;
+  timebase_irq();
+}
+
+static inline void time_advance(uint64_t ms) {
+  s_now += ms;
+  timebase_irq();
+}
+
+// Jump straight to the programmed deadline, like LPTIM compare would wake us
+static inline uint64_t time_jump(void) {
+  if (s_alarm != UINT64_MAX && s_alarm > s_now) s_now = s_alarm;
+  timebase_irq();
+  return s_now;
+}
+
+// RTC counts on in Standby, where LPTIM stops. Here both count virtual time
+static inline uint64_t rtc_ms(void) {
+  return s_now;
+}
+
+// Simulating RTC alarm A and wakeup timer, in the same virtual time. Like
+// on the device, flags are set when the time comes, whether anyone looks or
+// not. Nothing runs by itself: tests jump to rtc_next(), then run the
+// interrupt handler, or boot if in Standby, see cpu_standby()
+#define RTC_ALARM BIT(0)   // Alarm A fired
+#define RTC_WAKEUP BIT(1)  // Wakeup timer fired
+#define RTC_DAY_MS 86400000ULL
+
+static struct rtc_mock {
+  uint64_t alarm;   // Next alarm A match, or UINT64_MAX if off
+  uint64_t wakeup;  // Next wakeup timer expiry, or UINT64_MAX if off
+  uint64_t period;  // Wakeup timer period, ms
+} g_rtc = {UINT64_MAX, UINT64_MAX, 0};
+
+static inline void rtc_alarm_set(uint32_t day_s) {  // Second of the RTC day
+  g_rtc.alarm = s_now - s_now % RTC_DAY_MS + day_s * 1000ULL;
+  if (g_rtc.alarm <= s_now) g_rtc.alarm += RTC_DAY_MS;
+}
+static inline void rtc_alarm_off(void) {
+  g_rtc.alarm = UINT64_MAX;
+}
+static inline void rtc_wakeup_set(uint32_t sec) {
+  g_rtc.period = sec * 1000ULL, g_rtc.wakeup = s_now + g_rtc.period;
+}
+static inline void rtc_wakeup_off(void) {
+  g_rtc.wakeup = UINT64_MAX;
+}
+
+static inline unsigned rtc_pending(void) {  // Flags set by now
+  return (g_rtc.alarm <= s_now ? RTC_ALARM : 0U) |
+         (g_rtc.wakeup <= s_now ? RTC_WAKEUP : 0U);
+}
+static inline unsigned rtc_fired(void) {  // Take flags. Both reload
+  unsigned fired = rtc_pending();
+  while (g_rtc.alarm <= s_now) g_rtc.alarm += RTC_DAY_MS;
+  while (g_rtc.wakeup <= s_now) g_rtc.wakeup += g_rtc.period;
+  return fired;
+}
+static inline uint64_t rtc_next(void) {  // Next time a flag is set
+  return g_rtc.alarm < g_rtc.wakeup ? g_rtc.alarm : g_rtc.wakeup;
+}
+
+// Simulating the coin cell, and the ADC that reads VREFINT against it, see
+// power.h. VDD follows a discharge curve: mV by charge used, in per mille
+// of the capacity, straight lines in between. Tests and the simulator set
+// the charge used, or another curve
+#define VREFINT_CAL 1655  // Reading at 3.0 V: 1.212 V of 4095 steps
+
+static const uint16_t g_cr2032[][2] = {  // At a light load, room temperature
+    {0, 3000},   {50, 2950},  {700, 2850}, {850, 2750},
+    {920, 2600}, {960, 2450}, {1000, 2000}};
 
-static inline void delay_ms(uint64_t milliseconds) {
-  g_ticks += milliseconds;  // Simulate that wait time has expired
+static struct battery {
+  const uint16_t (*curve)[2];  // Charge used, VDD: rising, falling
+  size_t len;                  // Number of curve points
+  unsigned used;               // Charge used, per mille
+  unsigned reads;              // Number of adc_vrefint() calls
+} g_battery = {g_cr2032, sizeof(g_cr2032) / sizeof(g_cr2032[0]), 0, 0};
+
+static inline uint16_t battery_mv(void) {  // VDD now
+  const uint16_t(*c)[2] = g_battery.curve;
+  unsigned u = g_battery.used;
+  size_t i = 1;
+  while (i + 1 < g_battery.len && c[i][0] < u) i++;
+  if (u >= c[i][0]) return c[i][1];
+  if (u <= c[i - 1][0]) return c[i - 1][1];
+  return (uint16_t) (c[i - 1][1] - (c[i - 1][1] - c[i][1]) *
+                                       (u - c[i - 1][0]) /
+                                       (c[i][0] - c[i - 1][0]));
+}
+
+static inline uint16_t adc_vrefint(void) {
+  g_battery.reads++;
+  return (uint16_t) ((VREFINT_CAL * 3000U + battery_mv() / 2) / battery_mv());
+}
+
+// Simulating sleep: count how many times firmware went to light or deep sleep
+static struct sleeps {
+  unsigned light, deep;
+} g_sleeps;
+
+// Simulating Standby. Nothing wakes the firmware up but the button and the
+// RTC, and that is a reset: tests drive the pin, or jump to the RTC event,
+// then call SystemInit() and setup() while the standby flag is set. RAM is
+// not lost, unlike on the device
+static struct standby_mock {
+  bool sbf;          // Standby flag, firmware clears it on boot
+  unsigned entries;  // Number of cpu_standby() calls
+} g_standby;
+
+static inline void cpu_standby(void) {
+  g_standby.sbf = true;
+  g_standby.entries++;
+  s_alarm = UINT64_MAX;
+}
+static inline bool standby_wakeup(void) {
+  return g_standby.sbf;
+}
+static inline void standby_clear(void) {
+  g_standby.sbf = false;
+}
+
+static inline void cpu_sleep(bool deep) {
+  if (deep) {
+    g_sleeps.deep++;
+  } else {
+    g_sleeps.light++;
+  }
 }
 
 // Simulating pins
-static bool g_pins[10][15];
+static bool g_pins[10][16];
+static unsigned g_bank_writes;  // Number of gpio_write_bank() calls
 
 static inline bool gpio_read(uint16_t pin) {
   return g_pins[PINBANK(pin)][PINNO(pin)];
@@ -47,25 +354,168 @@ static inline void gpio_write(uint16_t pin, bool val) {
   g_pins[PINBANK(pin)][PINNO(pin)] = val;
 }
 
+static inline void gpio_write_bank(uint8_t bank, uint32_t bsrr) {
+  for (int i = 0; i < 16; i++) {
+    if (bsrr & BIT(i)) {
+      g_pins[bank][i] = true;  // Like BSRR, set takes priority over reset
+    } else if (bsrr & BIT(i + 16)) {
+      g_pins[bank][i] = false;
+    }
+  }
+  g_bank_writes++;
+}
+
+// LED PWM. Remember DMA buffers, so tests can replay the waveform. Like the
+// first DMA transfers, starting writes slot 0 to the pins. The timer that
+// paces slots runs from the CPU clock, which must be set by then
+extern uint32_t SystemCoreClock;
+static struct pwm_mock {
+  const uint32_t *bufs[2];  // GPIOA and GPIOB BSRR words
+  uint16_t len;             // Slots per period
+  uint32_t slot_hz;         // Slots per second
+  bool active;
+} g_pwm;
+
+static inline void pwm_start(const uint32_t *a, const uint32_t *b,
+                             uint16_t len, uint32_t slot_hz) {
+  assert(SystemCoreClock != 0);
+  g_pwm = (struct pwm_mock) {{a, b}, len, slot_hz, true};
+  gpio_write_bank(0, a[0]), gpio_write_bank(1, b[0]);
+}
+static inline void pwm_stop(void) {
+  g_pwm.active = false;
+}
+static inline bool pwm_active(void) {
+  return g_pwm.active;
+}
+
+// Replay DMA transfers of one PWM slot onto the pins
+static inline void pwm_replay(uint16_t slot) {
+  gpio_write_bank(0, g_pwm.bufs[0][slot]);
+  gpio_write_bank(1, g_pwm.bufs[1][slot]);
+}
+
+// Simulating clock switches. Remember the last operating point, see clock.h
+static struct clock_mock {
+  uint8_t src, msi_range, pll_n, vos, ws;
+  uint32_t hz;
+  unsigned switches;  // Number of clock_set() calls
+} g_clock;
+
+static inline void clock_set(uint8_t src, uint8_t msi_range, uint8_t pll_n,
+                             uint8_t vos, uint8_t ws, uint32_t hz) {
+  unsigned switches = g_clock.switches + 1;
+  g_clock = (struct clock_mock) {src, msi_range, pll_n, vos, ws, hz, switches};
+  SystemCoreClock = hz;
+}
+
 #define uart_init(uart, baud)
-#define uart_read_ready(uart) 0
 #define uart_write_byte(uart, ch)
 
 static inline void uart_write_buf(void *uart, void *buf, size_t len) {
   (void) uart, (void) buf, (void) len;
 }
 
+// Simulating UART. Sent bytes are captured for inspection, received bytes
+// are given by tests. Tests call the UART IRQ handler to simulate the
+// interrupt, and can stall the line to check that the firmware does not
+// wait for it
+static struct uart_mock {
+  char out[4096];     // Captured output
+  size_t len;         // Captured output length
+  bool stalled;       // If true, transmitter never becomes ready
+  bool txe, tc;       // Enabled interrupts
+  unsigned polls;     // Number of times firmware checked for readiness
+  const uint8_t *rx;  // Bytes to receive
+  size_t rx_len;      // Number of bytes to receive
+  bool rxne;          // Receive interrupt enabled
+  uint16_t brr;       // Baud rate divider
+} g_uart;
+
+static inline void uart_set_brr(void *uart, uint16_t brr) {
+  (void) uart;
+  g_uart.brr = brr;
+}
+
+static inline bool uart_read_ready(void *uart) {
+  (void) uart;
+  return g_uart.rx_len > 0;
+}
+
+static inline uint8_t uart_read_byte(void *uart) {
+  (void) uart;
+  g_uart.rx_len--;
+  return *g_uart.rx++;
+}
+
+static inline bool uart_tx_ready(void *uart) {
+  (void) uart;
+  g_uart.polls++;
+  return !g_uart.stalled;
+}
+
+static inline bool uart_tx_done(void *uart) {
+  (void) uart;
+  return !g_uart.stalled;
+}
+
+static inline void uart_tx_byte(void *uart, uint8_t byte) {
+  (void) uart;
+  if (g_uart.len < sizeof(g_uart.out) - 1) g_uart.out[g_uart.len++] = byte;
+}
+
+static inline void uart_tx_irq(void *uart, bool txe, bool tc) {
+  (void) uart;
+  g_uart.txe = txe, g_uart.tc = tc;
+}
+
+static inline void uart_rx_irq(void *uart, bool on) {
+  (void) uart;
+  g_uart.rxne = on;
+}
+
 static struct exti {
-  volatile uint32_t PR1;
+  volatile uint32_t PR1, IMR1;
 } g_exti;
 struct exti *EXTI = &g_exti;
 
-// t: expiration time, prd: period, now: current time. Return true if expired
-static inline bool timer_expired(volatile uint64_t *t, uint64_t prd,
-                                 uint64_t now) {
-  if (now + prd < *t) *t = 0;                    // Time wrapped? Reset timer
-  if (*t == 0) *t = now + prd;                   // Firt poll? Set expiration
-  if (*t > now) return false;                    // Not expired yet, return
-  *t = (now - *t) > prd ? now + prd : *t + prd;  // Next expiration time
-  return true;                                   // Expired, return true
+static inline void attach_external_irq(uint16_t pin) {  // On both edges
+  EXTI->IMR1 |= BIT(PINNO(pin));
+}
+
+static inline void exti_enable(uint16_t pin, bool on) {
+  if (on) {
+    EXTI->IMR1 |= BIT(PINNO(pin));
+  } else {
+    EXTI->IMR1 &= ~BIT(PINNO(pin));
+  }
+}
+
+// Simulated inputs idle high, like a button with a pull-up, unless they are
+// driven from outside
+static uint16_t g_driven[10];  // Pins driven by gpio_drive(), by bank
+
+static inline void gpio_input(uint16_t pin) {
+  if (!(g_driven[PINBANK(pin)] & BIT(PINNO(pin)))) {
+    g_pins[PINBANK(pin)][PINNO(pin)] = true;
+  }
+}
+
+// Drive an input pin from outside. Return true if that raises the pin's
+// interrupt: the level changed, and the line is not masked
+static inline bool gpio_drive(uint16_t pin, bool level) {
+  bool edge = g_pins[PINBANK(pin)][PINNO(pin)] != level;
+  g_driven[PINBANK(pin)] |= (uint16_t) BIT(PINNO(pin));
+  g_pins[PINBANK(pin)][PINNO(pin)] = level;
+  return edge && (EXTI->IMR1 & BIT(PINNO(pin)));
+}
+
+// t: expiration time, prd: period, now: current time, all 32-bit
+// milliseconds, see mono.h. Return true if expired
+static inline bool timer_expired(volatile uint32_t *t, uint32_t prd,
+                                 uint32_t now) {
+  if (*t == 0) *t = now + prd;                  // Firt poll? Set expiration
+  if (!deadline_passed(*t, now)) return false;  // Not expired yet, return
+  *t = elapsed(*t, now) > prd ? now + prd : *t + prd;  // Next expiration
+  return true;                                         // Expired
 }
@@ -0,0 +1,222 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Trace replayer. Feeds event traces captured on the watch, see trace.h,
+// to the firmware in virtual time, and checks that it reaches the same
+// states and LED masks, no later than it did. Button interrupts, debounced
+// levels, boots and clock settings are the input, and the simulated RTC
+// fires alarms and countdowns set on the way. States and LED masks are
+// compared in order, by value and by time. So a trace of a press that was
+// misread on the wrist becomes a regression test:
+//
+//   ./timesync /dev/cu.usbserial-0001 trace=arch/unix/traces/name.trace
+//   make replay  # Replay all of arch/unix/traces
+//
+// The watch boots at time 0, and is idle in Standby when the trace starts.
+// Time of day and settings are those the trace was dumped with
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../../watch.c"
+
+#define MAX_RECORDS 1024
+#define START_MS (STANDBY_IDLE_MS + 60000)  // Trace time 0, in virtual time
+#define SLACK_MS 1  // Replay may lag that much: device times are truncated
+
+struct rec {
+  uint64_t time;  // Virtual time
+  unsigned type;
+  uint32_t value;
+};
+
+static struct rec s_in[MAX_RECORDS];   // Captured
+static struct rec s_out[MAX_RECORDS];  // Replayed states and LED masks
+static size_t s_nin, s_nout;
+static unsigned s_seen;  // Firmware trace records taken so far
+
+static bool output(unsigned type) {  // Compared, rather than fed in
+  return type == TRACE_STATE || type == TRACE_LEDS;
+}
+
+static void collect(void) {  // Take new firmware trace records
+  for (; s_seen != trace_end(&s_trace); s_seen++) {
+    const struct trace_rec *r = trace_get(&s_trace, s_seen);
+    if (output(r->type) && s_nout < MAX_RECORDS) {
+      s_out[s_nout++] = (struct rec) {r->time, r->type, r->value};
+    }
+  }
+}
+
+// Run firmware until it sleeps, and send log output
+static void step(void) {
+  do {
+    loop();
+    while (g_uart.txe || g_uart.tc) {
+      while (g_uart.txe || g_uart.tc) USART1_IRQHandler();
+      loop();
+    }
+    g_uart.len = 0;
+    collect();
+  } while (s_alarm <= now_ms());
+}
+
+static void boot(void) {  // Reset, and set up
+  SystemInit();
+  setup();
+  step();
+}
+
+// Deadlines and RTC events before t, then time is t. The RTC fires as it
+// did on the watch, once the same alarm or countdown is set
+static void run_until(uint64_t t) {
+  for (;;) {
+    uint64_t next = s_alarm > now_ms() ? s_alarm : UINT64_MAX;
+    if (rtc_next() < next) next = rtc_next();
+    if (next >= t) break;
+    time_set(next);
+    if (rtc_next() > next) {
+      step();
+    } else if (g_standby.sbf) {  // A reset
+      boot();
+    } else {
+      if (rtc_pending() & RTC_ALARM) RTC_Alarm_IRQHandler();
+      if (rtc_pending() & RTC_WAKEUP) RTC_WKUP_IRQHandler();
+      step();
+    }
+  }
+  if (t > now_ms()) time_set(t);
+}
+
+static void set_clock(uint32_t tod) {
+  wclock_set_ms(&s_wclock, tod, now_ms());
+  if (g_standby.sbf) standby();  // Kept for the wake-up
+}
+
+static void input(const struct rec *r) {
+  bool level = r->type == TRACE_EDGE ? r->value : !r->value;
+  if (r->type == TRACE_CLOCK) {
+    set_clock(r->value);
+  } else if (r->type == TRACE_BOOT) {
+    // A wake-up shows the time first thing, then traces it
+    for (const struct rec *c = r; r->value && c < s_in + s_nin; c++) {
+      if (c->time != r->time) break;
+      if (c->type == TRACE_CLOCK) set_clock(c->value);
+    }
+    g_standby.sbf = g_standby.sbf && r->value;
+    if (r->value) gpio_drive(BTN_PIN, false);  // Wake-up pin
+    boot();
+  } else if (g_standby.sbf && !level) {  // A press in Standby is a reset
+    gpio_drive(BTN_PIN, false);
+    boot();
+  } else if (r->type == TRACE_EDGE) {  // An interrupt came: an edge, or two
+    if (gpio_drive(BTN_PIN, !level) | gpio_drive(BTN_PIN, level)) {
+      EXTI2_IRQHandler();
+    }
+    step();
+  } else {  // Level the debounce timer reads
+    gpio_drive(BTN_PIN, level);
+    step();
+  }
+}
+
+static bool load(const char *path) {
+  char line[128];
+  uint32_t time, value;
+  unsigned type;
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return false;
+  while (fgets(line, sizeof(line), fp) != NULL && s_nin < MAX_RECORDS) {
+    if (trace_parse(line, &time, &type, &value)) {
+      s_in[s_nin++] = (struct rec) {START_MS + time, type, value};
+    }
+  }
+  fclose(fp);
+  return s_nin > 0;
+}
+
+// Boot, take the settings and the time of day, and wait in Standby
+static void start(void) {
+  uint64_t tod = 0, at = 0;
+  uint32_t midnight;
+  boot();
+  for (size_t i = 0; i < s_nin; i++) {
+    const struct rec *r = &s_in[i];
+    if (r->type == TRACE_TIMEOUT) kv_set(&s_kv, KV_TIMEOUT, r->value);
+    if (r->type == TRACE_CLICK_GAP) kv_set(&s_kv, KV_CLICK_GAP, r->value);
+    if (r->type == TRACE_DUMP) tod = r->value, at = r->time;
+  }
+  settings_apply();
+  midnight = (uint32_t) (at % WCLOCK_DAY_MS);  // Unless the trace sets it
+  wclock_set_ms(&s_wclock, (uint32_t) ((tod + WCLOCK_DAY_MS - midnight) %
+                                       WCLOCK_DAY_MS), now_ms());
+  run_until(START_MS);
+}
+
+static bool replay(const char *path) {
+  uint64_t end = START_MS, lag = 0;
+  size_t j = 0, matched = 0;
+  if (!load(path)) {
+    printf("%s: no records\n", path);
+    return false;
+  }
+  start();
+  while (j < s_nout && s_out[j].time < START_MS) j++;  // Before the trace
+  for (size_t i = 0; i < s_nin; i++) {
+    const struct rec *r = &s_in[i];
+    if (r->type == TRACE_SLEEP || r->type > TRACE_CLOCK) continue;
+    if (r->time > end) end = r->time;
+    if (r->type == TRACE_BOOT && r->value == 2) continue;  // RTC does that
+    if (!output(r->type)) run_until(r->time), input(r);
+  }
+  run_until(end + 1);
+
+  for (size_t i = 0; i < s_nin; i++) {
+    const struct rec *c = &s_in[i], *o = &s_out[j];
+    if (!output(c->type)) continue;
+    if (j >= s_nout || o->type != c->type || o->value != c->value) {
+      printf("%s: at %lu ms, captured %s %#lx, replayed %s %#lx\n", path,
+             (unsigned long) (c->time - START_MS), trace_name(c->type),
+             (unsigned long) c->value, j < s_nout ? trace_name(o->type) : "-",
+             j < s_nout ? (unsigned long) o->value : 0UL);
+      return false;
+    }
+    if (o->time > c->time + SLACK_MS) {
+      printf("%s: at %lu ms, %s %#lx is %lu ms late\n", path,
+             (unsigned long) (c->time - START_MS), trace_name(c->type),
+             (unsigned long) c->value, (unsigned long) (o->time - c->time));
+      return false;
+    }
+    if (o->time > c->time && o->time - c->time > lag) lag = o->time - c->time;
+    j++, matched++;
+  }
+  if (j < s_nout) {
+    printf("%s: replay goes on: %s %#lx at %lu ms\n", path,
+           trace_name(s_out[j].type), (unsigned long) s_out[j].value,
+           (unsigned long) (s_out[j].time - START_MS));
+    return false;
+  }
+  printf("%s: %lu records, %lu states and LED masks match, lag %lu ms\n",
+         path, (unsigned long) s_nin, (unsigned long) matched,
+         (unsigned long) lag);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  int failed = 0;
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s FILE.trace ...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  // stdout is ours: firmware output goes to the UART mock, see hal.h
+  for (int i = 1; i < argc; i++) {
+    int status;
+    pid_t pid;
+    fflush(stdout);
+    if ((pid = fork()) == 0) {  // Every trace starts from a fresh boot
+      exit(replay(argv[i]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || status != 0) failed++;
+  }
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,386 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Discrete-event simulator and benchmark. Replays button traces against the
+// firmware in virtual time, jumping from event to event: button presses and
+// firmware deadlines. Over the run, it integrates an energy model: LED
+// on-time per colour, CPU run / Sleep / STOP2 / Standby time, boots from
+// Standby, and UART bytes sent. Firmware runs in no virtual time, but a
+// press that wakes it from Standby waits for the boot to light the LEDs.
+// Drain scenarios take the charge used off the battery, so the firmware
+// sees VDD fall, and run until it is empty.
+// Prints a report per scenario, with press-to-LED latency percentiles and
+// projected battery life. Given a saved report, prints the difference:
+//
+//   make bench       # Run, and compare with the baseline arch/unix/bench.txt
+//   make bench-save  # Make current results the new baseline
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../../watch.c"
+
+// Energy model: STM32L432 at 3V, datasheet typical values. Run and Sleep
+// currents scale with the clock of the operating point, see set_op()
+#define RUN_UA_PER_MHZ 112.0   // Run mode, executing from flash
+#define SLEEP_UA_PER_MHZ 31.0  // Sleep mode, peripherals clocked
+#define I_STOP2_UA 1.5         // STOP2 with LSE and LPTIM1 running
+#define I_STANDBY_UA 0.35      // Standby with LSE and RTC running
+#define WAKE_CYCLES 800        // Run time per wake-up, including STOP2 exit
+#define BOOT_CYCLES 40000      // Wake-up from Standby: startup and setup()
+#define SHOW_CYCLES 4000       // Of those, reset to LEDs on, see wake_show()
+#define BOOT_MHZ 4.0           // MSI until clock_init(), see SystemInit()
+#define UART_BAUD 115200       // While a byte is sent, the CPU is in Sleep
+#define BATTERY_MAH 225   // CR2032
+#define ADC_CYCLES 240    // VDD sample: regulator start-up, calibration
+
+// Drained battery: a cell of DRAIN_MAH, so that it runs out in weeks of
+// virtual time, not years. Battery days are still for BATTERY_MAH: the
+// average current is the same. With the policy off, VDD looks full
+#define DRAIN_MAH 3.0
+#define UA_MS_PER_MAH 3.6e9
+enum { BATTERY_FULL, BATTERY_DRAIN, BATTERY_DRAIN_OFF };
+static const uint16_t s_flat[][2] = {{0, 3000}, {1000, 3000}};
+
+#define MAX_PRESSES 8192
+#define CLICK_GAP_MS 150  // Between clicks of a multi-click
+#define PRESS_MS 80       // How long a click holds the button
+
+enum { MODE_RUN, MODE_SLEEP, MODE_STOP2, MODE_STANDBY };  // Where it waits
+
+static double mhz(uint32_t hz) {
+  return hz / 1e6;
+}
+
+static double current_ua(int mode) {  // At the current clock
+  double f = mhz(SystemCoreClock);
+  return mode == MODE_RUN     ? f * RUN_UA_PER_MHZ
+         : mode == MODE_SLEEP ? f * SLEEP_UA_PER_MHZ
+         : mode == MODE_STOP2 ? I_STOP2_UA
+                              : I_STANDBY_UA;
+}
+
+static double wake_ms(void) {
+  return WAKE_CYCLES / mhz(SystemCoreClock) / 1000;
+}
+
+struct scenario {
+  const char *name;
+  uint64_t duration;    // Milliseconds
+  uint64_t mean_gap;    // Mean time between click sequences, 0 - scripted
+  const uint8_t *seq;   // Click sequences to choose from, clicks in each
+  size_t nseq;          // Number of sequences
+  uint8_t brightness;   // See set_brightness()
+  uint8_t battery;      // BATTERY_FULL, BATTERY_DRAIN, BATTERY_DRAIN_OFF
+};
+
+struct stats {
+  double run_ms, sleep_ms, stop_ms, standby_ms;  // CPU time in each mode
+  double led_ms[4];                              // LED-milliseconds, by colour
+  double charge;                                 // Microampere-milliseconds
+  unsigned long wakeups, boots, uart_bytes, presses, unanswered;
+  uint16_t mask;                  // LEDs after the last step
+  double latency[MAX_PRESSES];    // Press to LED change, milliseconds
+  size_t nlatency;
+  double boot_ms;                 // Reset to LEDs on, for the wake press
+};
+
+static uint64_t s_presses[MAX_PRESSES];  // Button trace
+static size_t s_npresses;
+static uint32_t s_seed = 1;
+
+static uint32_t rnd(void) {  // xorshift32: same traces on every run
+  s_seed ^= s_seed << 13, s_seed ^= s_seed >> 17, s_seed ^= s_seed << 5;
+  return s_seed;
+}
+
+// Random click sequences, gaps uniformly distributed around the mean
+static void make_trace(const struct scenario *sc) {
+  uint64_t t = 0;
+  s_npresses = 0;
+  for (;;) {
+    uint8_t clicks = sc->seq[rnd() % sc->nseq];
+    t += sc->mean_gap / 2 + rnd() % (sc->mean_gap + 1);
+    if (t + clicks * CLICK_GAP_MS >= sc->duration) break;
+    for (uint8_t i = 0; i < clicks && s_npresses < MAX_PRESSES; i++) {
+      s_presses[s_npresses++] = t, t += CLICK_GAP_MS;
+    }
+  }
+}
+
+// Scripted traces: groups of presses, each is the time of the first one,
+// the number of presses, and the gap between them
+static void make_scripted_trace(const uint64_t (*groups)[3], size_t n) {
+  s_npresses = 0;
+  for (size_t i = 0; i < n; i++) {
+    for (uint64_t j = 0; j < groups[i][1]; j++) {
+      s_presses[s_npresses++] = groups[i][0] + j * groups[i][2];
+    }
+  }
+}
+
+// Set time: triple click and 5 clicks to set hours, then quad click and
+// 7 clicks to set minutes, then a glance
+static const uint64_t s_set_time[][3] = {
+    {1000, 3, CLICK_GAP_MS}, {2000, 5, 400}, {8000, 4, CLICK_GAP_MS},
+    {9000, 7, 400},          {16000, 1, 0}};
+
+// Countdown: double click and 10 clicks for 10 minutes, then it rings
+static const uint64_t s_countdown_set[][3] = {{1000, 2, CLICK_GAP_MS},
+                                              {2000, 10, 400}};
+
+static uint16_t led_mask(void) {
+  uint16_t mask = 0;
+  for (size_t i = 0; i < ARRAY_SIZE(s_leds); i++) {
+    mask |= (uint16_t) (gpio_read(s_leds[i]) ? BIT(i) : 0);
+  }
+  return mask;
+}
+
+// Lit LEDs per colour, averaged over a PWM period if dimming is on
+static void leds_lit(double lit[4]) {
+  uint16_t slots = pwm_active() ? g_pwm.len : 1;
+  memset(lit, 0, 4 * sizeof(lit[0]));
+  for (uint16_t k = 0; k < slots; k++) {
+    if (pwm_active()) pwm_replay(k);
+    for (int i = 0; i < 4; i++) {
+      lit[i] += __builtin_popcount(led_mask() & LED_ROW(i)) / (double) slots;
+    }
+  }
+  if (pwm_active()) pwm_replay(0);
+}
+
+// Run firmware once, collect UART output and LED changes.
+// Return how the CPU waits for the next event, by the chosen sleep mode
+static int step(struct stats *st, size_t *pending) {
+  struct sleeps before = g_sleeps;
+  unsigned standby = g_standby.entries;
+  loop();
+  st->wakeups++;
+  while (g_uart.txe || g_uart.tc) {  // Log is sent, UART IRQ wakes us up
+    while (g_uart.txe || g_uart.tc) USART1_IRQHandler();
+    st->uart_bytes += g_uart.len, g_uart.len = 0;
+    double run = wake_ms(), current = current_ua(MODE_RUN);  // Log clock
+    before = g_sleeps;
+    loop();
+    st->wakeups++;
+    st->run_ms += run, st->charge += run * current;
+  }
+  // Presses the display did not react to, like a long press, are ignored
+  for (; *pending < st->presses; (*pending)++) {
+    if (now_ms() - s_presses[*pending] <= NEXT_PRESS_MS + TIMEOUT_MS) break;
+    st->unanswered++;
+  }
+  if (led_mask() != st->mask) {  // Display reacted to all pending presses
+    for (; *pending < st->presses; (*pending)++) {
+      st->latency[st->nlatency++] =
+          (double) (now_ms() - s_presses[*pending]) + st->boot_ms;
+      st->boot_ms = 0;
+    }
+  }
+  st->boot_ms = 0;  // An RTC wake-up has no press waiting for it
+  st->mask = led_mask();
+  if (g_standby.entries > standby) return MODE_STANDBY;
+  if (g_sleeps.deep > before.deep) return MODE_STOP2;
+  if (g_sleeps.light > before.light) return MODE_SLEEP;
+  return MODE_RUN;  // Did not sleep, polling
+}
+
+// Time of the next button edge, if it comes before t: press or release
+static uint64_t next_edge(const struct stats *st, size_t releases,
+                          uint64_t t) {
+  if (releases < st->presses && s_presses[releases] + PRESS_MS < t) {
+    t = s_presses[releases] + PRESS_MS;
+  }
+  if (st->presses < s_npresses && s_presses[st->presses] < t) {
+    t = s_presses[st->presses];
+  }
+  return t;
+}
+
+static void boot(const struct scenario *sc, struct stats *st) {
+  double run;
+  SystemInit();
+  setup();
+  set_brightness(sc->brightness);
+  run = BOOT_CYCLES / BOOT_MHZ / 1000;  // Mostly before clock_init()
+  st->run_ms += run, st->charge += run * BOOT_MHZ * RUN_UA_PER_MHZ;
+  st->boot_ms = SHOW_CYCLES / BOOT_MHZ / 1000;
+  st->boots++;
+}
+
+static void simulate(const struct scenario *sc, struct stats *st) {
+  size_t pending = 0, releases = 0;
+  if (sc->battery == BATTERY_DRAIN_OFF) {
+    g_battery.curve = s_flat, g_battery.len = ARRAY_SIZE(s_flat);
+  }
+  SystemInit();
+  setup();
+  set_brightness(sc->brightness);
+  while (now_ms() < sc->duration && g_battery.used < 1000) {
+    int mode = step(st, &pending);
+    double current = current_ua(mode), lit[4], dt, run;
+    uint64_t next = sc->duration;
+    if (s_alarm > now_ms() && s_alarm < next) next = s_alarm;
+    if (rtc_next() < next) next = rtc_next();
+    next = next_edge(st, releases, next);
+    dt = (double) (next - now_ms());
+    run = mode == MODE_RUN ? dt : dt < wake_ms() ? dt : wake_ms();
+    leds_lit(lit);
+    for (int i = 0; i < 4; i++) {
+      st->led_ms[i] += lit[i] * dt;
+      st->charge += lit[i] * dt * led_ua(i);
+    }
+    st->run_ms += run;
+    st->sleep_ms += mode == MODE_SLEEP ? dt - run : 0;
+    st->stop_ms += mode == MODE_STOP2 ? dt - run : 0;
+    st->standby_ms += mode == MODE_STANDBY ? dt - run : 0;
+    st->charge += run * current_ua(MODE_RUN) + (dt - run) * current;
+    if (sc->battery != BATTERY_FULL) {
+      g_battery.used = (unsigned) (st->charge * 1000 /
+                                   (DRAIN_MAH * UA_MS_PER_MAH));
+    }
+    time_set(next);
+    if (rtc_next() == next) {  // RTC interrupt, or in Standby, a reset
+      if (g_standby.sbf) {
+        boot(sc, st);
+      } else if (rtc_pending() & RTC_ALARM) {
+        RTC_Alarm_IRQHandler();
+      } else {
+        RTC_WKUP_IRQHandler();
+      }
+    }
+    if (releases < st->presses && s_presses[releases] + PRESS_MS == next) {
+      if (gpio_drive(BTN_PIN, true)) EXTI2_IRQHandler();
+      releases++;
+    }
+    if (st->presses < s_npresses && s_presses[st->presses] == next) {
+      if (g_standby.sbf) {  // Wake-up pin: reset, and boot
+        gpio_drive(BTN_PIN, false);
+        boot(sc, st);
+      } else if (gpio_drive(BTN_PIN, false)) {
+        EXTI2_IRQHandler();
+      }
+      st->presses++;
+    }
+  }
+  st->unanswered += st->presses - pending;
+  st->charge += g_battery.reads * ADC_CYCLES * RUN_UA_PER_MHZ / 1000;
+  st->charge += st->uart_bytes * 10 * 1000.0 / UART_BAUD *  // Sending time
+                (mhz(clock_op_hz(&s_ops[OP_LOG])) * SLEEP_UA_PER_MHZ -
+                 I_STOP2_UA);
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct stats *st, unsigned p) {
+  if (st->nlatency == 0) return 0;
+  return st->latency[(st->nlatency - 1) * p / 100];
+}
+
+// Saved report, to compare with. Lines are: scenario metric value
+static char s_baseline[16 * 1024];
+
+static void report(const char *scenario, const char *metric, double value) {
+  char name[64], key[64];
+  const char *p = s_baseline;
+  double old;
+  value = (double) (long long) (value * 100 + 0.5) / 100;  // As printed
+  fprintf(stdout, "%-10s %-16s %12.2f", scenario, metric, value);
+  while (p != NULL && *p != '\0') {
+    if (sscanf(p, "%63s %63s %lf", name, key, &old) == 3 &&
+        strcmp(name, scenario) == 0 && strcmp(key, metric) == 0) {
+      fprintf(stdout, "   was %12.2f", old);
+      if (old != 0) fprintf(stdout, "  %+6.1f%%", (value - old) * 100 / old);
+      break;
+    }
+    if ((p = strchr(p, '\n')) != NULL) p++;
+  }
+  fprintf(stdout, "\n");
+}
+
+static void print_stats(const char *name, struct stats *st,
+                        uint64_t duration) {
+  static const char *colours[] = {"red", "orange", "green", "blue"};
+  double avg = st->charge / (double) duration;
+  char metric[32];
+  qsort(st->latency, st->nlatency, sizeof(st->latency[0]), cmp_double);
+  report(name, "presses", st->presses);
+  report(name, "unanswered", st->unanswered);
+  report(name, "wakeups", st->wakeups);
+  report(name, "run_ms", st->run_ms);
+  report(name, "sleep_ms", st->sleep_ms);
+  report(name, "stop2_ms", st->stop_ms);
+  report(name, "standby_ms", st->standby_ms);
+  report(name, "boots", st->boots);
+  report(name, "uart_bytes", st->uart_bytes);
+  for (int i = 0; i < 4; i++) {
+    snprintf(metric, sizeof(metric), "led_ms_%s", colours[i]);
+    report(name, metric, st->led_ms[i]);
+  }
+  report(name, "latency_p50_ms", percentile(st, 50));
+  report(name, "latency_p90_ms", percentile(st, 90));
+  report(name, "latency_p99_ms", percentile(st, 99));
+  report(name, "latency_max_ms", percentile(st, 100));
+  report(name, "avg_current_ua", avg);
+  report(name, "battery_days", BATTERY_MAH * 1000.0 / avg / 24);
+}
+
+int main(int argc, char *argv[]) {
+  static const uint8_t glance[] = {1};
+  static const uint8_t mixed[] = {1, 1, 1, 1, 1, 1, 2, 3, 4};
+  static const struct scenario scenarios[] = {
+      {"idle", 24 * 3600 * 1000ULL, 0, NULL, 0, PWM_STEPS, BATTERY_FULL},
+      {"glance", 24 * 3600 * 1000ULL, 20 * 60 * 1000, glance, 1, PWM_STEPS,
+       BATTERY_FULL},
+      {"dimmed", 24 * 3600 * 1000ULL, 20 * 60 * 1000, glance, 1,
+       PWM_STEPS / 2, BATTERY_FULL},
+      {"busy", 3600 * 1000ULL, 20 * 1000, mixed, ARRAY_SIZE(mixed),
+       PWM_STEPS, BATTERY_FULL},
+      {"set_time", 30 * 1000ULL, 0, NULL, 0, PWM_STEPS, BATTERY_FULL},
+      {"countdown", 15 * 60 * 1000ULL, 0, NULL, 0, PWM_STEPS, BATTERY_FULL},
+      {"drain", 90 * 24 * 3600 * 1000ULL, 20 * 60 * 1000, glance, 1,
+       PWM_STEPS, BATTERY_DRAIN},
+      {"drain_off", 90 * 24 * 3600 * 1000ULL, 20 * 60 * 1000, glance, 1,
+       PWM_STEPS, BATTERY_DRAIN_OFF},
+  };
+  FILE *fp;
+
+  if (argc > 1 && (fp = fopen(argv[1], "r")) != NULL) {
+    size_t n = fread(s_baseline, 1, sizeof(s_baseline) - 1, fp);
+    s_baseline[n] = '\0';
+    fclose(fp);
+  }
+
+  // stdout is ours: firmware output goes to the UART mock, see hal.h
+  fprintf(stdout, "# %-8s %-16s %12s\n", "scenario", "metric", "value");
+  fflush(stdout);
+  for (size_t i = 0; i < ARRAY_SIZE(scenarios); i++) {
+    const struct scenario *sc = &scenarios[i];
+    int status;
+    pid_t pid;
+    if (sc->mean_gap > 0) {
+      make_trace(sc);
+    } else if (strcmp(sc->name, "set_time") == 0) {
+      make_scripted_trace(s_set_time, ARRAY_SIZE(s_set_time));
+    } else if (strcmp(sc->name, "countdown") == 0) {
+      make_scripted_trace(s_countdown_set, ARRAY_SIZE(s_countdown_set));
+    } else {
+      s_npresses = 0;
+    }
+    if ((pid = fork()) == 0) {  // Every scenario starts from a fresh boot
+      static struct stats st;
+      simulate(sc, &st);
+      print_stats(sc->name, &st, now_ms());  // Drained ones end early
+      exit(EXIT_SUCCESS);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || status != 0) {
+      fprintf(stderr, "scenario %s failed\n", sc->name);
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -1,6 +1,7 @@
 // Copyright (c) 2025 Sergey Lyubka
 // SPDX-License-Identifier: MIT
 
+#define PROF 1  // Test with profiler probes enabled
 #include "../../watch.c"
 
 static uint16_t get_led_mask(void) {
@@ -12,8 +13,1544 @@ static uint16_t get_led_mask(void) {
   return mask;
 }
 
+// Simulate UART interrupts until the transmitter is idle
+static void uart_isr(void) {
+  while (!g_uart.stalled && (g_uart.txe || g_uart.tc)) USART1_IRQHandler();
+}
+
+// Receive bytes. The UART IRQ takes them all in one go
+static void uart_rx(const void *buf, size_t len) {
+  g_uart.rx = (const uint8_t *) buf, g_uart.rx_len = len;
+  USART1_IRQHandler();
+}
+
+// Compare batched set_leds() with writing LEDs one pin at a time
+static void test_set_leds(void) {
+  bool expected[sizeof(g_pins) / sizeof(g_pins[0])][16];
+  for (uint32_t mask = 0; mask <= 0xffff; mask++) {
+    unsigned writes = g_bank_writes;
+    for (size_t i = 0; i < ARRAY_SIZE(s_leds); i++) {
+      gpio_write(s_leds[i], mask & BIT(i));
+    }
+    memcpy(expected, g_pins, sizeof(g_pins));
+    set_leds((uint16_t) (mask ^ 0xffff));  // Start from the opposite state
+    set_leds((uint16_t) mask);
+    assert(memcmp(expected, g_pins, sizeof(g_pins)) == 0);
+    assert(get_led_mask() == mask);
+    assert(g_bank_writes == writes + 2 * LED_BANKS);  // One store per bank
+  }
+  set_leds(0);
+}
+
+// Expected average LED current from brightness settings, microamperes
+static unsigned leds_current_ua(void) {
+  unsigned ua = 0;
+  for (int i = 0; i < 4; i++) {
+    unsigned n = (unsigned) __builtin_popcount(s_led_mask & LED_ROW(i));
+    unsigned duty = brightness() >= PWM_STEPS ? PWM_STEPS : row_duty(i);
+    if (brightness() == 0) duty = 0;
+    ua += n * led_ua(i) * duty / PWM_STEPS;
+  }
+  return ua;
+}
+
+// Previous, division based time of day conversion. Reference for wclock.h
+#define SECONDS_IN_DAY (24 * 60 * 60)
+
+static inline uint16_t time_to_led_mask(unsigned hours, unsigned minutes) {
+  uint8_t a[] = {hours / 10, hours % 10, minutes / 10, minutes % 10};
+  uint16_t mask = 0;
+  for (int i = 0; i < 4; i++) {    // columns
+    for (int j = 0; j < 4; j++) {  // rows
+      uint16_t x = (a[i] & (1 << j)) ? 1 : 0;
+      mask |= x << (j * 4 + i);
+    }
+  }
+  return mask;
+}
+
+static inline unsigned hours(uint64_t milliseconds) {
+  return ((milliseconds / 1000) % SECONDS_IN_DAY) / 3600;
+}
+
+static inline unsigned minutes(uint64_t milliseconds) {
+  return ((milliseconds / 1000) % 3600) / 60;
+}
+
+// BCD wall clock against the division based conversion: LED masks for all
+// minutes of a day, and time moved in steps of all sizes
+static void test_wclock(void) {
+  struct wclock c = {0};
+  uint64_t now = 0, step = 1;
+  uint32_t seed = 1;
+  for (unsigned h = 0; h < 24; h++) {
+    for (unsigned m = 0; m < 60; m++) {
+      uint8_t bh = bcd_from_bin(h), bm = bcd_from_bin(m);
+      assert(wclock_led_mask(bh, bm) == time_to_led_mask(h, m));
+      assert(bcd_inc(bm, 0x60) == bcd_from_bin((m + 1) % 60));
+    }
+    assert(bcd_inc(bcd_from_bin(h), 0x24) == bcd_from_bin((h + 1) % 24));
+  }
+
+  // Every minute of a day, one by one, and then past midnight
+  for (unsigned i = 0; i <= 24 * 60; i++, now += WCLOCK_MINUTE_MS) {
+    wclock_update(&c, now);
+    assert(c.hours == bcd_from_bin(hours(now)));
+    assert(c.minutes == bcd_from_bin(minutes(now)) && c.ms == 0);
+  }
+
+  // Random steps, from a millisecond to weeks of sleep
+  for (int i = 0; i < 100000; i++) {
+    seed ^= seed << 13, seed ^= seed >> 17, seed ^= seed << 5;
+    step = i % 1000 == 999 ? seed * 1000ULL : seed % (i % 2 ? 1000 : 600000);
+    now += step;
+    wclock_update(&c, now);
+    assert(c.hours == bcd_from_bin(hours(now)));
+    assert(c.minutes == bcd_from_bin(minutes(now)));
+    assert(c.ms == now % WCLOCK_MINUTE_MS);
+  }
+
+  wclock_set(&c, 0x23, 0x59, 1000);
+  wclock_update(&c, 1000 + WCLOCK_MINUTE_MS - 1);
+  assert(c.hours == 0x23 && c.minutes == 0x59);
+  wclock_update(&c, 1000 + WCLOCK_MINUTE_MS);
+  assert(c.hours == 0 && c.minutes == 0 && c.ms == 0);
+}
+
+// Dimmed LEDs: replay the simulated DMA waveform, check per-colour duty,
+// estimated current, and that the CPU does not enter STOP2 while dimming
+static void test_dimming(void) {
+  uint16_t mask = 0x8421;  // One LED per row, in different columns
+  unsigned on[16] = {0}, ua = 0, light = g_sleeps.light;
+
+  set_leds(mask);  // Full brightness: static drive, no PWM
+  assert(!pwm_active() && get_led_mask() == mask);
+  assert(leds_current_ua() ==
+         led_ua(0) + led_ua(1) + led_ua(2) + led_ua(3));
+
+  set_brightness(PWM_STEPS / 2);  // Redraws the current mask, dimmed
+  assert(pwm_active() && get_led_mask() == mask);  // Slot 0 lights all
+  assert(g_pwm.slot_hz == PWM_HZ * PWM_STEPS && g_pwm.len == PWM_STEPS);
+  for (uint16_t k = 0; k < PWM_STEPS; k++) {
+    uint16_t lit;
+    pwm_replay(k);
+    lit = get_led_mask();
+    assert((lit & ~mask) == 0);  // Unlit LEDs never blink
+    for (int i = 0; i < 16; i++) on[i] += lit & BIT(i) ? 1 : 0;
+  }
+  // Half brightness, scaled by colour gains 60, 75, 100, 100%, rounded up
+  assert(on[0] == 5 && on[5] == 6 && on[10] == 8 && on[15] == 8);
+  for (int i = 0; i < 16; i++) ua += on[i] * led_ua(i / 4) / PWM_STEPS;
+  assert(leds_current_ua() == ua);
+  assert(ua < (led_ua(0) + led_ua(1) + led_ua(2) + led_ua(3)) / 2);
+
+  sleep_task();  // DMA needs clocks: sleep lightly
+  assert(g_sleeps.light == light + 1 && g_sleeps.deep == 0);
+
+  set_brightness(1);  // Dimmest: every colour is still visible
+  for (int i = 0; i < 4; i++) assert(row_duty(i) == 1);
+  set_brightness(0);  // Off
+  assert(!pwm_active() && get_led_mask() == 0 && leds_current_ua() == 0);
+
+  set_brightness(PWM_STEPS);
+  set_leds(0);
+  sleep_task();
+  assert(g_sleeps.deep == 1);
+  memset(&g_sleeps, 0, sizeof(g_sleeps));
+}
+
+// Jump virtual time to the next deadline, and run firmware loop
+static void wake_up(void) {
+  time_jump();
+  loop();
+  uart_isr();
+}
+
+// Let firmware run for a given time, waking up on every deadline on the way
+static void run_for(uint64_t ms) {
+  uint64_t until = now_ms() + ms;
+  loop();
+  uart_isr();
+  while (s_alarm > now_ms() && s_alarm <= until) wake_up();
+  if (until > now_ms()) time_set(until);
+  loop();
+  uart_isr();
+}
+
+// Button. Drive the pin, and if that raises the IRQ, handle it and wake up.
+// In Standby, a press is a reset
+#define CLICK_MS 50  // How long a test click holds, then waits
+static unsigned s_btn_irqs;  // Number of button IRQs
+static void btn(bool pressed) {
+  if (g_standby.sbf && pressed) {
+    gpio_drive(BTN_PIN, false);
+    SystemInit();
+    setup();
+    uart_isr();
+  } else if (gpio_drive(BTN_PIN, !pressed)) {
+    EXTI2_IRQHandler();
+    s_btn_irqs++;
+    loop();
+    uart_isr();
+  }
+}
+
+static void click(void) {  // Press, hold, release, let the level settle
+  btn(true);
+  run_for(CLICK_MS);
+  btn(false);
+  run_for(CLICK_MS);
+}
+
+static void clicks(int n) {  // Click n times, until the count is decoded
+  for (int i = 0; i < n; i++) click();
+  run_for(NEXT_PRESS_MS - CLICK_MS);
+}
+
+static char s_fired[10];  // Names of fired test timers, in order
+static void fire(void *arg) {
+  size_t len = strlen(s_fired);
+  if (len + 1 < sizeof(s_fired)) s_fired[len] = *(char *) arg;
+}
+
+static void test_sched(void) {
+  struct sched s = {0};
+  struct timer a = {.fn = fire, .arg = "a"}, b = {.fn = fire, .arg = "b"},
+               c = {.fn = fire, .arg = "c"}, d = {.fn = fire, .arg = "d"};
+  assert(sched_next(&s) == UINT64_MAX);
+
+  // Ordering: by deadline, then by insertion order
+  assert(sched_add(&s, &a, 30, 0));
+  assert(sched_add(&s, &b, 10, 0));
+  assert(sched_add(&s, &c, 20, 0));
+  assert(sched_add(&s, &d, 20, 0));
+  assert(sched_next(&s) == 10);
+  sched_run(&s, 9);
+  assert(strcmp(s_fired, "") == 0);
+  sched_run(&s, 20);
+  assert(strcmp(s_fired, "bcd") == 0);
+  assert(!timer_active(&b) && timer_active(&a) && sched_next(&s) == 30);
+  sched_run(&s, 100);
+  assert(strcmp(s_fired, "bcda") == 0 && s.len == 0);
+
+  // Cancellation, and rescheduling an active timer
+  memset(s_fired, 0, sizeof(s_fired));
+  sched_add(&s, &a, 10, 0);
+  sched_add(&s, &b, 20, 0);
+  sched_add(&s, &c, 30, 0);
+  sched_cancel(&s, &a);
+  sched_cancel(&s, &a);  // Cancelling twice is fine
+  sched_add(&s, &c, 5, 0);
+  assert(s.len == 2 && sched_next(&s) == 5);
+  sched_run(&s, 100);
+  assert(strcmp(s_fired, "cb") == 0);
+
+  // Periodic timers: fire every period, skip missed periods
+  memset(s_fired, 0, sizeof(s_fired));
+  sched_add(&s, &a, 10, 10);
+  sched_add(&s, &b, 25, 0);
+  sched_run(&s, 10);
+  sched_run(&s, 20);
+  assert(sched_next(&s) == 25);
+  sched_run(&s, 30);
+  assert(strcmp(s_fired, "aaba") == 0 && a.expire == 40);
+  sched_run(&s, 75);  // Late: fire once, next is a period from now
+  assert(strcmp(s_fired, "aabaa") == 0 && a.expire == 85);
+  sched_cancel(&s, &a);
+  assert(s.len == 0);
+
+  // Capacity is fixed
+  struct timer many[SCHED_MAX_TIMERS + 1];
+  memset(many, 0, sizeof(many));
+  for (size_t i = 0; i < SCHED_MAX_TIMERS; i++) {
+    assert(sched_add(&s, &many[i], SCHED_MAX_TIMERS - i, 0));
+  }
+  assert(!sched_add(&s, &many[SCHED_MAX_TIMERS], 0, 0));
+  for (size_t i = 0; i < SCHED_MAX_TIMERS; i++) {
+    assert(sched_next(&s) == i + 1);
+    sched_cancel(&s, s.heap[0]);
+  }
+}
+
+// Interrupts injected in the middle of a time read
+static void overflow_irq(void) {  // Time passes, overflow interrupt runs
+  s_now += 3;
+  timebase_irq();
+}
+static void overflow_masked(void) {  // Interrupts are disabled: just pending
+  s_now += 3;
+}
+
+static void test_mono(void) {
+  uint32_t t = 0;
+  time_set(0x1fffe);
+  g_time_irq = overflow_irq;  // Without a retry, it would read 0x10001
+  assert(now_ms() == 0x20001 && g_time_irq == NULL);
+  time_set(0x1fffe);
+  g_time_irq = overflow_masked;
+  assert(now_ms() == 0x20001 && s_overflows == 1);  // Taken from pending
+  assert(now_ms() == 0x20001);
+  timebase_irq();
+  assert(now_ms() == 0x20001 && s_overflows == 2);
+  time_set(0xfffffffe);  // 32-bit milliseconds wrap, 64-bit time does not
+  g_time_irq = overflow_irq;
+  assert(now_ms() == 0x100000001 && s_overflows == 0x10000);
+
+  // 32-bit time wraps every 49 days
+  assert(elapsed(0xfffffff0, 0x10) == 0x20);
+  assert(!deadline_passed(0x10, 0xfffffff0) && deadline_passed(0x10, 0x10));
+  assert(deadline_passed(0xfffffff0, 0x10));
+  time_set(0xfffffff0);
+  for (int i = 0; i < 3; i++) {  // Period of 20 ms, across the wrap
+    while (!timer_expired(&t, 20, (uint32_t) now_ms())) time_advance(1);
+    assert(now_ms() == 0xfffffff0 + 20 * (uint64_t) (i + 1));
+  }
+  time_set(0);
+}
+
+static void test_evq(void) {
+  struct evq q = {0};
+  struct event ev;
+  uint64_t sent = 0, received = 0;
+  srand(1);
+  for (int i = 0; i < 10000; i++) {
+    int n = rand() % (EVQ_SIZE + 4);  // Burst of "interrupts"
+    for (int j = 0; j < n; j++) {
+      ev.time = sent, ev.type = EV_BTN_EDGE;
+      if (evq_push(&q, &ev)) sent++;
+    }
+    n = rand() % (EVQ_SIZE + 4);  // Main loop drains some of them
+    for (int j = 0; j < n && evq_pop(&q, &ev); j++) {
+      assert(ev.time == received);  // In order, nothing lost or duplicated
+      received++;
+    }
+  }
+  while (evq_pop(&q, &ev)) assert(ev.time == received++);
+  assert(sent == received && q.dropped > 0 && evq_empty(&q));
+}
+
+// State machine: A encloses B and C, B encloses B1. D stands alone
+enum { FA, FB, FB1, FC, FD, NUM_FSTATES };
+enum { EV_GO_C, EV_GO_D, EV_GO_B1, EV_POKE, EV_NONE, NUM_FEVENTS };
+static char s_calls[32];  // Actions run, in order
+static uint8_t s_changed;
+static void called(char c) {
+  size_t n = strlen(s_calls);
+  assert(n + 1 < sizeof(s_calls));
+  s_calls[n] = c, s_calls[n + 1] = '\0';
+}
+static void enter_a(void *arg) { (void) arg, called('A'); }
+static void exit_a(void *arg) { (void) arg, called('a'); }
+static void enter_b(void *arg) { (void) arg, called('B'); }
+static void exit_b(void *arg) { (void) arg, called('b'); }
+static void enter_b1(void *arg) { (void) arg, called('1'); }
+static void exit_b1(void *arg) { (void) arg, called('!'); }
+static void enter_c(void *arg) { (void) arg, called('C'); }
+static void enter_d(void *arg) { (void) arg, called('D'); }
+static void poke(void *arg) { called(*(char *) arg); }
+static void on_changed(uint8_t state) { s_changed = state, called('='); }
+
+static void test_fsm(void) {
+  static const struct fsm_state states[NUM_FSTATES] = {
+      [FA] = {FSM_NONE, enter_a, exit_a}, [FB] = {FA, enter_b, exit_b},
+      [FB1] = {FB, enter_b1, exit_b1},    [FC] = {FA, enter_c, NULL},
+      [FD] = {FSM_NONE, enter_d, NULL},
+  };
+  static const struct fsm_tr table[NUM_FSTATES][NUM_FEVENTS] = {
+      [FA][EV_GO_D] = FSM_GO(FD, poke),  [FA][EV_POKE] = FSM_DO(poke),
+      [FB][EV_GO_C] = FSM_GO(FC, NULL),  [FB1][EV_GO_B1] = FSM_GO(FB1, NULL),
+      [FC][EV_GO_B1] = FSM_GO(FB1, NULL), [FD][EV_GO_B1] = FSM_GO(FB1, NULL),
+  };
+  struct fsm m = {states, &table[0][0], NUM_FEVENTS, FB1, on_changed};
+  char arg = 'x';
+
+  assert(fsm_encloses(&m, FA, FB1) && fsm_encloses(&m, FB, FB1));
+  assert(!fsm_encloses(&m, FB1, FB1) && !fsm_encloses(&m, FC, FB1));
+  assert(!fsm_dispatch(&m, EV_NONE, &arg) && s_calls[0] == '\0');
+
+  // Internal transition, handled by a parent: no exit, no entry
+  assert(fsm_dispatch(&m, EV_POKE, &arg) && m.state == FB1);
+  assert(strcmp(s_calls, "x") == 0);
+
+  // Exit up to the common parent, then enter down to the target
+  s_calls[0] = '\0';
+  assert(fsm_dispatch(&m, EV_GO_C, &arg) && m.state == FC);
+  assert(strcmp(s_calls, "!b=C") == 0 && s_changed == FC);
+  s_calls[0] = '\0';
+  assert(fsm_dispatch(&m, EV_GO_B1, &arg) && m.state == FB1);
+  assert(strcmp(s_calls, "=B1") == 0 && s_changed == FB1);
+
+  // Self-transition exits and enters again
+  s_calls[0] = '\0';
+  assert(fsm_dispatch(&m, EV_GO_B1, &arg) && m.state == FB1);
+  assert(strcmp(s_calls, "!=1") == 0);
+
+  // Across the top: every state exits, the action runs in between
+  s_calls[0] = '\0';
+  assert(fsm_dispatch(&m, EV_GO_D, &arg) && m.state == FD);
+  assert(strcmp(s_calls, "!bax=D") == 0);
+  s_calls[0] = '\0';
+  assert(!fsm_dispatch(&m, EV_POKE, &arg) && s_calls[0] == '\0');
+  assert(fsm_dispatch(&m, EV_GO_B1, &arg) && m.state == FB1);
+  assert(strcmp(s_calls, "=AB1") == 0);
+}
+
+static struct {
+  uint8_t type;
+  unsigned count;
+  uint64_t time;
+} s_gestures[10];  // Reported gestures, in order
+static size_t s_ngestures;
+static void on_gesture(uint8_t type, unsigned count, uint64_t time) {
+  assert(s_ngestures < ARRAY_SIZE(s_gestures));
+  s_gestures[s_ngestures].type = type, s_gestures[s_ngestures].count = count;
+  s_gestures[s_ngestures++].time = time;
+}
+
+static void check_gesture(size_t i, uint8_t type, unsigned count,
+                          uint64_t time) {
+  assert(i < s_ngestures && s_gestures[i].type == type);
+  assert(s_gestures[i].count == count && s_gestures[i].time == time);
+}
+
+static void test_gesture(void) {
+  struct sched s = {0};
+  struct gesture_cfg cfg = {.click_gap_ms = 300, .long_ms = 1000,
+                            .hold_ms = 100};
+  struct gesture g = {.cfg = &cfg, .sched = &s, .fn = on_gesture};
+
+  // Double click: presses and releases as they come, then the click count
+  gesture_input(&g, true, 0);
+  gesture_input(&g, false, 100);
+  gesture_input(&g, false, 120);  // No change, ignored
+  gesture_input(&g, true, 350);   // Within the gap: same sequence
+  gesture_input(&g, false, 400);
+  sched_run(&s, 699);
+  assert(s_ngestures == 4);
+  sched_run(&s, 700);
+  check_gesture(0, GESTURE_PRESS, 1, 0);
+  check_gesture(1, GESTURE_RELEASE, 1, 100);
+  check_gesture(2, GESTURE_PRESS, 2, 350);
+  check_gesture(3, GESTURE_RELEASE, 2, 400);
+  check_gesture(4, GESTURE_CLICKS, 2, 700);
+  assert(s_ngestures == 5 && sched_next(&s) == UINT64_MAX);
+
+  // Click, then press and hold: long press, repeats, and no click count
+  s_ngestures = 0;
+  gesture_input(&g, true, 1000);
+  gesture_input(&g, false, 1050);
+  gesture_input(&g, true, 1300);
+  sched_run(&s, 2299);
+  assert(s_ngestures == 3);
+  sched_run(&s, 2550);
+  gesture_input(&g, false, 2550);
+  check_gesture(3, GESTURE_LONG, 2, 2300);
+  check_gesture(4, GESTURE_HOLD, 1, 2400);
+  check_gesture(5, GESTURE_HOLD, 2, 2500);
+  check_gesture(6, GESTURE_RELEASE, 0, 2550);
+  assert(s_ngestures == 7 && sched_next(&s) == UINT64_MAX);
+
+  // Next press starts a new sequence
+  s_ngestures = 0;
+  gesture_input(&g, true, 3000);
+  gesture_input(&g, false, 3999);  // Just short of a long press
+  sched_run(&s, 5000);
+  check_gesture(2, GESTURE_CLICKS, 1, 4299);
+  assert(s_ngestures == 3);
+}
+
+// Bouncy button: contacts chatter for a few milliseconds on each edge, and
+// noise spikes hit the line now and then. The line is masked after the
+// first edge, so there must be one IRQ per edge, and no extra wake-ups
+static void bouncy(bool pressed, bool chatter) {
+  for (int i = chatter ? rand() % 8 : 0; i > 0; i--) {
+    btn(i % 2 == 0 ? !pressed : pressed);
+    time_advance((uint64_t) (rand() % 2));
+  }
+  btn(pressed);
+}
+
+static unsigned bouncy_clicks(int n, bool chatter, unsigned *spikes) {
+  unsigned sleeps = g_sleeps.light + g_sleeps.deep, irqs = s_btn_irqs;
+  srand(3);
+  *spikes = 0;
+  for (int i = 0; i < n; i++) {
+    if (rand() % 4 == 0) {  // Spike: line glitches and comes back
+      btn(true);
+      time_advance(1);
+      btn(false);
+      run_for(DEBOUNCE_MS + 1);
+      assert(s_state == STATE_SLEEP && !s_btn_pressed);
+      (*spikes)++;
+    }
+    bouncy(true, chatter);
+    run_for(CLICK_MS);
+    assert(s_btn_pressed);
+    bouncy(false, chatter);
+    run_for(NEXT_PRESS_MS);
+    assert(!s_btn_pressed && s_state == STATE_SHOW_TIME);
+    run_for(TIMEOUT_MS);
+    assert(s_state == STATE_SLEEP);
+  }
+  assert(s_btn_irqs - irqs == 2 * (unsigned) n + *spikes);
+  return g_sleeps.light + g_sleeps.deep - sleeps;
+}
+
+static void test_bounce(void) {
+  unsigned spikes, clean = bouncy_clicks(100, false, &spikes);
+  unsigned noisy = bouncy_clicks(100, true, &spikes);
+  assert(spikes > 0);
+  assert(noisy <= clean + clean / 50);  // Chatter shifts times a bit
+}
+
+// Memory telemetry: incremental high-water mark, interrupt nesting, free
+// stack trend, crash records. Then firmware on simulated RAM: stack growth
+// report, and an overflow into the guard
+static void test_mem(void) {
+  uint32_t ram[64], *sp = ram + 56, *p, *guard;
+  struct mem m;
+  struct mem_crash c;
+  size_t len;
+  for (p = ram; p < sp; p++) *p = MEM_PAINT;
+  mem_init(&m, ram + 8, ram + 64, sp);
+  assert(mem_scan(&m) == MEM_CLEAN && m.low == sp);  // Nothing used yet
+  ram[54] = 1, ram[50] = 2;  // Deeper call, with untouched words between
+  assert(mem_scan(&m) == 56 - 50 + MEM_CLEAN && m.low == ram + 50);
+  assert(mem_scan(&m) == MEM_CLEAN);  // Next scan starts from the mark
+  assert(mem_stack_used(&m) == 14 * 4 && mem_stack_free(&m) == 42 * 4);
+
+  ram[20] = 3;  // Below a clean run, scans miss it. Sampled sp does not
+  mem_scan(&m);
+  assert(m.low == ram + 50);
+  mem_irq_enter(&m, ram + 20);
+  mem_irq_enter(&m, ram + 30);  // Nested
+  assert(m.low == ram + 20 && m.irq_depth == 2 && m.irq_depth_max == 2);
+  mem_irq_exit(&m), mem_irq_exit(&m);
+  assert(m.irq_depth == 0 && m.irq_depth_max == 2);
+  for (p = ram; p < ram + 20; p++) *p = 0;  // All the way down
+  mem_scan(&m);
+  assert(m.low == ram + 8 && mem_stack_free(&m) == 0);
+
+  // Trend: one sample every MEM_TREND_TICKS, MEM_TREND kept
+  mem_init(&m, ram + 8, ram + 64, sp);
+  for (int i = 0; i < MEM_TREND_TICKS * (MEM_TREND + 2); i++) {
+    if (i % MEM_TREND_TICKS == 0) m.low--;  // Grows one word per sample
+    mem_tick(&m);
+    if (i == MEM_TREND_TICKS - 1) assert(m.ntrend == 1 && mem_trend(&m) == 0);
+  }
+  assert(m.ntrend == MEM_TREND && mem_trend(&m) == (MEM_TREND - 1) * 4);
+
+  mem_crash_save(&c, 1, 2, 3, 4, 5);
+  assert(mem_crash_valid(&c));
+  c.pc ^= 0x100;  // Random RAM after power-up is not a crash record
+  assert(!mem_crash_valid(&c));
+
+  // Firmware: guard right above .bss, stack above the guard. The last boot
+  // was a wake-up from Standby, which leaves scans off: boot cold
+  SystemInit();
+  mem_setup(true);
+  guard = (uint32_t *) g_mpu.base;
+  assert(g_mpu.size == MEM_GUARD_SIZE && guard >= ram_end());
+  assert(((uintptr_t) guard & (MEM_GUARD_SIZE - 1)) == 0);
+  assert(s_mem.bottom == guard + MEM_GUARD_SIZE / 4);
+  assert(s_mem.top == stack_top() && s_mem.low == g_sp);
+
+  // Stack growth is reported once, from the periodic task
+  memset(&g_uart, 0, sizeof(g_uart));
+  for (p = g_sp - 1; p >= g_sp - 100; p--) stack_write(p, 0);
+  log_task(NULL);
+  uart_isr();
+  assert(s_mem.low == g_sp - 100 && strncmp(g_uart.out, "Stack: ", 7) == 0);
+  len = g_uart.len;
+  log_task(NULL);
+  uart_isr();
+  assert(g_uart.len == len);
+
+  // Interrupt on a deep stack: stack pointer is sampled on entry
+  g_sp -= 200;
+  USART1_IRQHandler();
+  assert(s_mem.low == g_sp && s_mem.irq_depth == 0);
+  assert(s_mem.irq_depth_max == 1);
+
+  // Runaway recursion: the first store into the guard faults and resets
+  while (g_resets == 0) stack_write(--g_sp, 0);
+  assert(g_sp == guard + MEM_GUARD_SIZE / 4 - 1 && mem_crash_valid(&s_crash));
+  assert(s_crash.addr == (uint32_t) (uintptr_t) g_sp);
+  g_sp = stack_top() - 64;  // Reset: boot again, report the crash once
+  memset(&g_uart, 0, sizeof(g_uart));
+  mem_setup(true);
+  uart_isr();
+  assert(strncmp(g_uart.out, "Crash: ", 7) == 0 && !mem_crash_valid(&s_crash));
+  len = g_uart.len;
+  mem_setup(true);
+  uart_isr();
+  assert(g_uart.len == len);
+  memset(&g_uart, 0, sizeof(g_uart));
+}
+
+// Boot: a fresh RAM copy of the flash key/value store
+static struct kv kv_open(void) {
+  struct kv kv = {.base = flash_kv_base(),
+                  .page_size = FLASH_PAGE_SIZE,
+                  .npages = flash_kv_pages(),
+                  .erase = flash_erase,
+                  .write = flash_write,
+                  .read = flash_read};
+  kv_init(&kv);
+  assert(kv.reads <= kv.npages + 2 * FLASH_PAGE_SIZE / 8);  // Bounded
+  return kv;
+}
+
+// Flash key/value store: wear leveling, and power cuts at every byte
+static void test_kv(void) {
+  uint32_t expected[KV_KEYS], v, seed = 11;
+  uint32_t present = 0;  // Keys with an expected value
+  unsigned lo = UINT32_MAX, hi = 0;
+  struct kv kv;
+
+  memset(g_flash.mem, 0xff, sizeof(g_flash.mem));
+  kv = kv_open();
+  assert(kv.present == 0 && !kv_get(&kv, 1, &v));
+  assert(kv_set(&kv, 1, 42) && kv_get(&kv, 1, &v) && v == 42);
+  assert(g_flash.erases[0] == 1 && g_flash.writes == 3);  // Header, 1, done
+  assert(kv_set(&kv, 1, 42) && g_flash.writes == 3);  // Same value: no write
+  assert(!kv_set(&kv, KV_KEYS, 1));
+  kv = kv_open();
+  assert(kv_get(&kv, 1, &v) && v == 42 && kv.present == 2);
+
+  // Pages are taken in turn, so they wear evenly
+  for (uint32_t i = 0; i < 10000; i++) assert(kv_set(&kv, i % 3, i));
+  for (unsigned i = 0; i < FLASH_KV_PAGES; i++) {
+    if (g_flash.erases[i] < lo) lo = g_flash.erases[i];
+    if (g_flash.erases[i] > hi) hi = g_flash.erases[i];
+  }
+  assert(lo >= 9 && hi - lo <= 1);
+  kv = kv_open();
+  assert(kv_get(&kv, 0, &v) && v == 9999 && kv_get(&kv, 1, &v) && v == 9997);
+
+  // A record that fails ECC does not read: it is skipped like one cut
+  // short, and the value before it stays. The next one goes to a new page
+  assert(kv_set(&kv, 2, 7) && kv_set(&kv, 2, 8));
+  g_flash.ecc[(size_t) (kv_page(&kv, kv.page) + kv.pos - g_flash.mem) / 8 -
+              1] = true;
+  kv = kv_open();
+  assert(kv_get(&kv, 2, &v) && v == 7 && kv.pos == kv.page_size);
+  assert(kv_set(&kv, 2, 9));
+  kv = kv_open();
+  assert(kv_get(&kv, 2, &v) && v == 9);
+  for (uint8_t k = 0; k < KV_KEYS; k++) {
+    if (kv_get(&kv, k, &expected[k])) present |= 1U << k;
+  }
+
+  // Cut power after a random number of bytes, then boot. Every key has its
+  // last stored value, or the one being stored when power went
+  for (int iter = 0; iter < 3000; iter++) {
+    uint8_t key = 0;
+    uint32_t val = 0;
+    seed = seed * 1103515245 + 12345;
+    g_flash.budget = (long) (seed >> 8) % 6000;
+    for (int i = 0; i < 500; i++) {
+      seed = seed * 1103515245 + 12345;
+      key = (uint8_t) ((seed >> 16) % KV_KEYS), val = seed;
+      if (!kv_set(&kv, key, val)) break;
+      expected[key] = val, present |= 1U << key;
+      key = KV_KEYS;  // Stored: nothing is left in flight
+    }
+    g_flash.budget = -1;
+    kv = kv_open();
+    for (uint8_t k = 0; k < KV_KEYS; k++) {
+      bool found = kv_get(&kv, k, &v);
+      if (k == key && found && v == val) {
+        expected[k] = val, present |= 1U << k;
+      } else {
+        assert(found == ((present >> k) & 1));
+        assert(!found || v == expected[k]);
+      }
+    }
+  }
+  memset(g_flash.mem, 0xff, sizeof(g_flash.mem));
+  memset(g_flash.erases, 0, sizeof(g_flash.erases));
+  memset(g_flash.ecc, 0, sizeof(g_flash.ecc));
+}
+
+// Formatter against libc snprintf(), on random conversions of random values
+static void test_fmt(void) {
+  static const char *lens[] = {"hh", "h", "", "l", "ll", "z"};
+  static const char *strs[] = {"", "a", "set_leds", "0123456789abcdefghij"};
+  uint32_t seed = 7;
+  char f[32], a[128], b[128];
+  for (int i = 0; i < 200000; i++) {
+    uint64_t r;
+    int n = 0, w = 0, p = 0, want, got;
+    bool ws = false, ps = false;  // Width and precision are arguments
+    char conv;
+    size_t len, size;
+    seed ^= seed << 13, seed ^= seed >> 17, seed ^= seed << 5;
+    r = (uint64_t) seed << 32, seed ^= seed << 13, seed ^= seed >> 17;
+    seed ^= seed << 5, r |= seed;
+    conv = "diuxXcs"[r % 7];
+    len = conv == 'c' || conv == 's' ? 2 : (r >> 3) % 6;
+    f[n++] = '%';
+    if (r & BIT(8)) f[n++] = '-';
+    if ((r & BIT(9)) && conv != 'c' && conv != 's') f[n++] = '0';
+    if ((r & BIT(10)) && (conv == 'x' || conv == 'X')) f[n++] = '#';
+    if ((r & BIT(11)) && (conv == 'd' || conv == 'i')) f[n++] = '+';
+    if ((r & BIT(12)) && (conv == 'd' || conv == 'i')) f[n++] = ' ';
+    if (r & BIT(13)) n += sprintf(f + n, "%d", (int) ((r >> 14) % 13));
+    else if (r & BIT(18)) w = (int) ((r >> 19) % 25) - 12, ws = true;
+    if (ws) f[n++] = '*';
+    if ((r & BIT(24)) && conv != 'c') {
+      n += sprintf(f + n, ".%d", (int) ((r >> 25) % 8));
+    } else if ((r & BIT(28)) && conv != 'c') {
+      p = (int) ((r >> 29) % 10) - 2, ps = true, n += sprintf(f + n, ".*");
+    }
+    n += sprintf(f + n, "%s%c", lens[len], conv);
+    size = (r >> 40) % 4 == 0 ? (r >> 42) % 8 : sizeof(a);  // Truncate
+    if ((r >> 48) % 3 == 0) r &= 0xff;  // Small values, and negative ones
+    if ((r >> 48) % 3 == 1) r = ~r;
+
+#define FMT_BOTH(...)                        \
+  want = snprintf(a, size, __VA_ARGS__),     \
+  got = (int) fmt_snprintf(b, size, __VA_ARGS__)
+#define FMT_ARGS(v)                                          \
+  if (ws && ps) FMT_BOTH(f, w, p, v);                        \
+  else if (ws) FMT_BOTH(f, w, v);                            \
+  else if (ps) FMT_BOTH(f, p, v);                            \
+  else FMT_BOTH(f, v);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+    if (conv == 's') {
+      FMT_ARGS(strs[r % ARRAY_SIZE(strs)]);
+    } else if (conv == 'c') {
+      FMT_ARGS((int) (r % 95 + 32));
+    } else if (len == 5) {
+      FMT_ARGS((size_t) r);
+    } else if (len >= 3) {
+      FMT_ARGS((long long) r);  // Same size as long here
+    } else {
+      FMT_ARGS((int) r);
+    }
+#pragma GCC diagnostic pop
+    if (want != got || (size > 0 && strcmp(a, b) != 0)) {
+      fprintf(stderr, "fmt: '%s' %d %d: '%s' != '%s'\n", f, w, p, b, a);
+    }
+    assert(want == got && (size == 0 || strcmp(a, b) == 0));
+  }
+
+  // What the firmware logs
+  fmt_snprintf(b, sizeof(b), "%s -> %#04hx, %lu %ld %02x %5lu %%",
+               "set_leds", (unsigned short) 0x8421, 42UL, -7L, 0x5U, 3UL);
+  assert(strcmp(b, "set_leds -> 0x8421, 42 -7 05     3 %") == 0);
+  assert(fmt_snprintf(NULL, 0, "%d", -12345) == 6);
+}
+
+static void test_log(void) {
+  char buf[LOG_BUF_SIZE * 2];
+  unsigned polls;
+
+  // Output goes to the UART in the background, in order
+  memset(&g_uart, 0, sizeof(g_uart));
+  LOG("hello %d\n", 1);
+  assert(g_uart.len == 0 && g_uart.txe && log_busy());
+  LOG("world\n");
+  uart_isr();
+  assert(g_uart.len == 14 && memcmp(g_uart.out, "hello 1\nworld\n", 14) == 0);
+  assert(!log_busy() && !g_uart.txe && !g_uart.tc);
+
+  // Busy UART: light sleep only, to let the transmission finish
+  LOG("x");
+  loop();
+  assert(g_sleeps.light == 1 && g_sleeps.deep == 0);
+  uart_isr();
+  loop();
+  assert(g_sleeps.light == 1 && g_sleeps.deep == 1);
+
+  // Stalled line: writer never waits, excess output is dropped
+  memset(&g_uart, 0, sizeof(g_uart));
+  g_uart.stalled = true;
+  memset(buf, 'a', sizeof(buf));
+  assert(_write(1, buf, sizeof(buf)) == (int) sizeof(buf));
+  polls = g_uart.polls;
+  assert(s_log_dropped == LOG_BUF_SIZE && polls == 0 && g_uart.len == 0);
+  LOG("lost\n");
+  assert(s_log_dropped == LOG_BUF_SIZE + 5 && g_uart.polls == polls);
+  g_uart.stalled = false;
+  uart_isr();
+  assert(g_uart.len == LOG_BUF_SIZE && !log_busy());
+  s_log_dropped = 0;
+  memset(&g_uart, 0, sizeof(g_uart));
+  memset(&g_sleeps, 0, sizeof(g_sleeps));
+}
+
+// Decode captured UART output as tokenized records, compare with expected
+static void check_logt(const char **expected, size_t n) {
+  size_t ofs = 0, i = 0;
+  char text[256];
+  uint64_t time;
+  uart_isr();
+  while (ofs < g_uart.len) {
+    size_t len = (uint8_t) g_uart.out[ofs++];
+    assert(ofs + len <= g_uart.len && i < n);
+    assert(logt_decode(__start_logstr, (size_t) (__stop_logstr - __start_logstr),
+                       (uint8_t *) &g_uart.out[ofs], len, &time, text,
+                       sizeof(text)));
+    assert(time == now_ms());
+    assert(strcmp(text, expected[i]) == 0);
+    ofs += len, i++;
+  }
+  assert(i == n);
+  memset(&g_uart, 0, sizeof(g_uart));
+}
+
+static void test_logt(void) {
+  char e[6][64];
+  const char *expected[] = {e[0], e[1], e[2], e[3], e[4], e[5]};
+  long big = -1234567890L;
+  unsigned long ul = 4000000000UL;
+
+  memset(&g_uart, 0, sizeof(g_uart));
+  time_set(123456);
+  LOGT("no args\n");
+  LOGT("%s -> %d, tick %lu\n", __func__, STATE_SET_HOURS, ul);
+  LOGT("%s -> %#04hx\n", "set_leds", (unsigned short) 0x88);
+  LOGT("Setting minutes: %d. Offset: %ld, tick: %lu\n", -7, big, 0UL);
+  LOGT("%5d|%-4u|%x|%c|%% %.3s", 42, 7U, 0xbeefU, 'z', "abcdef");
+  LOGT("%s", "this string is longer than the limit");
+  snprintf(e[0], sizeof(e[0]), "no args\n");
+  snprintf(e[1], sizeof(e[1]), "%s -> %d, tick %lu\n", __func__,
+           STATE_SET_HOURS, ul);
+  snprintf(e[2], sizeof(e[2]), "%s -> %#04hx\n", "set_leds",
+           (unsigned short) 0x88);
+  snprintf(e[3], sizeof(e[3]), "Setting minutes: %d. Offset: %ld, tick: %lu\n",
+           -7, big, 0UL);
+  snprintf(e[4], sizeof(e[4]), "%5d|%-4u|%x|%c|%% %.3s", 42, 7U, 0xbeefU, 'z',
+           "abcdef");
+  snprintf(e[5], sizeof(e[5]), "%.*s", LOGT_MAX_STRING,
+           "this string is longer than the limit");
+  check_logt(expected, 6);
+
+  // Records are compact: a short message with two numbers takes a few bytes
+  LOGT("%s -> %d, tick %lu\n", "set_state", 1, 123456UL);
+  assert(g_uart.len == 0);
+  uart_isr();
+  assert(g_uart.len <= 1 + 2 + 3 + 1 + 9 + 1 + 3);  // Text takes 28 bytes
+
+  // Whole records are dropped when the log buffer is full
+  memset(&g_uart, 0, sizeof(g_uart));
+  g_uart.stalled = true;
+  LOGT("%d %d\n", 1000, 2000);
+  size_t rec = ring_len(&s_log);
+  for (int i = 0; i < LOG_BUF_SIZE; i++) LOGT("%d %d\n", 1000, 2000);
+  assert(s_log_dropped > 0 && s_log_dropped % rec == 0);
+  assert(ring_len(&s_log) % rec == 0);
+  g_uart.stalled = false;
+  s_log_dropped = 0;
+  uart_isr();
+  memset(&g_uart, 0, sizeof(g_uart));
+  time_set(0);
+}
+
+// Check that LED animation plays given frames, waking up only when needed
+static void check_frames(const struct frame *frames, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint64_t end = now_ms() + frames[i].duration;
+    while (now_ms() < end) {
+      assert(get_led_mask() == frames[i].mask);
+      wake_up();
+    }
+    assert(now_ms() == end);
+  }
+}
+
+// Profiler: histogram buckets, probes hit by the tests, and the UART dump
+static void test_prof(void) {
+  struct prof p = {0};
+  size_t len;
+  prof_record(&p, 0);
+  prof_record(&p, 1);
+  prof_record(&p, 3);
+  prof_record(&p, 1024);
+  prof_record(&p, UINT32_MAX);
+  assert(p.count == 5 && p.min == 0 && p.max == UINT32_MAX);
+  assert(p.sum == 1028ULL + UINT32_MAX);
+  assert(p.hist[0] == 2 && p.hist[1] == 1 && p.hist[10] == 1);
+  assert(p.hist[PROF_BUCKETS - 1] == 1);  // Longer ones go to the last
+
+  for (size_t i = 0; i < PROF_NUM_PROBES; i++) {
+    uint32_t n = 0;
+    for (size_t j = 0; j < PROF_BUCKETS; j++) n += s_prof[i].hist[j];
+    assert(s_prof[i].count > 0 && n == s_prof[i].count);
+    assert(s_prof[i].min <= s_prof[i].max);
+  }
+
+  // Dump on request, one probe per wake-up
+  uart_isr();
+  memset(&g_uart, 0, sizeof(g_uart));
+  uart_rx("p", 1);
+  for (size_t i = 0; i < PROF_NUM_PROBES; i++) {
+    len = g_uart.len;
+    loop();
+    uart_isr();
+    assert(g_uart.len > len);
+    assert(strncmp(g_uart.out + len, s_prof_names[i],
+                   strlen(s_prof_names[i])) == 0);
+    assert(g_uart.out[g_uart.len - 1] == '\n');
+  }
+  len = g_uart.len;
+  loop();
+  assert(g_uart.len == len);  // Done
+  memset(&g_uart, 0, sizeof(g_uart));
+  run_for(RX_WINDOW_MS);
+  assert(!s_rx_on);
+}
+
+// Time sync host, with its own clock. Frames take up ms to get to the
+// watch, and down ms to come back, time on the wire included
+#define HOST_OFFSET_US 1234567890123LL  // Host clock minus watch clock
+static int32_t s_host_ppb;               // Host clock runs faster by that
+static int64_t host_us(void) {
+  int64_t ms = (int64_t) now_ms();
+  return ms * 1000 + ms * s_host_ppb / 1000000 + HOST_OFFSET_US;
+}
+
+static bool host_send(const struct tsync_msg *m, unsigned up, unsigned down,
+                      struct tsync_msg *reply) {
+  uint8_t buf[TSYNC_FRAME_SIZE];
+  struct tsync_parser p = {0};
+  size_t ofs = g_uart.len;
+  tsync_encode(m, buf);
+  time_set(now_ms() + up);
+  uart_rx(buf, sizeof(buf));
+  for (int i = 0; i < 3; i++) loop(), uart_isr();  // Log output goes first
+  time_set(now_ms() + down);
+  while (ofs < g_uart.len) {  // Pick the frame from log output
+    if (tsync_feed(&p, (uint8_t) g_uart.out[ofs++], reply) > 0) return true;
+  }
+  return false;
+}
+
+static uint32_t watch_tod(void) {  // Wall clock, ms into the day
+  wclock_update(&s_wclock, now_ms());
+  return wclock_tod_ms(&s_wclock);
+}
+
+static int32_t watch_error(void) {  // Wall clock minus host clock, ms
+  int64_t host = host_us() / 1000 % (int64_t) WCLOCK_DAY_MS;
+  return (int32_t) ((int64_t) watch_tod() - host);
+}
+
+// Sync like tools/timesync.c does, with symmetric delays
+static void host_sync(void) {
+  int64_t t1, offset, delay, host;
+  struct tsync_msg m = {TSYNC_REQ, 0, 0, 0, 0}, r;
+  m.a = (uint32_t) (t1 = host_us());
+  assert(host_send(&m, 2, 2, &r) && r.type == TSYNC_REPLY);
+  tsync_sample(t1, r.b, r.c, host_us(), &offset, &delay);
+  m = (struct tsync_msg) {TSYNC_SET, 1, 0, 0, 0};
+  m.a = tsync_watch_time(host_us(), offset, &host);
+  m.b = (uint32_t) (((host + 500) / 1000) % WCLOCK_DAY_MS);
+  assert(host_send(&m, 2, 2, &r) && r.type == TSYNC_ACK);
+}
+
+// Time sync protocol: framing, and a sync over a simulated wire
+static void test_tsync(void) {
+  static const unsigned delays[][2] = {{5, 1}, {2, 2}, {1, 6}, {4, 3}};
+  struct tsync_msg m = {TSYNC_REPLY, 7, 1, 0x12345678, 0xffffffff}, r;
+  struct tsync_parser p = {0};
+  uint8_t buf[TSYNC_FRAME_SIZE], in[3 * TSYNC_FRAME_SIZE];
+  int64_t t1, offset, delay, best = INT64_MAX, best_offset = 0, host;
+  size_t i, n = 0;
+  int type = 0;
+
+  // Frames are found among other bytes, and bad ones are dropped
+  tsync_encode(&m, buf);
+  in[n++] = 'p', in[n++] = TSYNC_MAGIC0;
+  memcpy(in + n, buf, sizeof(buf)), n += sizeof(buf);
+  memcpy(in + n, buf, sizeof(buf)), in[n + 5] ^= 1, n += sizeof(buf);
+  for (i = 0; i < n; i++) {
+    int t = tsync_feed(&p, in[i], &r);
+    assert(i == 0 ? t == -1 : t >= 0);
+    if (t > 0) type = t, assert(i == 1 + sizeof(buf));
+  }
+  assert(type == TSYNC_REPLY && memcmp(&r, &m, sizeof(m)) == 0);
+  assert(tsync_feed(&p, 0x42, &r) == -1);  // Nothing is left over
+
+  // Symmetric delays give the offset exactly
+  tsync_sample(1000000, 2000, 2005, 1009000, &offset, &delay);
+  assert(offset == 998000 && delay == 4000);
+
+  // Watch answers requests with its receive and transmit time
+  memset(&g_uart, 0, sizeof(g_uart));
+  for (i = 0; i < ARRAY_SIZE(delays); i++) {
+    m = (struct tsync_msg) {TSYNC_REQ, (uint8_t) i, 0, 0, 0};
+    m.a = (uint32_t) (t1 = host_us());
+    assert(host_send(&m, delays[i][0], delays[i][1], &r));
+    assert(r.type == TSYNC_REPLY && r.seq == i && r.a == m.a);
+    assert(r.b == r.c && r.b == (uint32_t) ((t1 - HOST_OFFSET_US) / 1000 +
+                                            delays[i][0]));
+    tsync_sample(t1, r.b, r.c, host_us(), &offset, &delay);
+    if (delay < best) best = delay, best_offset = offset;
+  }
+  offset = (int64_t) (uint32_t) now_ms() * 1000 - host_us();  // 32-bit
+  assert(best == 4000 && best_offset == offset);
+  assert(s_rx_on && s_op == OP_LOG);
+
+  // Set time of day at the next watch millisecond, off by at most 1 ms
+  m = (struct tsync_msg) {TSYNC_SET, 9, 0, 0, 0};
+  m.a = tsync_watch_time(host_us(), best_offset, &host);
+  m.b = (uint32_t) (((host + 500) / 1000) % WCLOCK_DAY_MS);
+  assert(host_send(&m, 3, 3, &r));
+  assert(r.type == TSYNC_ACK && r.seq == 9 && r.b + 3 == watch_tod());
+  run_for(12345);
+  assert(watch_error() >= -1 && watch_error() <= 1);
+
+  // Receiver is turned off after a while, and the idle watch goes to
+  // Standby. Then a long press wakes it up, and turns the receiver on
+  run_for(RX_WINDOW_MS);
+  assert(!s_rx_on && g_standby.sbf && s_op == OP_LOW);
+  btn(true);
+  run_for(LONG_PRESS_MS);
+  btn(false);
+  assert(s_rx_on && s_op == OP_LOG && s_state == STATE_SLEEP);
+  run_for(RX_WINDOW_MS);
+  assert(!s_rx_on);
+  memset(&g_uart, 0, sizeof(g_uart));
+}
+
+// Event trace: the ring, text lines, what the firmware records, and the
+// dump over the UART
+static void test_trace(void) {
+  static const uint32_t click[][2] = {{TRACE_EDGE, 0},
+                                      {TRACE_BUTTON, 1},
+                                      {TRACE_EDGE, 1},
+                                      {TRACE_BUTTON, 0},
+                                      {TRACE_STATE, STATE_SHOW_TIME}};
+  static struct trace t;
+  struct tsync_msg m = {TSYNC_TRACE, 3, 0, 0, 0}, r;
+  struct tsync_parser p = {0};
+  uint8_t buf[TSYNC_FRAME_SIZE];
+  uint32_t time, value, n = 0;
+  unsigned type, first, end;
+  bool acked = false;
+  char line[64];
+
+  // The ring keeps the newest records
+  for (uint32_t i = 0; i < TRACE_SIZE + 5; i++) {
+    trace_add(&t, i, TRACE_EDGE, i & 1);
+  }
+  assert(trace_first(&t) == 5 && trace_end(&t) == TRACE_SIZE + 5);
+  assert(trace_get(&t, 5)->time == 5 && trace_get(&t, 6)->value == 0);
+
+  // Text lines, and back
+  trace_format(line, sizeof(line), 1234, TRACE_LEDS, 0x88);
+  assert(strcmp(line, "1234 leds 0x88\n") == 0);
+  assert(trace_parse(line, &time, &type, &value));
+  assert(time == 1234 && type == TRACE_LEDS && value == 0x88);
+  assert(!trace_parse("# time_ms event value\n", &time, &type, &value));
+  assert(!trace_parse("12 bogus 3\n", &time, &type, &value));
+
+  // A click: the edges, the levels that settled, then state and LEDs
+  first = trace_end(&s_trace);
+  clicks(1);
+  for (unsigned i = 0; i < ARRAY_SIZE(click); i++) {
+    const struct trace_rec *rec = trace_get(&s_trace, first + i);
+    assert(rec->type == click[i][0] && rec->value == click[i][1]);
+  }
+  assert(trace_get(&s_trace, first)->time + NEXT_PRESS_MS + CLICK_MS ==
+         trace_get(&s_trace, first + 4)->time);
+  assert(trace_get(&s_trace, first + 5)->type == TRACE_LEDS);
+  assert(trace_get(&s_trace, first + 5)->value == get_led_mask());
+  assert(trace_end(&s_trace) == first + 6);
+
+  // Dump on request: time of day and settings, the records oldest first,
+  // then an acknowledgement with their number, over a few wake-ups
+  uart_isr();
+  memset(&g_uart, 0, sizeof(g_uart));
+  first = trace_first(&s_trace), end = trace_end(&s_trace);
+  tsync_encode(&m, buf);
+  uart_rx(buf, sizeof(buf));
+  for (int i = 0; i < 10; i++) loop(), uart_isr();
+  for (size_t ofs = 0; ofs < g_uart.len; ofs++) {
+    int t = tsync_feed(&p, (uint8_t) g_uart.out[ofs], &r);
+    if (t == TSYNC_TRACE && n < 3) {
+      static const uint32_t header[] = {0, TIMEOUT_MS, NEXT_PRESS_MS};
+      assert(r.seq == 3 && r.b == TRACE_DUMP + n);
+      assert(r.c == (n == 0 ? watch_tod() : header[n]));
+      n++;
+    } else if (t == TSYNC_TRACE) {
+      const struct trace_rec *rec = trace_get(&s_trace, first + n++ - 3);
+      assert(r.a == rec->time && r.b == rec->type && r.c == rec->value);
+    } else if (t == TSYNC_ACK) {
+      assert(r.seq == 3 && r.a == end - first && n == r.a + 3);
+      acked = true;
+    }
+  }
+  assert(acked && end - first == TRACE_SIZE && s_trace_seq < 0);
+  run_for(RX_WINDOW_MS);
+  assert(!s_rx_on && !g_standby.sbf);
+  memset(&g_uart, 0, sizeof(g_uart));
+}
+
+// Standby after an idle period, and a wake-up by the button: the time
+// comes from the RTC and backup registers, LEDs light before the rest of
+// setup(), RAM is not painted, and the press counts as a click
+static void test_standby(void) {
+  uint64_t start;
+  uint32_t tod;
+  struct wclock c = {0};
+  assert(g_standby.entries == 0);  // Never idle long enough so far
+  run_for(STANDBY_IDLE_MS - (now_ms() - s_active) - 1);
+  assert(!g_standby.sbf && s_alarm < UINT64_MAX);
+  start = s_drift.start = now_ms() - 1000;  // A drift interval is going
+  s_drift.started = true, s_drift.error = 7;
+  run_for(2);
+  assert(g_standby.sbf && g_standby.entries > 0 && s_alarm == UINT64_MAX);
+  tod = watch_tod();
+
+  // An hour and a half later, RAM is lost, the button wakes us up
+  time_set(now_ms() + 90 * WCLOCK_MINUTE_MS);
+  memset(&s_wclock, 0, sizeof(s_wclock));
+  memset(&s_drift, 0, sizeof(s_drift));
+  memset(&g_uart, 0, sizeof(g_uart));
+  g_ram[0] = 0;
+  btn(true);
+  wclock_set_ms(&c, (tod + 90 * WCLOCK_MINUTE_MS) % WCLOCK_DAY_MS, 0);
+  assert(s_woken && !g_standby.sbf && g_ram[0] == 0);
+  assert(get_led_mask() == wclock_led_mask(c.hours, c.minutes));
+  assert(watch_tod() == wclock_tod_ms(&c));
+  assert(s_drift.started && s_drift.start == start && s_drift.error == 7);
+  assert(s_prof[PROF_wake].count == 1);
+  assert(strstr(g_uart.out, "Wake: LEDs on") != NULL);
+  assert(s_state == STATE_SLEEP);
+
+  // Release: a single click, the time stays on for the display timeout
+  run_for(CLICK_MS);
+  btn(false);
+  run_for(NEXT_PRESS_MS);
+  assert(s_state == STATE_SHOW_TIME);
+  assert(get_led_mask() == wclock_led_mask(c.hours, c.minutes));
+  run_for(TIMEOUT_MS - NEXT_PRESS_MS - CLICK_MS + 1);
+  assert(s_state == STATE_SLEEP && get_led_mask() == 0);
+
+  // Any other reset is a cold boot: RAM is painted, time comes from flash
+  SystemInit();
+  setup();
+  uart_isr();
+  assert(!s_woken && g_ram[0] == MEM_PAINT && watch_tod() == tod);
+}
+
+// Jump to the next RTC event: its interrupt, or a reset in Standby
+static void rtc_wake(void) {
+  time_set(rtc_next());
+  if (g_standby.sbf) {
+    SystemInit();
+    setup();
+  } else if (rtc_pending() & RTC_ALARM) {
+    RTC_Alarm_IRQHandler();
+  } else {
+    RTC_WKUP_IRQHandler();
+  }
+  loop();
+  uart_isr();
+}
+
+static uint32_t last_boot(void) {  // Value of the last boot trace record
+  uint32_t value = UINT32_MAX;
+  for (unsigned i = trace_first(&s_trace); i != trace_end(&s_trace); i++) {
+    const struct trace_rec *r = trace_get(&s_trace, i);
+    if (r->type == TRACE_BOOT) value = r->value;
+  }
+  return value;
+}
+
+// Countdown and alarm, set by presses. The RTC keeps them: the watch goes
+// to Standby, and nothing wakes it up until they fire, then it rings
+static void test_alarm(void) {
+  uint64_t start, until;
+  unsigned entries;
+  uint32_t v;
+
+  // Countdown of 3 minutes. It starts when the display goes off
+  assert(rtc_next() == UINT64_MAX);
+  clicks(2);
+  assert(s_state == STATE_SET_TIMER && get_led_mask() == 0xcccc);
+  click(), click(), click();
+  assert(get_led_mask() == wclock_led_mask(0, 3));
+  run_for(NEXT_PRESS_MS + TIMEOUT_MS + 2);
+  assert(s_state == STATE_SLEEP && get_led_mask() == 0);
+  start = rtc_next() - 3 * WCLOCK_MINUTE_MS;  // Display went off then
+  assert(start <= now_ms() && now_ms() - start < NEXT_PRESS_MS + 2 * CLICK_MS);
+
+  // Idle: Standby, with no wake-up but the RTC, which boots us up to ring
+  entries = g_standby.entries;
+  run_for(STANDBY_IDLE_MS + LOG_PERIOD_MS);
+  assert(g_standby.sbf && g_standby.entries > entries);
+  assert(s_alarm == UINT64_MAX);
+  rtc_wake();
+  assert(now_ms() == start + 3 * WCLOCK_MINUTE_MS && last_boot() == 2);
+  assert(s_woken && s_state == STATE_RINGING && get_led_mask() == 0xffff);
+  assert(!s_gesture.pressed && s_countdown == 0);
+  assert(rtc_next() == UINT64_MAX);  // One-shot
+  run_for(ARRAY_SIZE(s_ring) / 4 * 1000 + 1);
+  assert(s_state == STATE_SLEEP && get_led_mask() == 0);
+
+  // Alarm at 08:02, 5 clicks and 8 presses for hours, 6 clicks and 2
+  // presses for minutes. Saved to flash, and armed for that time of day
+  clicks(5);
+  assert(s_state == STATE_SET_ALARM_HOURS && get_led_mask() == 0x3333);
+  for (int i = 0; i < 8; i++) click();
+  assert(get_led_mask() == wclock_led_mask(8, 0));
+  run_for(NEXT_PRESS_MS + TIMEOUT_MS + 2);
+  clicks(6);
+  assert(s_state == STATE_SET_ALARM_MINUTES && get_led_mask() == 0xcccc);
+  click(), click();
+  assert(get_led_mask() == wclock_led_mask(0, 2));
+  run_for(NEXT_PRESS_MS + TIMEOUT_MS + 2);
+  assert(kv_get(&s_kv, KV_ALARM, &v) && v == 0x0802);
+  until = (8 * WCLOCK_HOUR_MS + 2 * WCLOCK_MINUTE_MS + WCLOCK_DAY_MS -
+           watch_tod()) % WCLOCK_DAY_MS;
+  until += now_ms();  // Rounded up to a second
+  assert(rtc_next() >= until && rtc_next() < until + 1000);
+
+  // Time set to just before: it fires while the time is shown, in STOP2.
+  // A press stops the ring, the click shows the time
+  wclock_set(&s_wclock, 0x08, 0x01, now_ms());
+  s_wclock.ms = 59000;
+  time_save();
+  assert(rtc_next() >= now_ms() + 1000 && rtc_next() < now_ms() + 2000);
+  clicks(1);
+  assert(s_state == STATE_SHOW_TIME && !g_standby.sbf);
+  rtc_wake();
+  assert(s_state == STATE_RINGING && get_led_mask() == 0xffff);
+  assert(watch_tod() / WCLOCK_MINUTE_MS == 8 * 60 + 2);
+  btn(true);
+  run_for(CLICK_MS);
+  assert(s_state == STATE_SLEEP && get_led_mask() == 0);
+  btn(false);
+  run_for(NEXT_PRESS_MS);
+  assert(s_state == STATE_SHOW_TIME);
+  assert(get_led_mask() == wclock_led_mask(0x08, 0x02));
+  run_for(TIMEOUT_MS);
+
+  // Next day, from Standby. Then off: hours go on to 24, after 23
+  entries = g_standby.entries;
+  run_for(STANDBY_IDLE_MS + LOG_PERIOD_MS);
+  assert(g_standby.sbf && g_standby.entries > entries && s_alarm == UINT64_MAX);
+  start = now_ms();
+  rtc_wake();
+  assert(s_state == STATE_RINGING && last_boot() == 2);
+  assert(watch_tod() >= 8 * WCLOCK_HOUR_MS + 2 * WCLOCK_MINUTE_MS);
+  assert(watch_tod() < 8 * WCLOCK_HOUR_MS + 2 * WCLOCK_MINUTE_MS + 1000);
+  assert(now_ms() - start > WCLOCK_DAY_MS - STANDBY_IDLE_MS - 5000);
+  btn(true);
+  run_for(CLICK_MS);
+  btn(false);
+  run_for(NEXT_PRESS_MS + TIMEOUT_MS);
+  clicks(5);
+  for (int i = 0; i < 24; i++) click();
+  assert(get_led_mask() == wclock_led_mask(ALARM_OFF, 0));
+  run_for(NEXT_PRESS_MS + TIMEOUT_MS + 2);
+  assert(s_alarm_hours == ALARM_OFF && rtc_next() == UINT64_MAX);
+  assert(kv_get(&s_kv, KV_ALARM, &v) && v == (ALARM_OFF << 8 | 0x02));
+}
+
+// Drift correction: learning, the trimmed wall clock, and syncs with a
+// host whose clock runs faster
+static void test_drift(void) {
+  struct drift d = {0};
+  struct wclock c = {0};
+  int32_t expected;
+
+  assert(!drift_sync(&d, 5000, 0));  // First sync starts an interval
+  assert(!drift_sync(&d, 1, DRIFT_MIN_MS / 2));  // Too short, error adds up
+  assert(drift_sync(&d, 2, DRIFT_MIN_MS) && d.ppb == 833 && d.samples == 1);
+  assert(!drift_sync(&d, 10000, 2 * DRIFT_MIN_MS));  // Too far off: restart
+  assert(d.ppb == 833);
+  assert(drift_sync(&d, 36, 3 * DRIFT_MIN_MS));  // 10000 more, half of it
+  assert(d.ppb == 5833 && d.samples == 2);
+  d = (struct drift) {0};
+  assert(!drift_sync(&d, 0, 0));
+  assert(drift_sync(&d, 10000, 3 * DRIFT_MIN_MS) && d.ppb == DRIFT_MAX_PPB);
+  assert(drift_trim(DRIFT_MAX_PPB) == 2147483 && drift_trim(-1000) == -4294);
+
+  // Fractions of a millisecond carry over: 100 ppm in 7 ms steps
+  c.trim = drift_trim(100000);
+  for (uint64_t t = 0; t < 600000; t += 7) wclock_update(&c, t);
+  wclock_update(&c, 600000);
+  assert(wclock_tod_ms(&c) >= 600059 && wclock_tod_ms(&c) <= 600060);
+  c.trim = drift_trim(-100000), c.synced = 0, c.frac = 0;
+  wclock_update(&c, WCLOCK_DAY_MS);
+  assert(wclock_tod_ms(&c) == 600060 - 8640 - 1);
+
+  // Syncs three hours apart with a host 37 ppm ahead. The first one only
+  // starts an interval, the second learns, then the wall clock keeps up
+  s_host_ppb = 37000;
+  memset(&g_uart, 0, sizeof(g_uart));
+  host_sync();
+  assert(s_drift.started && s_drift.samples == 0);
+  time_set(now_ms() + 3 * DRIFT_MIN_MS);
+  loop();
+  expected = 37000 * 3 * 3600 / 1000000;  // Behind by that, ms
+  assert(watch_error() >= -expected - 2 && watch_error() <= -expected + 2);
+  host_sync();
+  assert(s_drift.samples == 1);
+  assert(s_drift.ppb > 37000 - 200 && s_drift.ppb < 37000 + 200);
+  assert(s_wclock.trim == drift_trim(s_drift.ppb));
+  time_set(now_ms() + 3 * DRIFT_MIN_MS);
+  loop();
+  assert(watch_error() >= -3 && watch_error() <= 3);
+  host_sync();
+  assert(s_drift.samples == 2);
+  assert(s_drift.ppb > 37000 - 200 && s_drift.ppb < 37000 + 200);
+
+  // Setting time by hand restarts the interval
+  clicks(3);
+  click();
+  run_for(NEXT_PRESS_MS + TIMEOUT_MS + 2);
+  assert(!s_drift.started);
+
+  // Correction survives a reset, and a power loss, which clears backup
+  // registers, from flash
+  expected = s_drift.ppb;
+  memset(&s_drift, 0, sizeof(s_drift));
+  s_wclock.trim = 0;
+  drift_setup();
+  assert(s_drift.ppb == expected && s_wclock.trim == drift_trim(expected));
+  memset(g_bkp, 0, sizeof(g_bkp));
+  memset(&s_drift, 0, sizeof(s_drift));
+  kv_setup();
+  drift_setup();
+  assert(s_drift.ppb == expected && g_bkp[BKP_DRIFT] == (uint32_t) expected);
+  drift_set(0);
+  s_host_ppb = 0;
+  run_for(RX_WINDOW_MS);
+  uart_isr();
+  memset(&g_uart, 0, sizeof(g_uart));
+}
+
+// Settings over the UART, and the time of day, come back from flash on boot
+static void test_settings(void) {
+  struct tsync_msg m = {TSYNC_CONF, 3, TSYNC_TIMEOUT_MS, 1000, 0}, r;
+  uint32_t tod;
+  unsigned writes;
+
+  memset(&g_uart, 0, sizeof(g_uart));
+  assert(host_send(&m, 1, 1, &r) && r.type == TSYNC_ACK && r.seq == 3);
+  assert(r.a == TSYNC_TIMEOUT_MS && r.b == 1000);
+  assert(s_show[0].duration == 1000 && s_blink2[4].duration == 1000);
+  m = (struct tsync_msg) {TSYNC_CONF, 4, TSYNC_CLICK_GAP_MS, 5, 0};
+  assert(host_send(&m, 1, 1, &r) && r.b == NEXT_PRESS_MS);  // Out of range
+  assert(s_gesture_cfg.click_gap_ms == NEXT_PRESS_MS);
+  clicks(1);
+  assert(s_state == STATE_SHOW_TIME);
+  run_for(1000 + 1);
+  assert(s_state == STATE_SLEEP);  // Display timeout is shorter now
+
+  // Time of day is saved every hour
+  writes = g_flash.writes;
+  time_set(now_ms() + KV_TIME_PERIOD_MS);
+  loop();
+  assert(g_flash.writes == writes + 1);
+
+  // Reboot, not from Standby
+  tod = watch_tod();
+  memset(&s_wclock, 0, sizeof(s_wclock));
+  s_woken = false;
+  s_show[0].duration = TIMEOUT_MS;
+  kv_setup();
+  assert(wclock_tod_ms(&s_wclock) == tod && s_show[0].duration == 1000);
+  m = (struct tsync_msg) {TSYNC_CONF, 5, TSYNC_TIMEOUT_MS, TIMEOUT_MS, 0};
+  assert(host_send(&m, 1, 1, &r) && s_show[0].duration == TIMEOUT_MS);
+  run_for(RX_WINDOW_MS);
+  memset(&g_uart, 0, sizeof(g_uart));
+}
+
+// Battery power policy. VDD comes from VREFINT, levels go down with it, and
+// back up with some margin. As the cell drains, the watch samples it at the
+// end of a display, at most every hour, and steps down: dimmer, shorter,
+// quiet, then a low battery sign before the time
+static void glance(uint16_t timeout) {  // Click, and wait the display out
+  clicks(1);
+  assert(s_state == STATE_SHOW_TIME);
+  run_for(timeout + 1);
+  assert(s_state == STATE_SLEEP);
+}
+
+static void test_power(void) {
+  static const struct power_level t[] = {
+      {2800, 0, 0, true, false}, {2600, 0, 0, true, false},
+      {0, 0, 0, false, true}};
+  unsigned reads = g_battery.reads, full;
+
+  assert(power_vdd_mv(VREFINT_CAL, VREFINT_CAL) == 3000);
+  assert(power_vdd_mv(VREFINT_CAL * 3 / 2, VREFINT_CAL) == 2000);
+  assert(power_vdd_mv(0, VREFINT_CAL) == 0);
+  g_battery.used = 775;  // Half way from 2850 mV at 70% to 2750 at 85%
+  assert(battery_mv() == 2800);
+  assert(power_vdd_mv(adc_vrefint(), VREFINT_CAL) - 2800U + 2 <= 4);
+  g_battery.used = 1200;  // Past the end of the curve
+  assert(battery_mv() == 2000);
+  assert(power_level(t, 3, 0, 2800) == 0 && power_level(t, 3, 0, 2799) == 1);
+  assert(power_level(t, 3, 0, 2500) == 2);
+  assert(power_level(t, 3, 1, 2899) == 1 && power_level(t, 3, 1, 2900) == 0);
+  assert(power_level(t, 3, 2, 2650) == 2 && power_level(t, 3, 2, 2700) == 1);
+
+  // Fresh cell: full brightness, LEDs driven statically
+  g_battery.used = 0, g_battery.reads = 0;
+  time_set(now_ms() + POWER_PERIOD_MS);
+  loop();
+  clicks(1);
+  assert(!pwm_active() && s_power == 0);
+  run_for(TIMEOUT_MS + 1);
+  assert(g_battery.reads == 1 && s_power == 0);
+
+  // Past 2800 mV: dimmer, and a shorter timeout. Sampled once an hour
+  g_battery.used = 800;
+  time_set(now_ms() + POWER_PERIOD_MS);
+  loop();
+  glance(TIMEOUT_MS);
+  assert(g_battery.reads == 2 && s_power == 1 && s_show[0].duration == 2000);
+  clicks(1);
+  assert(pwm_active() && brightness() == 12);
+  run_for(2000 + 1);
+  assert(s_state == STATE_SLEEP && g_battery.reads == 2);
+
+  // Near empty: the change is logged, then the log goes quiet. The time
+  // comes after the low battery sign, and draws a third of the current
+  g_battery.used = 960;
+  time_set(now_ms() + POWER_PERIOD_MS);
+  loop();
+  uart_isr();
+  memset(&g_uart, 0, sizeof(g_uart));
+  glance(2000);
+  assert(s_power == 3 && strstr(g_uart.out, ", level 3\n") != NULL);
+  memset(&g_uart, 0, sizeof(g_uart));
+  clicks(1);
+  assert(s_state == STATE_SHOW_TIME && s_led_mask == 0x000f);
+  run_for(4 * 150);
+  assert(s_led_mask == wclock_led_mask(s_wclock.hours, s_wclock.minutes));
+  full = 0;
+  for (int i = 0; i < 4; i++) {
+    full += (unsigned) __builtin_popcount(s_led_mask & LED_ROW(i)) *
+            led_ua(i);
+  }
+  assert(leds_current_ua() * 3 <= full);
+  run_for(1000 + 1);
+  assert(s_state == STATE_SLEEP && g_uart.len == 0);
+
+  // Backup registers keep the level over Standby: a wake-up shows the time
+  // capped at it before setup. Without them, sample
+  run_for(STANDBY_IDLE_MS);
+  assert(g_standby.sbf);
+  s_power = 0;
+  assert(wake_show() && s_power == 3 && pwm_active() && brightness() == 6);
+  btn(true);
+  assert(s_woken && s_power == 3 && g_battery.reads == 3);
+  run_for(CLICK_MS);
+  btn(false);
+  run_for(NEXT_PRESS_MS);
+  assert(s_state == STATE_SHOW_TIME);
+  run_for(4 * 150 + 1000 + 1);
+  assert(s_state == STATE_SLEEP);
+  s_power = 0;
+  power_setup();
+  assert(s_power == 3 && g_battery.reads == 3);
+  g_battery.used = 0;  // A new cell
+  bkp_write(BKP_POWER_CHECK, 0);
+  power_setup();
+  assert(s_power == 0 && g_battery.reads == 4);
+  assert(s_show[0].duration == TIMEOUT_MS);
+  g_battery.reads = reads;
+}
+
+// Clock plans, and switching between operating points as log output comes
+// and goes
+static void test_clock(void) {
+  struct clock_op op = {CLOCK_MSI, 5, 0, 2, 0};
+  struct clock_plan p;
+  for (size_t i = 0; i < ARRAY_SIZE(s_ops); i++) {
+    p = clock_plan(&s_ops[i]);
+    assert(p.valid && p.hz == clock_op_hz(&s_ops[i]));
+    if (s_ops[i].baud > 0) assert(p.brr > 0);
+  }
+
+  p = clock_plan(&op);  // MSI 2 MHz, low power range
+  assert(p.valid && p.hz == 2000000 && p.flash_ws == 0);
+  op.msi_range = 7;  // 8 MHz is over 6 MHz, one wait state in range 2
+  assert(clock_plan(&op).flash_ws == 1);
+  op.msi_range = 11;  // 48 MHz needs range 1
+  assert(!clock_plan(&op).valid);
+  op.vos = 1;
+  p = clock_plan(&op);
+  assert(p.valid && p.flash_ws == 2);
+  op = (struct clock_op) {CLOCK_HSI, 0, 0, 1, 0};
+  p = clock_plan(&op);
+  assert(p.valid && p.hz == 16000000 && p.flash_ws == 0);
+  op = (struct clock_op) {CLOCK_PLL, 0, 10, 1, 115200};
+  p = clock_plan(&op);
+  assert(p.valid && p.hz == 80000000 && p.flash_ws == 4 && p.brr == 694);
+  op.pll_n = 2;  // VCO below 64 MHz
+  assert(!clock_plan(&op).valid);
+
+  // Every MSI range: valid only where range limits allow. UART at 115200
+  // needs at least 16 clocks per bit, within 2%: 2 MHz is 2.1% off
+  for (uint8_t vos = 1; vos <= 2; vos++) {
+    for (uint8_t r = 0; r < 12; r++) {
+      op = (struct clock_op) {CLOCK_MSI, r, 0, vos, 115200};
+      p = clock_plan(&op);
+      assert(p.hz == clock_msi_hz(r));
+      assert(p.valid == (p.hz >= 4000000 && p.hz <= clock_max_hz(vos)));
+      if (p.brr > 0) {
+        assert(p.baud_ppm <= CLOCK_BAUD_PPM && p.baud_ppm >= -CLOCK_BAUD_PPM);
+      }
+    }
+  }
+  assert(clock_msi_hz(12) == 0 && clock_flash_ws(81000000, 1) == 255);
+
+  // Log output runs the UART clock, and idle drops back to low power
+  wake_up();
+  uart_isr();
+  assert(s_op == OP_LOW && SystemCoreClock == 2000000);
+  LOG("clock test\n");
+  p = clock_plan(&s_ops[OP_LOG]);
+  assert(s_op == OP_LOG && g_clock.hz == p.hz && g_uart.brr == p.brr);
+  assert(g_clock.ws == p.flash_ws && g_clock.vos == 2);
+  loop();  // Still sending: no switch, no deep sleep
+  assert(s_op == OP_LOG && g_uart.txe);
+  uart_isr();
+  loop();
+  assert(s_op == OP_LOW && g_clock.hz == 2000000 && g_clock.ws == 0);
+
+  set_brightness(PWM_STEPS / 2);  // PWM is restarted on a clock switch
+  set_leds(0xffff);
+  LOG("x\n");
+  assert(pwm_active() && SystemCoreClock == p.hz);
+  uart_isr();
+  loop();
+  assert(pwm_active() && SystemCoreClock == 2000000);
+  set_brightness(PWM_STEPS);
+  set_leds(0);
+}
+
 int main(void) {
+  unsigned deep;
+  test_sched();
+  test_mono();
+  test_evq();
+  test_fsm();
+  test_gesture();
+  test_wclock();
+  test_kv();
+  SystemInit();  // Reset clock: LED dimming is timed from it
+  test_set_leds();
+  test_dimming();
   setup();
+  uart_isr();
+  assert(g_uart.rxne);  // Receiver runs on interrupts
+  test_fmt();
+  test_log();
+  test_logt();
 
   // Check all LEDs are off
   assert(get_led_mask() == 0);
@@ -22,76 +1559,106 @@ int main(void) {
   assert(time_to_led_mask(1, 0) == 0x2);
   assert(time_to_led_mask(0, 1) == 0x8);
 
-  // Simulate single button press
-  g_ticks = 3 * 60 * 1000;  // Shift to 3 minutes
-  EXTI2_IRQHandler();
-  g_ticks += NEXT_PRESS_MS + 1;
+  // Nothing happens: we sleep, and only wake up for periodic log task
   loop();
+  assert(g_sleeps.deep == 1 && s_alarm == LOG_PERIOD_MS);
+  wake_up();
+  assert(now_ms() == LOG_PERIOD_MS);
+  assert(g_sleeps.deep == 2 && s_alarm == 2 * LOG_PERIOD_MS);
+
+  // Simulate single button press
+  time_set(3 * 60 * 1000);  // Shift to 3 minutes
+  click();  // Press is pending, must wake up on time to handle it
+  assert(s_alarm == 3 * 60 * 1000 + CLICK_MS + NEXT_PRESS_MS);
+  wake_up();
   assert(get_led_mask() == 0x88);
+  assert(now_ms() == 3 * 60 * 1000 + CLICK_MS + NEXT_PRESS_MS);
 
-  // Turn off after timeout
-  g_ticks += TIMEOUT_MS + 1;
-  loop();
+  // Turn off after timeout, and go back to sleep
+  run_for(TIMEOUT_MS + 1);
   assert(get_led_mask() == 0);
-
-  // Setting hours. Click 3 times, then wait for timeout
-  EXTI2_IRQHandler();
-  EXTI2_IRQHandler();
-  EXTI2_IRQHandler();
-  g_ticks += NEXT_PRESS_MS + 1;
+  assert(s_state == STATE_SLEEP && s_alarm == s_log_timer.expire);
+  deep = g_sleeps.deep;
   loop();
-  assert(get_led_mask() == 0);
+  assert(g_sleeps.deep == deep + 1);  // Log is sent, back to deep sleep
+
+  // Setting hours. Click 3 times, blink once, then wait for timeout
+  clicks(3);
   assert(s_state == STATE_SET_HOURS);  // Check state
-  g_ticks += TIMEOUT_MS + 2;
-  loop();
+  deep = g_sleeps.deep;
+  check_frames(s_blink1, ARRAY_SIZE(s_blink1));
+  assert(g_sleeps.deep > deep + 2);  // Slept between frames
   assert(get_led_mask() == 0);
   assert(s_state == STATE_SLEEP);
 
+  // Setting minutes. Click 4 times, blink twice, then wait for timeout
+  clicks(4);
+  assert(s_state == STATE_SET_MINUTES);
+  check_frames(s_blink2, ARRAY_SIZE(s_blink2));
+  assert(s_state == STATE_SLEEP);
+
   // Setting hours. Click 3 times
-  EXTI2_IRQHandler();
-  EXTI2_IRQHandler();
-  EXTI2_IRQHandler();
-  g_ticks += NEXT_PRESS_MS + 1;
-  loop();
-  assert(get_led_mask() == 0);
+  clicks(3);
+  assert(get_led_mask() == 0xffff);    // Blinking
   assert(s_state == STATE_SET_HOURS);  // Check state
-  EXTI2_IRQHandler();                  // Click once
-  loop();
+  click();                             // Click once
   assert(s_state == STATE_SET_HOURS);
   assert(get_led_mask() == 0x2);  // Check that we show 1 hour
-  EXTI2_IRQHandler();             // Click once more
-  loop();
+  click();                        // Click once more
   assert(get_led_mask() == 0x20);  // Check that we show 2 hours
   assert(s_state == STATE_SET_HOURS);
 
   // Wait until timeout - and set an hour
-  g_ticks += NEXT_PRESS_MS + TIMEOUT_MS + 2;
-  loop();
-  assert(s_time_in_millis_at_boot = 2 * 3600 * 1000);
-  // printf("--> %#04x\n", get_led_mask());
+  run_for(NEXT_PRESS_MS + TIMEOUT_MS + 2);
+  assert(s_wclock.hours == 0x02);
   assert(get_led_mask() == 0);
 
   // Setting minutes. Click 4 times
-  EXTI2_IRQHandler();
-  EXTI2_IRQHandler();
-  EXTI2_IRQHandler();
-  EXTI2_IRQHandler();
-  g_ticks += NEXT_PRESS_MS + 1;
-  loop();
-  assert(get_led_mask() == 0);
+  clicks(4);
+  assert(get_led_mask() == 0xffff);      // Blinking
   assert(s_state == STATE_SET_MINUTES);  // Check state
-  EXTI2_IRQHandler();                    // Click once
-  loop();
-  printf("-> %#04hx\n", get_led_mask());
+  click();                               // Click once
   assert(get_led_mask() == 0x8);  // Check that we show 1 minute
-  EXTI2_IRQHandler();             // Click once more
-  loop();
+  click();                        // Click once more
   assert(get_led_mask() == 0x80);  // Check that we show 2 minutes
 
-  // Wait until timeout - and set an hour
-  g_ticks += NEXT_PRESS_MS + TIMEOUT_MS + 2;
-  loop();
+  // Wait until timeout - and set a minute
+  run_for(NEXT_PRESS_MS + TIMEOUT_MS + 2);
   assert(get_led_mask() == 0);
+  assert(s_wclock.hours == 0x02 && s_wclock.minutes == 0x02);
+
+  // Setting hours by holding the button: every repeat adds an hour
+  clicks(3);
+  btn(true);
+  run_for(LONG_PRESS_MS + 2 * HOLD_REPEAT_MS);
+  btn(false);
+  run_for(CLICK_MS);
+  assert(get_led_mask() == time_to_led_mask(3, 0));  // Press and 2 repeats
+
+  run_for(NEXT_PRESS_MS + TIMEOUT_MS + 2);
+  assert(s_state == STATE_SLEEP);
+
+  // Button events carry 32-bit time: a click across the wrap still works
+  time_set((1ULL << 32) - DEBOUNCE_MS / 2);
+  sched_run(&s_sched, now_ms());  // Catch up with periodic timers
+  click();
+  assert(s_alarm == (1ULL << 32) - DEBOUNCE_MS / 2 + CLICK_MS +
+                        NEXT_PRESS_MS);
+  wake_up();
+  assert(s_state == STATE_SHOW_TIME);
+  run_for(TIMEOUT_MS + 1);
+  assert(s_state == STATE_SLEEP);
+  test_bounce();
+  test_trace();
+  test_standby();
+  test_alarm();
+  test_prof();
+  test_tsync();
+  test_drift();
+  test_settings();
+  test_power();
+  test_clock();
+  test_mem();
 
   return 0;
 }
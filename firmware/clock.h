@@ -0,0 +1,84 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Clock plans. An operating point names a clock source and a voltage range.
+// Its plan is what the hardware needs to run at it: the frequency, flash
+// wait states and the UART baud rate divider. This is pure C, so the unix
+// build checks every operating point. See STM32L4 reference manual, RM0394:
+// MSI ranges in 6.2.3, flash wait states in 3.3.3, VCO limits in 6.4.4
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum { CLOCK_MSI = 0, CLOCK_HSI = 1, CLOCK_PLL = 3 };  // RCC_CFGR SW values
+
+#define CLOCK_HSI_HZ 16000000UL  // HSI16, also the PLL input
+#define CLOCK_BAUD_PPM 20000     // Largest UART baud rate error, 2%
+
+struct clock_op {
+  uint8_t src;        // CLOCK_*
+  uint8_t msi_range;  // MSI range, 0 .. 11: 100 kHz .. 48 MHz
+  uint8_t pll_n;      // PLL: HSI16 * pll_n / 2
+  uint8_t vos;        // Voltage range: 1 - high performance, 2 - low power
+  uint32_t baud;      // UART baud rate, 0 if UART is not used at this point
+};
+
+struct clock_plan {
+  uint32_t hz;       // SYSCLK, AHB and APB clocks are not divided
+  uint8_t flash_ws;  // Flash wait states
+  uint16_t brr;      // UART baud rate register, 0 if baud is not reachable
+  int32_t baud_ppm;  // Baud rate error, parts per million
+  bool valid;        // Can run at this operating point
+};
+
+static inline uint32_t clock_msi_hz(uint8_t range) {
+  static const uint32_t khz[] = {100,  200,   400,   800,   1000,  2000,
+                                 4000, 8000,  16000, 24000, 32000, 48000};
+  return range < sizeof(khz) / sizeof(khz[0]) ? khz[range] * 1000 : 0;
+}
+
+static inline uint32_t clock_max_hz(uint8_t vos) {
+  return vos == 1 ? 80000000 : vos == 2 ? 26000000 : 0;
+}
+
+// Flash wait states for a frequency in a voltage range, or 255 if too fast
+static inline uint8_t clock_flash_ws(uint32_t hz, uint8_t vos) {
+  static const uint8_t range1[] = {16, 32, 48, 64, 80};  // MHz, by ws
+  static const uint8_t range2[] = {6, 12, 18, 26};
+  const uint8_t *mhz = vos == 1 ? range1 : range2;
+  uint8_t i, n = vos == 1 ? sizeof(range1) : vos == 2 ? sizeof(range2) : 0;
+  for (i = 0; i < n; i++) {
+    if (hz <= mhz[i] * 1000000UL) return i;
+  }
+  return 255;
+}
+
+static inline uint32_t clock_op_hz(const struct clock_op *op) {
+  if (op->src == CLOCK_MSI) return clock_msi_hz(op->msi_range);
+  if (op->src == CLOCK_HSI) return CLOCK_HSI_HZ;
+  if (op->src == CLOCK_PLL) {
+    uint32_t vco = CLOCK_HSI_HZ * op->pll_n;
+    return vco >= 64000000 && vco <= 344000000 ? vco / 2 : 0;
+  }
+  return 0;
+}
+
+static inline struct clock_plan clock_plan(const struct clock_op *op) {
+  struct clock_plan p = {.hz = clock_op_hz(op)};
+  p.flash_ws = clock_flash_ws(p.hz, op->vos);
+  p.valid = p.hz > 0 && p.hz <= clock_max_hz(op->vos) && p.flash_ws <= 4;
+  if (op->baud > 0) {
+    uint32_t brr = (p.hz + op->baud / 2) / op->baud;  // Oversampling by 16
+    if (brr >= 16 && brr <= 0xffff) {
+      int64_t actual = p.hz / brr;
+      p.baud_ppm = (int32_t) ((actual - op->baud) * 1000000 / op->baud);
+      if (p.baud_ppm <= CLOCK_BAUD_PPM && p.baud_ppm >= -CLOCK_BAUD_PPM) {
+        p.brr = (uint16_t) brr;
+      }
+    }
+    if (p.brr == 0) p.valid = false;
+  }
+  return p;
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Oscillator drift. The 32.768 kHz crystal that keeps time is good to some
+// 20 ppm, about 2 seconds a day, and worse when cold or hot. Every time
+// sync tells how far the wall clock has drifted since the previous one.
+// Over an interval of at least DRIFT_MIN_MS, that gives the frequency
+// error, which is learned as a correction in parts per billion:
+//
+//   struct drift d = {0};
+//   if (drift_sync(&d, true_ms - clock_ms, now)) save(d.ppb);
+//   c.trim = drift_trim(d.ppb);  // Wall clock runs faster by ppb
+//
+// The first measurement is taken as is, later ones are averaged in, to
+// smooth out sync jitter. A sync that is too far off, like the first one,
+// or one after the time was set by hand, only starts a new interval
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DRIFT_MIN_MS (60 * 60 * 1000UL)  // Shortest interval to learn from
+#define DRIFT_MAX_PPB 500000             // Corrections are clamped to that
+#define DRIFT_ERROR_MS 100               // Sync error on top of the drift
+
+struct drift {
+  int32_t ppb;       // Learned correction, positive if the clock is slow
+  unsigned samples;  // Intervals learned from
+  bool started;      // An interval is being measured
+  uint64_t start;    // When, time since boot
+  int64_t error;     // Sum of clock errors at syncs since, ms
+};
+
+// Wall clock trim, in 2^-32 ms per ms, see wclock.h. Sync time only: a
+// 64-bit division is a library call on Cortex-M4
+static inline int32_t drift_trim(int32_t ppb) {
+  return (int32_t) ((int64_t) ppb * 4294967296LL / 1000000000);
+}
+
+// Forget the interval, for example when the time is set by hand
+static inline void drift_restart(struct drift *d) {
+  d->started = false;
+}
+
+// A sync has found the wall clock off by error ms: true time minus clock
+// time. Return true if the correction is updated
+static inline bool drift_sync(struct drift *d, int32_t error, uint64_t now) {
+  int64_t interval = (int64_t) (now - d->start), ppb;
+  int64_t limit = interval * DRIFT_MAX_PPB / 500000000 + DRIFT_ERROR_MS;
+  if (!d->started || error > limit || error < -limit) {
+    d->started = true, d->start = now, d->error = 0;
+    return false;
+  }
+  d->error += error;
+  if (interval < (int64_t) DRIFT_MIN_MS) return false;
+  ppb = d->ppb + d->error * 1000000000 / interval;
+  if (d->samples++ > 0) ppb = (d->ppb + ppb) / 2;
+  if (ppb > DRIFT_MAX_PPB) ppb = DRIFT_MAX_PPB;
+  if (ppb < -DRIFT_MAX_PPB) ppb = -DRIFT_MAX_PPB;
+  d->ppb = (int32_t) ppb, d->start = now, d->error = 0;
+  return true;
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Lock-free single-producer, single-consumer event queue. The producer is an
+// interrupt handler, the consumer is the main loop. Each side writes only its
+// own index, so no locking or interrupt masking is needed. Events that do not
+// fit are dropped and counted
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EVQ_SIZE 16  // Must be a power of two
+
+enum { EV_BTN_EDGE };  // Button pin level changed
+
+struct event {
+  uint32_t time;  // Milliseconds since boot, 32-bit, see mono.h
+  uint8_t type;   // One of EV_*
+};
+
+struct evq {
+  struct event buf[EVQ_SIZE];
+  atomic_uint head;     // Next slot to write. Written by producer only
+  atomic_uint tail;     // Next slot to read. Written by consumer only
+  atomic_uint dropped;  // Number of events lost because queue was full
+};
+
+static inline bool evq_push(struct evq *q, const struct event *ev) {
+  unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if (head - tail >= EVQ_SIZE) {
+    atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+    return false;
+  }
+  q->buf[head & (EVQ_SIZE - 1)] = *ev;
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);  // Publish
+  return true;
+}
+
+static inline bool evq_pop(struct evq *q, struct event *ev) {
+  unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+  if (head == tail) return false;
+  *ev = q->buf[tail & (EVQ_SIZE - 1)];
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);  // Free
+  return true;
+}
+
+static inline bool evq_empty(struct evq *q) {
+  return atomic_load_explicit(&q->head, memory_order_acquire) ==
+         atomic_load_explicit(&q->tail, memory_order_relaxed);
+}
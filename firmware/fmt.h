@@ -0,0 +1,189 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Tiny printf-style formatter, in place of newlib's printf. No heap, no
+// floating point, no global state, so it is reentrant. Output goes to a
+// callback in chunks of FMT_CHUNK bytes, which bounds stack use:
+//
+//   fmt_format(out, arg, "%s -> %#04hx\n", "set_leds", mask);
+//
+// Conversions: d i u x X c s %. Flags: - + space # 0. Width and precision,
+// also as *. Length modifiers: hh h l ll z
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FMT_CHUNK 32  // Output buffer, on the stack
+
+typedef void (*fmt_out_fn)(const char *buf, size_t len, void *arg);
+
+struct fmt_buf {
+  fmt_out_fn out;
+  void *arg;
+  size_t len, total;  // Bytes buffered, and bytes output in total
+  char buf[FMT_CHUNK];
+};
+
+static inline void fmt_putc(struct fmt_buf *b, char c) {
+  b->buf[b->len++] = c, b->total++;
+  if (b->len == sizeof(b->buf)) b->out(b->buf, b->len, b->arg), b->len = 0;
+}
+
+static inline void fmt_pad(struct fmt_buf *b, char c, int n) {
+  while (n-- > 0) fmt_putc(b, c);
+}
+
+// Print prefix and digits, in a field of a given width
+static inline void fmt_field(struct fmt_buf *b, const char *prefix,
+                             const char *digits, int ndigits, int prec,
+                             int width, bool left, bool zero) {
+  int nprefix = 0, nzeros = prec > ndigits ? prec - ndigits : 0, pad;
+  while (prefix[nprefix] != '\0') nprefix++;
+  pad = width - nprefix - nzeros - ndigits;
+  if (zero) nzeros += pad > 0 ? pad : 0, pad = 0;
+  if (!left) fmt_pad(b, ' ', pad);
+  for (int i = 0; i < nprefix; i++) fmt_putc(b, prefix[i]);
+  fmt_pad(b, '0', nzeros);
+  for (int i = 0; i < ndigits; i++) fmt_putc(b, digits[i]);
+  if (left) fmt_pad(b, ' ', pad);
+}
+
+static inline size_t fmt_vformat(fmt_out_fn out, void *arg, const char *fmt,
+                                 va_list ap) {
+  struct fmt_buf b = {.out = out, .arg = arg};
+  while (*fmt != '\0') {
+    bool left = false, zero = false, alt = false;
+    char sign = 0, conv, digits[24];
+    int width = 0, prec = -1, len = 0, n = 0;  // len: -2 hh .. 2 ll, 3 z
+    if (*fmt != '%') {
+      fmt_putc(&b, *fmt++);
+      continue;
+    }
+    for (fmt++;; fmt++) {  // Flags
+      if (*fmt == '-') left = true;
+      else if (*fmt == '0') zero = true;
+      else if (*fmt == '#') alt = true;
+      else if (*fmt == '+') sign = '+';
+      else if (*fmt == ' ') sign = sign ? sign : ' ';
+      else break;
+    }
+    if (*fmt == '*') {
+      width = va_arg(ap, int), fmt++;
+      if (width < 0) left = true, width = -width;
+    }
+    while (*fmt >= '0' && *fmt <= '9') width = width * 10 + *fmt++ - '0';
+    if (*fmt == '.') {
+      prec = 0, fmt++;
+      if (*fmt == '*') {
+        prec = va_arg(ap, int), fmt++;
+      } else {
+        while (*fmt >= '0' && *fmt <= '9') prec = prec * 10 + *fmt++ - '0';
+      }
+    }
+    for (;; fmt++) {  // Length modifiers
+      if (*fmt == 'h') len--;
+      else if (*fmt == 'l') len++;
+      else if (*fmt == 'z') len = 3;
+      else break;
+    }
+    if ((conv = *fmt++) == '\0') break;
+    if (left) zero = false;
+    if (conv == 'd' || conv == 'i' || conv == 'u' || conv == 'x' ||
+        conv == 'X') {
+      const char *hex = conv == 'X' ? "0123456789ABCDEF" : "0123456789abcdef";
+      unsigned base = conv == 'x' || conv == 'X' ? 16 : 10;
+      char prefix[3] = {0};
+      unsigned long long v;
+      if (conv == 'd' || conv == 'i') {
+        long long i = len == 3   ? (long long) va_arg(ap, size_t)
+                      : len >= 2 ? va_arg(ap, long long)
+                      : len == 1 ? va_arg(ap, long)
+                                 : va_arg(ap, int);
+        if (len == -1) i = (short) i;
+        if (len <= -2) i = (signed char) i;
+        v = i < 0 ? 0ULL - (unsigned long long) i : (unsigned long long) i;
+        prefix[0] = i < 0 ? '-' : sign;
+      } else {
+        v = len == 3   ? va_arg(ap, size_t)
+            : len >= 2 ? va_arg(ap, unsigned long long)
+            : len == 1 ? va_arg(ap, unsigned long)
+                       : va_arg(ap, unsigned);
+        if (len == -1) v = (unsigned short) v;
+        if (len <= -2) v = (unsigned char) v;
+        if (alt && base == 16 && v != 0) prefix[0] = '0', prefix[1] = conv;
+      }
+      if (prec >= 0) zero = false;
+      do {  // 32-bit division where it fits: 64-bit one is a library call
+        unsigned d;
+        if (base == 16) {
+          d = (unsigned) (v & 15), v >>= 4;
+        } else if (v <= UINT32_MAX) {
+          d = (uint32_t) v % 10, v = (uint32_t) v / 10;
+        } else {
+          d = (unsigned) (v % 10), v /= 10;
+        }
+        digits[sizeof(digits) - 1 - n++] = hex[d];
+      } while (v != 0);
+      if (n == 1 && digits[sizeof(digits) - 1] == '0' && prec == 0) n = 0;
+      fmt_field(&b, prefix, digits + sizeof(digits) - n, n, prec, width,
+                left, zero);
+    } else if (conv == 'c') {
+      digits[0] = (char) va_arg(ap, int);
+      fmt_field(&b, "", digits, 1, -1, width, left, false);
+    } else if (conv == 's') {
+      const char *s = va_arg(ap, const char *);
+      if (s == NULL) s = "(null)";
+      while (s[n] != '\0' && (prec < 0 || n < prec)) n++;
+      fmt_field(&b, "", s, n, -1, width, left, false);
+    } else {  // %%, and unknown conversions are printed as is
+      fmt_putc(&b, conv);
+    }
+  }
+  if (b.len > 0) out(b.buf, b.len, arg);
+  return b.total;
+}
+
+static inline size_t fmt_format(fmt_out_fn out, void *arg, const char *fmt,
+                                ...) {
+  va_list ap;
+  size_t n;
+  va_start(ap, fmt);
+  n = fmt_vformat(out, arg, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+// Format into a buffer, like snprintf()
+struct fmt_mem {
+  char *buf;
+  size_t size, len;
+};
+
+static inline void fmt_mem_out(const char *buf, size_t len, void *arg) {
+  struct fmt_mem *m = (struct fmt_mem *) arg;
+  for (size_t i = 0; i < len && m->len + 1 < m->size; i++) {
+    m->buf[m->len++] = buf[i];
+  }
+}
+
+static inline size_t fmt_vsnprintf(char *buf, size_t size, const char *fmt,
+                                   va_list ap) {
+  struct fmt_mem m = {buf, size, 0};
+  size_t n = fmt_vformat(fmt_mem_out, &m, fmt, ap);
+  if (size > 0) buf[m.len] = '\0';
+  return n;
+}
+
+static inline size_t fmt_snprintf(char *buf, size_t size, const char *fmt,
+                                  ...) {
+  va_list ap;
+  size_t n;
+  va_start(ap, fmt);
+  n = fmt_vsnprintf(buf, size, fmt, ap);
+  va_end(ap);
+  return n;
+}
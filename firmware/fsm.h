@@ -0,0 +1,94 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Table-driven hierarchical state machine. States and events are small
+// numbers. A const transition table, which goes to flash, says for every
+// state and event what to do: run an action, go to another state, or both.
+// A state that leaves an event blank passes it to its parent, so shared
+// behaviour is written once, in a parent. A transition exits states up to
+// the common parent of source and target, runs the action, then enters
+// states down to the target, which is a leaf:
+//
+//   static const struct fsm_state states[] = {
+//       [IDLE] = {FSM_NONE, idle_entry, NULL},
+//       [BUSY] = {FSM_NONE, NULL, busy_exit},
+//   };
+//   static const struct fsm_tr table[][NUM_EVENTS] = {
+//       [IDLE][ON_START] = FSM_GO(BUSY, NULL),
+//       [BUSY][ON_TICK] = FSM_DO(busy_tick),
+//   };
+//   struct fsm m = {states, &table[0][0], NUM_EVENTS, IDLE, NULL};
+//   fsm_dispatch(&m, ON_START, NULL);
+//
+// Dispatch is a table lookup per nesting level. Nothing runs between events
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FSM_NONE 0xff  // No parent
+#define FSM_DEPTH 4    // Deepest nesting
+
+struct fsm_state {
+  uint8_t parent;            // Enclosing state, or FSM_NONE
+  void (*entry)(void *arg);  // Can be NULL
+  void (*exit)(void *arg);   // Can be NULL
+};
+
+struct fsm_tr {
+  uint8_t to;                 // Target state + 1, or 0 to stay
+  void (*action)(void *arg);  // Can be NULL
+};
+
+#define FSM_GO(state, action) {(uint8_t) ((state) + 1), (action)}
+#define FSM_DO(action) {0, (action)}
+
+struct fsm {
+  const struct fsm_state *states;
+  const struct fsm_tr *table;      // Rows of nevents, one row per state
+  uint8_t nevents;                 // Number of events
+  uint8_t state;                   // Current state, a leaf
+  void (*changed)(uint8_t state);  // Called on every transition, or NULL
+};
+
+// True if state a encloses state s
+static inline bool fsm_encloses(const struct fsm *m, uint8_t a, uint8_t s) {
+  while ((s = m->states[s].parent) != FSM_NONE) {
+    if (s == a) return true;
+  }
+  return false;
+}
+
+// Handle an event. The arg goes to the actions. Return false if no state
+// handles the event
+static inline bool fsm_dispatch(struct fsm *m, uint8_t event, void *arg) {
+  const struct fsm_tr *tr = NULL;
+  uint8_t s, to, path[FSM_DEPTH], n = 0;
+  for (s = m->state; s != FSM_NONE; s = m->states[s].parent) {
+    tr = &m->table[s * m->nevents + event];
+    if (tr->to != 0 || tr->action != NULL) break;
+  }
+  if (s == FSM_NONE) return false;
+  if (tr->to == 0) {  // Internal: no exit, no entry
+    tr->action(arg);
+    return true;
+  }
+  to = (uint8_t) (tr->to - 1);
+  for (s = m->state; s != FSM_NONE && !fsm_encloses(m, s, to);
+       s = m->states[s].parent) {
+    if (m->states[s].exit != NULL) m->states[s].exit(arg);
+  }
+  if (tr->action != NULL) tr->action(arg);
+  m->state = to;
+  if (m->changed != NULL) m->changed(to);
+  for (uint8_t t = to; t != s && n < FSM_DEPTH; t = m->states[t].parent) {
+    path[n++] = t;
+  }
+  while (n > 0) {
+    const struct fsm_state *e = &m->states[path[--n]];
+    if (e->entry != NULL) e->entry(arg);
+  }
+  return true;
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Button gesture recognizer. Takes debounced button state changes, and
+// reports every press and release, the number of clicks once a multi-click
+// is over, a long press, and repeats while the button stays held after a
+// long press. Thresholds are configurable. Deadlines are scheduler timers,
+// so nothing is polled while we wait:
+//
+//   press ... release <click_gap_ms  press ... release  >click_gap_ms
+//     PRESS 1     RELEASE              PRESS 2   RELEASE   CLICKS 2
+//
+//   press ... >long_ms ... +hold_ms ... +hold_ms ... release
+//     PRESS 1     LONG 1       HOLD 1       HOLD 2       RELEASE
+
+#pragma once
+
+#include "sched.h"
+
+enum {
+  GESTURE_PRESS,    // Button went down. Count: clicks so far, this included
+  GESTURE_RELEASE,  // Button went up. Count: clicks so far, 0 after long
+  GESTURE_CLICKS,   // No more clicks follow. Count: number of clicks
+  GESTURE_LONG,     // Held for long_ms. Count: clicks, this one included
+  GESTURE_HOLD,     // Still held, every hold_ms after LONG. Count: repeats
+};
+
+struct gesture_cfg {
+  uint16_t click_gap_ms;  // Longest release to press gap in a multi-click
+  uint16_t long_ms;       // Press that lasts that long is a long press
+  uint16_t hold_ms;       // Repeat period while held after a long press
+};
+
+struct gesture {
+  const struct gesture_cfg *cfg;
+  struct sched *sched;                                      // Scheduler to use
+  void (*fn)(uint8_t type, unsigned count, uint64_t time);  // Gesture handler
+  bool pressed, held;  // Button is down, long press was reported
+  unsigned count;      // Clicks in the sequence, or hold repeats
+  struct timer timer;  // End of sequence, long press, or next repeat
+};
+
+static inline void gesture_timer_fn(void *arg) {
+  struct gesture *g = (struct gesture *) arg;
+  uint64_t time = g->timer.expire;  // Repeats do not drift with wake-ups
+  unsigned count = g->count;
+  if (!g->pressed) {
+    g->count = 0;
+    g->fn(GESTURE_CLICKS, count, time);
+  } else if (!g->held) {
+    g->held = true, g->count = 0;
+    sched_add(g->sched, &g->timer, time + g->cfg->hold_ms, 0);
+    g->fn(GESTURE_LONG, count, time);
+  } else {
+    g->count++;
+    sched_add(g->sched, &g->timer, time + g->cfg->hold_ms, 0);
+    g->fn(GESTURE_HOLD, g->count, time);
+  }
+}
+
+// Feed a debounced button state, and the time it changed
+static inline void gesture_input(struct gesture *g, bool pressed,
+                                 uint64_t time) {
+  if (pressed == g->pressed) return;
+  g->pressed = pressed;
+  g->timer.fn = gesture_timer_fn, g->timer.arg = g;
+  if (pressed) {
+    g->count++;
+    sched_add(g->sched, &g->timer, time + g->cfg->long_ms, 0);
+    g->fn(GESTURE_PRESS, g->count, time);
+  } else if (g->held) {  // Long press is over, and so is the sequence
+    g->held = false, g->count = 0;
+    sched_cancel(g->sched, &g->timer);
+    g->fn(GESTURE_RELEASE, 0, time);
+  } else {
+    sched_add(g->sched, &g->timer, time + g->cfg->click_gap_ms, 0);
+    g->fn(GESTURE_RELEASE, g->count, time);
+  }
+}
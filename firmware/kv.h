@@ -0,0 +1,192 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Key/value store in flash, for what must survive a power loss: time and
+// settings. Keys are small numbers, values are 32-bit. Flash is a ring of
+// pages, written in 8-byte double words, each once after an erase. Every
+// page starts with a header, then records are appended to it:
+//
+//   page:    seq:u32 magic:u16 crc:u16      Higher seq is newer
+//   record:  key:u8 ff crc:u16 value:u32    A newer one replaces older
+//
+// A new page starts with a snapshot of all values, and a done record after
+// it. So the newest page that has a done record holds everything, and boot
+// replays that one page. Pages are taken in turn, which levels the wear.
+// Every record has a CRC, so that a record cut short by a power loss is
+// recognised and skipped. On the device, such a record may not even read:
+// its ECC fails, and the read hook says so. That is taken as cut short
+// too. After one, nothing is appended to the page any more. A page with no
+// done record is cut short too, and its slot is reused for the next page.
+// The erase, which comes first, is never of the page that holds everything
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KV_KEYS 8          // Keys are 0 .. KV_KEYS - 1
+#define KV_MAGIC 0x4b76    // Page header, "Kv"
+#define KV_KEY_DONE 0xfe   // Snapshot is complete
+
+struct kv {
+  uint8_t *base;        // First page, memory mapped
+  size_t page_size;     // Flash page size
+  unsigned npages;      // Number of pages, 2 or more
+  bool (*erase)(void *page);
+  bool (*write)(void *addr, const void *buf, size_t len);  // Double words
+  bool (*read)(const void *addr, void *buf, size_t len);   // False: ECC
+  uint32_t values[KV_KEYS];
+  uint32_t present;     // Bit mask of keys that have values
+  unsigned page;        // Page records are appended to
+  uint32_t seq;         // Its sequence number
+  size_t pos;           // Append offset in it. page_size: start a new page
+  bool reuse;           // Next page goes to the same slot: this one is cut
+  unsigned reads;       // Double words read by kv_init(), for tests
+};
+
+static inline uint16_t kv_crc16(const uint8_t *buf, size_t len) {
+  uint16_t crc = 0xffff;  // CRC-16/CCITT
+  while (len-- > 0) {
+    crc ^= (uint16_t) (*buf++ << 8);
+    for (int i = 0; i < 8; i++) {
+      crc = (uint16_t) (crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1);
+    }
+  }
+  return crc;
+}
+
+// Record CRC covers the key and the value: bytes 0, 4 .. 7
+static inline uint16_t kv_record_crc(const uint8_t *r) {
+  uint8_t buf[5] = {r[0], r[4], r[5], r[6], r[7]};
+  return kv_crc16(buf, sizeof(buf));
+}
+
+static inline uint16_t kv_get16(const uint8_t *p) {
+  return (uint16_t) (p[0] | p[1] << 8);
+}
+
+static inline void kv_put16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t) v, p[1] = (uint8_t) (v >> 8);
+}
+
+static inline uint32_t kv_get32(const uint8_t *p) {
+  return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+         (uint32_t) p[3] << 24;
+}
+
+static inline void kv_put32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t) v, p[1] = (uint8_t) (v >> 8);
+  p[2] = (uint8_t) (v >> 16), p[3] = (uint8_t) (v >> 24);
+}
+
+static inline uint8_t *kv_page(const struct kv *kv, unsigned page) {
+  return kv->base + page * kv->page_size;
+}
+
+// Sequence number of a page, false if it has no valid header
+static inline bool kv_page_seq(const struct kv *kv, unsigned page,
+                               uint32_t *seq) {
+  uint8_t p[8];
+  if (!kv->read(kv_page(kv, page), p, sizeof(p))) return false;
+  *seq = kv_get32(p);
+  return kv_get16(p + 4) == KV_MAGIC && kv_get16(p + 6) == kv_crc16(p, 6);
+}
+
+static inline bool kv_append(struct kv *kv, uint8_t key, uint32_t value) {
+  uint8_t r[8] = {key, 0xff};
+  kv_put32(r + 4, value);
+  kv_put16(r + 2, kv_record_crc(r));
+  if (!kv->write(kv_page(kv, kv->page) + kv->pos, r, sizeof(r))) return false;
+  kv->pos += sizeof(r);
+  return true;
+}
+
+// Erase the next page, and write a snapshot of all values to it
+static inline bool kv_new_page(struct kv *kv) {
+  uint8_t h[8];
+  if (!kv->reuse) kv->page = (kv->page + 1) % kv->npages, kv->seq++;
+  kv->reuse = true, kv->pos = kv->page_size;  // Until the snapshot is done
+  kv_put32(h, kv->seq);
+  kv_put16(h + 4, KV_MAGIC);
+  kv_put16(h + 6, kv_crc16(h, 6));
+  if (!kv->erase(kv_page(kv, kv->page))) return false;
+  if (!kv->write(kv_page(kv, kv->page), h, sizeof(h))) return false;
+  kv->pos = sizeof(h);
+  for (uint8_t key = 0; key < KV_KEYS; key++) {
+    if ((kv->present & (1U << key)) && !kv_append(kv, key, kv->values[key])) {
+      return false;
+    }
+  }
+  if (!kv_append(kv, KV_KEY_DONE, kv->present)) return false;
+  kv->reuse = false;
+  return true;
+}
+
+// Replay a page. Return true if it has a done record. The append position
+// is where records end, or the page end if one is cut short
+static inline bool kv_replay(struct kv *kv, unsigned page) {
+  const uint8_t *p = kv_page(kv, page);
+  bool done = false;
+  kv->present = 0, kv->pos = kv->page_size;
+  for (size_t ofs = 8; ofs + 8 <= kv->page_size; ofs += 8) {
+    uint8_t r[8];
+    kv->reads++;
+    if (!kv->read(p + ofs, r, sizeof(r))) break;  // Cut short
+    if (kv_get32(r) == 0xffffffff && kv_get32(r + 4) == 0xffffffff) {
+      kv->pos = ofs;  // Erased: the end
+      break;
+    }
+    if (kv_get16(r + 2) != kv_record_crc(r)) break;
+    if (r[0] == KV_KEY_DONE) done = true;
+    if (r[0] < KV_KEYS) {
+      kv->values[r[0]] = kv_get32(r + 4), kv->present |= 1U << r[0];
+    }
+  }
+  return done;
+}
+
+// Load values. Reads all page headers, and at most two pages: the newest
+// one, and if that is cut short, the one before it
+static inline void kv_init(struct kv *kv) {
+  unsigned newest = 0, n = 0;
+  uint32_t seq, max = 0;
+  kv->reads = 0;
+  for (unsigned i = 0; i < kv->npages; i++) {
+    kv->reads++;
+    if (kv_page_seq(kv, i, &seq) && (n++ == 0 || seq > max)) {
+      newest = i, max = seq;
+    }
+  }
+  kv->page = newest, kv->seq = max, kv->reuse = false;
+  if (n == 0) {  // Blank flash. The first write starts page 0
+    kv->present = 0, kv->pos = kv->page_size, kv->page = kv->npages - 1;
+    return;
+  }
+  if (kv_replay(kv, newest)) return;
+  kv->reuse = true;  // Its slot is taken again, the one before stays
+  unsigned prev = (newest + kv->npages - 1) % kv->npages;
+  if (kv_page_seq(kv, prev, &seq) && seq == max - 1 && kv_replay(kv, prev)) {
+    kv->pos = kv->page_size;  // Do not append behind the newer page
+  } else {
+    kv->present = 0;  // Nothing complete
+  }
+}
+
+static inline bool kv_get(const struct kv *kv, uint8_t key, uint32_t *value) {
+  if (key >= KV_KEYS || !(kv->present & (1U << key))) return false;
+  *value = kv->values[key];
+  return true;
+}
+
+// Store a value. Return false if flash fails: the old value may stay
+static inline bool kv_set(struct kv *kv, uint8_t key, uint32_t value) {
+  if (key >= KV_KEYS) return false;
+  if ((kv->present & (1U << key)) && kv->values[key] == value) return true;
+  kv->values[key] = value, kv->present |= 1U << key;
+  if (kv->pos + 8 <= kv->page_size && !kv->reuse) {
+    if (kv_append(kv, key, value)) return true;
+    kv->pos = kv->page_size;  // Cut short, or failed: move on
+  }
+  return kv_new_page(kv);
+}
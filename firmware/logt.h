@@ -0,0 +1,187 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Tokenized binary logging. Format strings are placed in a section that is
+// not loaded to the device, and a log call sends only a compact record:
+//
+//   LEN ID TIME ARG...
+//
+// LEN is a byte count of what follows. ID is the offset of the format string
+// in the string section, TIME is milliseconds since boot. Integer arguments
+// are zigzag varints, strings are a length byte followed by the bytes.
+// The host side decoder, logt_decode(), restores the text using the format
+// strings extracted from the ELF file. See tools/logdecode.c
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef LOG_TOKENIZED
+#define LOG_TOKENIZED 0  // 1 - send tokenized records, 0 - send text
+#endif
+
+#define LOGT_MAX_STRING 24  // Longer string arguments are truncated
+#define LOGT_MAX_RECORD (16 + 6 * (LOGT_MAX_STRING + 1))  // Always fits
+
+struct logt_arg {
+  const char *s;  // String argument, or NULL for integers
+  int64_t i;      // Integer argument
+};
+
+static inline struct logt_arg logt_str(const char *s) {
+  return (struct logt_arg) {.s = s};
+}
+static inline struct logt_arg logt_int(long long i) {
+  return (struct logt_arg) {.i = i};
+}
+
+// Convert each argument into struct logt_arg, preceded by a comma
+#define LOGT_ARG(x) \
+  _Generic((x), char *: logt_str, const char *: logt_str, default: logt_int)(x)
+#define LOGT_N(...) LOGT_N_(0, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define LOGT_N_(_0, _1, _2, _3, _4, _5, _6, N, ...) N
+#define LOGT_CAT(a, b) LOGT_CAT_(a, b)
+#define LOGT_CAT_(a, b) a##b
+#define LOGT_MAP(...) LOGT_CAT(LOGT_MAP, LOGT_N(__VA_ARGS__))(__VA_ARGS__)
+#define LOGT_MAP0()
+#define LOGT_MAP1(a) , LOGT_ARG(a)
+#define LOGT_MAP2(a, ...) , LOGT_ARG(a) LOGT_MAP1(__VA_ARGS__)
+#define LOGT_MAP3(a, ...) , LOGT_ARG(a) LOGT_MAP2(__VA_ARGS__)
+#define LOGT_MAP4(a, ...) , LOGT_ARG(a) LOGT_MAP3(__VA_ARGS__)
+#define LOGT_MAP5(a, ...) , LOGT_ARG(a) LOGT_MAP4(__VA_ARGS__)
+#define LOGT_MAP6(a, ...) , LOGT_ARG(a) LOGT_MAP5(__VA_ARGS__)
+
+// Only used for compile-time format checking, never called
+static inline __attribute__((format(printf, 1, 2))) void logt_check(
+    const char *fmt, ...) {
+  (void) fmt;
+}
+
+void logt_send(uint32_t id, const struct logt_arg *args, size_t nargs);
+
+// Send a text log line, formatted by fmt.h
+__attribute__((format(printf, 1, 2))) int log_printf(const char *fmt, ...);
+
+// Send a tokenized log record. Up to 6 integer or string arguments
+#define LOGT(fmt, ...)                                                 \
+  do {                                                                 \
+    static const char logt_fmt_[] LOGSTR_SECTION = fmt;                \
+    const struct logt_arg logt_args_[] = {{0} LOGT_MAP(__VA_ARGS__)};  \
+    if (0) logt_check(fmt, ##__VA_ARGS__);                             \
+    logt_send(LOGSTR_ID(logt_fmt_), logt_args_ + 1, LOGT_N(__VA_ARGS__)); \
+  } while (0)
+
+#if LOG_TOKENIZED
+#define LOG(fmt, ...) LOGT(fmt, ##__VA_ARGS__)
+#else
+#define LOG(fmt, ...) log_printf(fmt, ##__VA_ARGS__)
+#endif
+
+static inline size_t logt_put_varint(uint8_t *buf, size_t len, uint64_t v) {
+  do {
+    buf[len++] = (uint8_t) ((v & 0x7f) | (v > 0x7f ? 0x80 : 0));
+    v >>= 7;
+  } while (v > 0);
+  return len;
+}
+
+// Encode a record into buf of LOGT_MAX_RECORD bytes, return its size
+static inline size_t logt_encode(uint8_t *buf, uint32_t id, uint64_t time,
+                                 const struct logt_arg *args, size_t nargs) {
+  size_t i, len = logt_put_varint(buf, 1, id);
+  len = logt_put_varint(buf, len, time);
+  for (i = 0; i < nargs && i < 6; i++) {
+    if (args[i].s != NULL) {
+      size_t n = strlen(args[i].s);
+      if (n > LOGT_MAX_STRING) n = LOGT_MAX_STRING;
+      buf[len++] = (uint8_t) n;
+      memcpy(buf + len, args[i].s, n);
+      len += n;
+    } else {  // Zigzag: small negative numbers also become short varints
+      uint64_t v = (uint64_t) args[i].i;
+      len = logt_put_varint(buf, len, (v << 1) ^ (0 - (v >> 63)));
+    }
+  }
+  buf[0] = (uint8_t) (len - 1);
+  return len;
+}
+
+static inline bool logt_get_varint(const uint8_t *buf, size_t len, size_t *ofs,
+                                   uint64_t *v) {
+  unsigned shift = 0;
+  *v = 0;
+  while (*ofs < len && shift < 64) {
+    uint8_t b = buf[(*ofs)++];
+    *v |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+    shift += 7;
+  }
+  return false;
+}
+
+// Decode one record, without the length byte, into text. strs is the string
+// section contents. Return false if the record is malformed
+static inline bool logt_decode(const char *strs, size_t strs_len,
+                               const uint8_t *rec, size_t len, uint64_t *time,
+                               char *out, size_t size) {
+  size_t ofs = 0, n = 0;
+  uint64_t id, v;
+  const char *p;
+  if (size == 0) return false;
+  if (!logt_get_varint(rec, len, &ofs, &id) || id >= strs_len) return false;
+  if (!logt_get_varint(rec, len, &ofs, time)) return false;
+  out[0] = '\0';
+  for (p = strs + id; p < strs + strs_len && *p != '\0'; p++) {
+    char spec[16], conv;
+    size_t k = 0, h = 0;
+    int m;
+    if (p[0] != '%' || p[1] == '%') {  // Literal text
+      if (p[0] == '%') p++;
+      if (n + 1 < size) out[n++] = *p, out[n] = '\0';
+      continue;
+    }
+    spec[k++] = *p++;  // Copy flags, width and precision, skip length
+    while (*p != '\0' && strchr("-+ #0123456789.", *p) && k < 10) {
+      spec[k++] = *p++;
+    }
+    for (; *p != '\0' && strchr("hlzjt", *p); p++) h += *p == 'h';
+    if ((conv = *p) == '\0') return false;
+    if (conv == 's') {
+      uint64_t slen;
+      char str[LOGT_MAX_STRING + 1];
+      if (!logt_get_varint(rec, len, &ofs, &slen) || slen > len - ofs ||
+          slen > LOGT_MAX_STRING) {
+        return false;
+      }
+      memcpy(str, rec + ofs, (size_t) slen), str[slen] = '\0';
+      ofs += (size_t) slen;
+      spec[k++] = 's', spec[k] = '\0';
+      m = snprintf(out + n, size - n, spec, str);
+    } else {
+      int64_t i;
+      if (!logt_get_varint(rec, len, &ofs, &v)) return false;
+      i = (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+      spec[k++] = 'l', spec[k++] = 'l', spec[k++] = conv, spec[k] = '\0';
+      if (conv == 'd' || conv == 'i') {  // Truncate %hd, %hhd like printf
+        if (h > 0) i = h == 1 ? (int16_t) i : (int8_t) i;
+        m = snprintf(out + n, size - n, spec, (long long) i);
+      } else if (strchr("uxXo", conv)) {
+        if (h > 0) i = h == 1 ? (uint16_t) i : (uint8_t) i;
+        m = snprintf(out + n, size - n, spec, (unsigned long long) i);
+      } else if (conv == 'c') {
+        spec[k - 3] = 'c', spec[k - 2] = '\0';
+        m = snprintf(out + n, size - n, spec, (int) i);
+      } else {
+        return false;
+      }
+    }
+    if (m < 0) return false;
+    n += (size_t) m;
+    if (n >= size) n = size - 1;
+  }
+  return ofs == len;
+}
@@ -0,0 +1,112 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Memory telemetry. RAM above .bss is painted with MEM_PAINT at boot, see
+// stack_fill() in hal.h, and the stack grows down into it. The high-water
+// mark is the lowest stack word that is not paint any more. Scans move it
+// incrementally: they start from the last mark, and stop at a run of
+// MEM_CLEAN painted words, so a scan reads a handful of words, not all of
+// RAM. Interrupt handlers also sample the stack pointer on entry, and count
+// nesting depth. The free stack, bottom to mark, is sampled every
+// MEM_TREND_TICKS periods, to see whether usage keeps growing.
+//
+// Below the stack lies an MPU guard region, which no code may touch. An
+// overflow faults at once, and the fault handler leaves a crash record in
+// RAM that survives reset, for the next boot to report
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEM_PAINT 0xa5a5a5a5  // Same as stack_fill() in hal.h
+#define MEM_CLEAN 4           // Painted words in a row that end a scan
+#define MEM_GUARD_SIZE 256    // MPU region: power of two, 32 bytes or more
+#define MEM_TREND 8           // Free stack samples kept
+#define MEM_TREND_TICKS 60    // mem_tick() calls per sample
+#define MEM_CRASH_MAGIC 0xdead57acU
+
+struct mem {
+  uint32_t *bottom, *top;  // Stack may grow from top down to bottom
+  uint32_t *low;           // Lowest stack word known to be used
+  uint8_t irq_depth, irq_depth_max;  // Interrupt nesting, now and peak
+  uint32_t trend[MEM_TREND];         // Free stack bytes, oldest first
+  unsigned ntrend, ticks;
+};
+
+struct mem_crash {
+  uint32_t magic;
+  uint32_t pc, lr, sp;  // Where it happened. pc, lr: 0 if not stacked
+  uint32_t cfsr, addr;  // Fault status and faulting address
+  uint32_t check;       // XOR of the above, random RAM fails it
+};
+
+static inline void mem_init(struct mem *m, uint32_t *bottom, uint32_t *top,
+                            uint32_t *sp) {
+  *m = (struct mem) {.bottom = bottom, .top = top, .low = sp};
+}
+
+// Interrupt handler entry and exit. On entry, sample the stack pointer
+static inline void mem_irq_enter(struct mem *m, uint32_t *sp) {
+  if (++m->irq_depth > m->irq_depth_max) m->irq_depth_max = m->irq_depth;
+  if (sp < m->low && sp >= m->bottom) m->low = sp;
+}
+
+static inline void mem_irq_exit(struct mem *m) {
+  m->irq_depth--;
+}
+
+// Move the high-water mark down to the last used word. Return words read
+static inline size_t mem_scan(struct mem *m) {
+  uint32_t *p = m->low;
+  size_t clean = 0, reads = 0;
+  while (p > m->bottom && clean < MEM_CLEAN) {
+    reads++;
+    if (*--p == MEM_PAINT) {
+      clean++;
+    } else {
+      clean = 0, m->low = p;
+    }
+  }
+  return reads;
+}
+
+static inline uint32_t mem_stack_used(const struct mem *m) {
+  return (uint32_t) (m->top - m->low) * sizeof(uint32_t);
+}
+
+static inline uint32_t mem_stack_free(const struct mem *m) {
+  return (uint32_t) (m->low - m->bottom) * sizeof(uint32_t);
+}
+
+// Call periodically. Every MEM_TREND_TICKS calls, sample free stack
+static inline void mem_tick(struct mem *m) {
+  if (++m->ticks < MEM_TREND_TICKS) return;
+  m->ticks = 0;
+  if (m->ntrend == MEM_TREND) {
+    for (unsigned i = 1; i < MEM_TREND; i++) m->trend[i - 1] = m->trend[i];
+    m->ntrend--;
+  }
+  m->trend[m->ntrend++] = mem_stack_free(m);
+}
+
+// Free stack lost over the samples kept, in bytes. 0 means stable
+static inline uint32_t mem_trend(const struct mem *m) {
+  return m->ntrend < 2 ? 0 : m->trend[0] - m->trend[m->ntrend - 1];
+}
+
+static inline uint32_t mem_crash_check(const struct mem_crash *c) {
+  return c->magic ^ c->pc ^ c->lr ^ c->sp ^ c->cfsr ^ c->addr;
+}
+
+static inline void mem_crash_save(struct mem_crash *c, uint32_t pc,
+                                  uint32_t lr, uint32_t sp, uint32_t cfsr,
+                                  uint32_t addr) {
+  *c = (struct mem_crash) {MEM_CRASH_MAGIC, pc, lr, sp, cfsr, addr, 0};
+  c->check = mem_crash_check(c);
+}
+
+static inline bool mem_crash_valid(const struct mem_crash *c) {
+  return c->magic == MEM_CRASH_MAGIC && c->check == mem_crash_check(c);
+}
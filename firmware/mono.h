@@ -0,0 +1,44 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Monotonic time. A 16-bit hardware counter is extended to 64 bits by an
+// overflow count that an interrupt increments. Readers do not disable
+// interrupts. Like a seqlock with the overflow count as the sequence, they
+// read the count, then the counter, and retry if the count changed in
+// between. An overflow that is not counted yet, because interrupts are
+// disabled or the handler has not run, is taken from the pending flag.
+//
+// 64-bit time is for deadlines that live long, like scheduler timers. Hot
+// paths, like interrupt handlers, can keep 32-bit milliseconds, which wrap
+// every 49 days, and compare them with elapsed() and deadline_passed()
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Read the extended counter. count() returns the counter, which reads 0
+// when an overflow is flagged, pending() the overflow flag
+static inline uint64_t mono_ticks(const volatile uint32_t *overflows,
+                                  uint16_t (*count)(void),
+                                  bool (*pending)(void)) {
+  uint32_t hi;
+  uint16_t lo;
+  bool wrapped;
+  do {
+    hi = *overflows;
+    lo = count();
+    wrapped = lo < 0x8000 && pending();  // Wrapped, not counted yet
+  } while (hi != *overflows);
+  return (((uint64_t) hi + wrapped) << 16) | lo;
+}
+
+// Milliseconds from since to now, correct across a 32-bit wrap
+static inline uint32_t elapsed(uint32_t since, uint32_t now) {
+  return now - since;
+}
+
+// True if now is at or past the deadline, for deadlines under 24 days away
+static inline bool deadline_passed(uint32_t deadline, uint32_t now) {
+  return (int32_t) (now - deadline) >= 0;
+}
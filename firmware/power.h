@@ -0,0 +1,44 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Battery power policy. A CR2032 coin cell holds near 3 V for most of its
+// life, then falls off a knee. VDD is not measured directly: the ADC reads
+// the internal reference, VREFINT, against it, and the factory calibration
+// value is that reading at 3.0 V. So VDD follows from one ADC sample:
+//
+//   uint16_t mv = power_vdd_mv(adc_vrefint(), VREFINT_CAL);
+//   level = power_level(levels, ARRAY_SIZE(levels), level, mv);
+//
+// Levels are rows of a table, by falling voltage, each saving more than
+// the one before. The level goes down once VDD is below its threshold, and
+// back up only once VDD is POWER_HYST_MV over the threshold above: a cell
+// recovers some when the load is off, and sags when cold
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define POWER_CAL_MV 3000  // VDDA at which VREFINT_CAL was taken
+#define POWER_HYST_MV 100  // Going back up takes that much more
+
+struct power_level {
+  uint16_t mv;          // Level holds down to this VDD, 0 for the last one
+  uint16_t timeout_ms;  // Display timeout, at most
+  uint8_t brightness;   // LED brightness, at most, see set_brightness()
+  bool log;             // Log output is sent
+  bool low;             // Low battery: the time comes with a warning
+};
+
+// VDD in mV, from an ADC reading of VREFINT, and its calibration value
+static inline uint16_t power_vdd_mv(uint16_t raw, uint16_t cal) {
+  return raw == 0 ? 0 : (uint16_t) ((uint32_t) POWER_CAL_MV * cal / raw);
+}
+
+// Level for VDD mv, of n levels in table t, coming from level cur
+static inline unsigned power_level(const struct power_level *t, unsigned n,
+                                   unsigned cur, uint16_t mv) {
+  unsigned i = 0;
+  while (i + 1 < n && mv < t[i].mv + (i < cur ? POWER_HYST_MV : 0)) i++;
+  return i;
+}
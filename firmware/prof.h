@@ -0,0 +1,81 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Cycle profiler. A probe measures a code section with a free-running
+// counter, prof_cycles() from hal.h: DWT CYCCNT on the device, host clock
+// nanoseconds on unix. Each probe keeps count, min, max, mean and a log2
+// histogram in static RAM. Build with PROF=1 to enable. Otherwise, probes
+// compile to nothing, and no RAM is used:
+//
+//   void foo(void) {
+//     PROF_BEGIN(foo);
+//     ...
+//     PROF_END(foo);
+//   }
+//
+// A probe in the main loop also counts cycles of interrupts that preempt it
+
+#pragma once
+
+#include "logt.h"
+
+#ifndef PROF
+#define PROF 0  // 1 - enable probes, 0 - compile them out
+#endif
+
+#define PROF_BUCKETS 20  // Bucket i counts durations 2^i .. 2^(i+1)-1
+
+// All probes. Adding one here makes it known to PROF_BEGIN() and PROF_END()
+#define PROF_PROBES(X)                                       \
+  X(led_task) X(log_task) X(set_leds) X(exti2_irq) X(uart_irq) \
+  X(wake)
+
+enum {
+#define PROF_ENUM(name) PROF_##name,
+  PROF_PROBES(PROF_ENUM)
+#undef PROF_ENUM
+  PROF_NUM_PROBES
+};
+
+struct prof {
+  uint32_t count, min, max;     // Calls, and their shortest and longest
+  uint64_t sum;                 // Total, for the mean
+  uint32_t hist[PROF_BUCKETS];  // Number of calls, by log2 of duration
+};
+
+static inline void prof_record(struct prof *p, uint32_t cycles) {
+  unsigned bucket = cycles == 0 ? 0 : 31 - (unsigned) __builtin_clz(cycles);
+  if (bucket >= PROF_BUCKETS) bucket = PROF_BUCKETS - 1;
+  if (p->count == 0 || cycles < p->min) p->min = cycles;
+  if (cycles > p->max) p->max = cycles;
+  p->count++, p->sum += cycles, p->hist[bucket]++;
+}
+
+#if PROF
+static struct prof s_prof[PROF_NUM_PROBES];
+
+#define PROF_NAME(name) #name,
+static const char *s_prof_names[] = {PROF_PROBES(PROF_NAME)};
+#undef PROF_NAME
+
+#define PROF_BEGIN(name) uint32_t prof_##name##_ = prof_cycles()
+#define PROF_END(name) \
+  prof_record(&s_prof[PROF_##name], prof_cycles() - prof_##name##_)
+
+// Print one probe, as: name count min/mean/max, then histogram buckets
+// as log2:count for non-empty buckets
+static inline void prof_print(size_t i) {
+  const struct prof *p = &s_prof[i];
+  LOG("%s: %lu, %lu/%lu/%lu,", s_prof_names[i], (unsigned long) p->count,
+      (unsigned long) p->min,
+      (unsigned long) (p->count ? p->sum / p->count : 0),
+      (unsigned long) p->max);
+  for (unsigned j = 0; j < PROF_BUCKETS; j++) {
+    if (p->hist[j] > 0) LOG(" %u:%lu", j, (unsigned long) p->hist[j]);
+  }
+  LOG("\n");
+}
+#else
+#define PROF_BEGIN(name)
+#define PROF_END(name)
+#endif
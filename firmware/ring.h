@@ -0,0 +1,50 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Lock-free single-producer, single-consumer byte ring buffer. Used to pass
+// data between the main loop and an interrupt handler, in either direction
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ring {
+  uint8_t *buf;      // Storage
+  unsigned size;     // Storage size, must be a power of two
+  atomic_uint head;  // Next byte to write. Written by producer only
+  atomic_uint tail;  // Next byte to read. Written by consumer only
+};
+
+static inline unsigned ring_len(struct ring *r) {
+  return atomic_load_explicit(&r->head, memory_order_acquire) -
+         atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+static inline bool ring_empty(struct ring *r) {
+  return ring_len(r) == 0;
+}
+
+// Append as much of the data as fits. Return number of bytes written
+static inline size_t ring_write(struct ring *r, const void *buf, size_t len) {
+  unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  size_t i, space = r->size - (head - tail);
+  if (len > space) len = space;
+  for (i = 0; i < len; i++) {
+    r->buf[(head + i) & (r->size - 1)] = ((const uint8_t *) buf)[i];
+  }
+  atomic_store_explicit(&r->head, head + (unsigned) len, memory_order_release);
+  return len;
+}
+
+static inline bool ring_get(struct ring *r, uint8_t *byte) {
+  unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (head == tail) return false;
+  *byte = r->buf[tail & (r->size - 1)];
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  return true;
+}
@@ -0,0 +1,110 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Deadline-driven software timers, shared by all architectures.
+// Timers are owned by the caller. The scheduler keeps pointers to them in a
+// fixed-size min-heap ordered by expiration time, so there are no allocations,
+// sched_run() touches only expired timers, and sched_next() is O(1)
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef SCHED_MAX_TIMERS
+#define SCHED_MAX_TIMERS 8
+#endif
+
+struct timer {
+  void (*fn)(void *);  // Function to call on expiration
+  void *arg;           // Function argument
+  uint64_t expire;     // Absolute expiration time, milliseconds
+  uint32_t period;     // Repeat period, or 0 for one-shot timers
+  uint32_t seq;        // Insertion order, keeps equal deadlines in FIFO order
+  size_t pos;          // 1-based position in the heap, 0 if not scheduled
+};
+
+struct sched {
+  struct timer *heap[SCHED_MAX_TIMERS];
+  size_t len;
+  uint32_t seq;
+};
+
+static inline bool timer_active(const struct timer *t) {
+  return t->pos > 0;
+}
+
+static inline bool sched_less(struct sched *s, size_t i, size_t j) {
+  const struct timer *a = s->heap[i], *b = s->heap[j];
+  return a->expire < b->expire ||
+         (a->expire == b->expire && (int32_t) (a->seq - b->seq) < 0);
+}
+
+static inline void sched_swap(struct sched *s, size_t i, size_t j) {
+  struct timer *t = s->heap[i];
+  s->heap[i] = s->heap[j], s->heap[j] = t;
+  s->heap[i]->pos = i + 1, s->heap[j]->pos = j + 1;
+}
+
+static inline void sched_up(struct sched *s, size_t i) {
+  while (i > 0 && sched_less(s, i, (i - 1) / 2)) {
+    sched_swap(s, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static inline void sched_down(struct sched *s, size_t i) {
+  for (;;) {
+    size_t l = 2 * i + 1, r = l + 1, m = i;
+    if (l < s->len && sched_less(s, l, m)) m = l;
+    if (r < s->len && sched_less(s, r, m)) m = r;
+    if (m == i) break;
+    sched_swap(s, i, m);
+    i = m;
+  }
+}
+
+static inline void sched_cancel(struct sched *s, struct timer *t) {
+  size_t i;
+  if (t->pos == 0) return;
+  i = t->pos - 1, t->pos = 0;
+  if (i != --s->len) {
+    s->heap[i] = s->heap[s->len];
+    s->heap[i]->pos = i + 1;
+    sched_down(s, i);
+    sched_up(s, i);
+  }
+}
+
+// Schedule timer to fire at `expire`, then every `period` ms if non-zero.
+// Re-scheduling an active timer moves it. Return false if the heap is full
+static inline bool sched_add(struct sched *s, struct timer *t, uint64_t expire,
+                             uint32_t period) {
+  sched_cancel(s, t);
+  if (s->len >= SCHED_MAX_TIMERS) return false;
+  t->expire = expire, t->period = period, t->seq = s->seq++;
+  s->heap[s->len++] = t;
+  t->pos = s->len;
+  sched_up(s, s->len - 1);
+  return true;
+}
+
+// Earliest expiration time, or UINT64_MAX if nothing is scheduled
+static inline uint64_t sched_next(const struct sched *s) {
+  return s->len > 0 ? s->heap[0]->expire : UINT64_MAX;
+}
+
+// Call expired timers in deadline order. Callbacks may add or cancel timers.
+// Periodic timers that fell behind skip missed periods instead of bursting
+static inline void sched_run(struct sched *s, uint64_t now) {
+  while (s->len > 0 && s->heap[0]->expire <= now) {
+    struct timer *t = s->heap[0];
+    sched_cancel(s, t);
+    if (t->period > 0) {
+      uint64_t next = t->expire + t->period;
+      sched_add(s, t, next > now ? next : now + t->period, t->period);
+    }
+    t->fn(t->arg);
+  }
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Decode tokenized log stream captured from the device UART, see logt.h
+// Usage: logdecode firmware.logstr < capture.bin
+// firmware.logstr is the .logstr section dumped from the ELF: make logstr
+
+#include <stdlib.h>
+
+#include "../logt.h"
+
+int main(int argc, char *argv[]) {
+  static char strs[64 * 1024];
+  uint8_t rec[256];
+  char text[512];
+  size_t strs_len;
+  uint64_t time;
+  int len;
+  FILE *fp;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s firmware.logstr < capture.bin\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if ((fp = fopen(argv[1], "rb")) == NULL) {
+    fprintf(stderr, "Cannot open %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  strs_len = fread(strs, 1, sizeof(strs) - 1, fp);
+  fclose(fp);
+
+  while ((len = getchar()) != EOF) {
+    if (fread(rec, 1, (size_t) len, stdin) != (size_t) len) break;
+    if (logt_decode(strs, strs_len, rec, (size_t) len, &time, text,
+                    sizeof(text))) {
+      printf("%6lu.%03lu %s", (unsigned long) (time / 1000),
+             (unsigned long) (time % 1000), text);
+    } else {
+      printf("?? bad record, %d bytes\n", len);
+    }
+  }
+  return EXIT_SUCCESS;
+}
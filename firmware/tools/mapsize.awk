@@ -0,0 +1,59 @@
+# Flash and RAM use by object file, from a GNU ld map file. See "make size".
+# Input sections are listed as: name address size file. A long name takes
+# a line of its own, and the rest goes on the next line. Given a saved
+# report, base=FILE, every line also shows the change since: files that
+# are gone show up with what they took, as a saving
+
+function hex(s,  i, n) {
+  n = 0
+  s = tolower(substr(s, 3))
+  for (i = 1; i <= length(s); i++) {
+    n = n * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+  }
+  return n
+}
+
+function add(sect, size, file) {
+  sub(/.*\//, "", file)  # Library path is noise, keep archive(member)
+  if (sect ~ /^\.(text|rodata|isr_vector|ARM)/) flash[file] += hex(size)
+  if (sect ~ /^\.data/) { flash[file] += hex(size); ram[file] += hex(size) }
+  if (sect ~ /^\.bss|^COMMON/) ram[file] += hex(size)
+}
+
+BEGIN {
+  while (base != "" && (getline line < base) > 0) {
+    split(line, v)
+    f = substr(line, 20)  # After "%8d %8d  "
+    if (f ~ /^TOTAL/) continue
+    was_flash[f] = v[1]
+    was_ram[f] = v[2]
+    files[f] = 1
+  }
+}
+
+function show(f, fl, rm) {
+  printf "%8d %8d", fl, rm
+  if (base != "") printf " %+8d %+8d", fl - was_flash[f], rm - was_ram[f]
+  printf "  %s\n", f
+}
+
+/^Linker script and memory map/ { on = 1; next }
+!on { next }
+/^ [.A-Z]/ && $2 ~ /^0x/ && NF == 4 { add($1, $3, $4); pending = ""; next }
+/^ [.A-Z]/ && NF == 1 { pending = $1; next }
+/^ +0x/ && NF == 3 && pending != "" { add(pending, $2, $3) }
+{ pending = "" }
+
+END {
+  t = "TOTAL (flash, RAM)"
+  for (f in flash) files[f] = 1
+  for (f in ram) files[f] = 1
+  for (f in files) {
+    show(f, flash[f], ram[f])
+    total_flash += flash[f]
+    total_ram += ram[f]
+    was_flash[t] += was_flash[f]
+    was_ram[t] += was_ram[f]
+  }
+  show(t, total_flash, total_ram)
+}
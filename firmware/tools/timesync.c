@@ -0,0 +1,169 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Set the watch time from the host clock, and settings, see tsync.h
+// Usage: timesync /dev/cu.usbserial-0001 [samples] [timeout=MS] [gap=MS]
+// Long press the button first, to turn on the watch UART receiver. Log
+// output that comes along is passed through to stdout.
+// With trace=FILE, save the watch event trace to FILE instead, see trace.h
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../trace.h"
+#include "../tsync.h"
+
+#define TIMEOUT_US 200000  // Wait that long for a reply, then send again
+#define DAY_MS 86400000U
+
+static int64_t now_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int open_port(const char *name) {
+  struct termios tio;
+  int fd = open(name, O_RDWR | O_NOCTTY);
+  if (fd < 0 || tcgetattr(fd, &tio) != 0) return -1;
+  cfmakeraw(&tio);
+  cfsetspeed(&tio, B115200);
+  tio.c_cc[VMIN] = 0, tio.c_cc[VTIME] = 1;  // Reads return in 0.1s
+  if (tcsetattr(fd, TCSANOW, &tio) != 0) return -1;
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+static FILE *s_trace;       // Trace records received go there
+static unsigned s_records;  // Number of them
+
+// Send a frame, and wait for a reply of a given type. Return the time the
+// reply came, or -1 on timeout. Trace records restart the wait
+static int64_t exchange(int fd, const struct tsync_msg *m, uint8_t type,
+                        struct tsync_msg *reply) {
+  static struct tsync_parser p;
+  uint8_t buf[TSYNC_FRAME_SIZE], byte;
+  char line[64];
+  int64_t start;
+  tsync_encode(m, buf);
+  if (write(fd, buf, sizeof(buf)) != (ssize_t) sizeof(buf)) return -1;
+  start = now_us();
+  while (now_us() - start < TIMEOUT_US) {
+    if (read(fd, &byte, 1) != 1) continue;
+    int t = tsync_feed(&p, byte, reply);
+    if (t < 0) putchar(byte);
+    if (t == TSYNC_TRACE && reply->seq == m->seq && s_trace != NULL) {
+      trace_format(line, sizeof(line), reply->a, reply->b, reply->c);
+      fputs(line, s_trace);
+      s_records += reply->b < TRACE_CLOCK;
+      start = now_us();
+    }
+    if (t == type && reply->seq == m->seq) return now_us();
+  }
+  return -1;
+}
+
+static int trace_save(int fd, const char *path) {
+  struct tsync_msg m = {TSYNC_TRACE, 0xfd, 0, 0, 0}, r;
+  if ((s_trace = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  fprintf(s_trace, "# time_ms event value\n");
+  if (exchange(fd, &m, TSYNC_ACK, &r) < 0 || r.a != s_records) {
+    fprintf(stderr, "Trace cut short: %u records\n", s_records);
+    fclose(s_trace);
+    return -1;
+  }
+  printf("Saved %u records to %s\n", s_records, path);
+  return fclose(s_trace);
+}
+
+static const char *s_settings[] = {
+    [TSYNC_TIMEOUT_MS] = "timeout",
+    [TSYNC_CLICK_GAP_MS] = "gap",
+};
+
+static int configure(int fd, const char *arg) {  // name=value
+  struct tsync_msg m = {TSYNC_CONF, 0xfe, 0, 0, 0}, r;
+  size_t n = strcspn(arg, "=");
+  for (m.a = 0; m.a < sizeof(s_settings) / sizeof(s_settings[0]); m.a++) {
+    if (strlen(s_settings[m.a]) == n && strncmp(arg, s_settings[m.a], n) == 0) {
+      m.b = (uint32_t) strtoul(arg + n + 1, NULL, 0);
+      if (exchange(fd, &m, TSYNC_ACK, &r) < 0) return -1;
+      printf("%s: %lu%s\n", s_settings[m.a], (unsigned long) r.b,
+             r.b == m.b ? "" : ", out of range");
+      return 0;
+    }
+  }
+  fprintf(stderr, "Unknown setting: %s\n", arg);
+  return -1;
+}
+
+int main(int argc, char *argv[]) {
+  int samples = 16, fd, got = 0;
+  int64_t t1, t4, offset, delay, best = INT64_MAX, best_offset = 0, host;
+  struct tsync_msg m, r;
+  struct tm tm;
+  time_t sec;
+
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: %s PORT [samples] [timeout=MS] [gap=MS] [trace=FILE]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  if ((fd = open_port(argv[1])) < 0) {
+    fprintf(stderr, "Cannot open %s: %s\n", argv[1], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  for (int i = 2; i < argc; i++) {
+    if (strncmp(argv[i], "trace=", 6) == 0) {
+      return trace_save(fd, argv[i] + 6) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (strchr(argv[i], '=') == NULL) {
+      samples = atoi(argv[i]);
+    } else if (configure(fd, argv[i]) != 0) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Keep the sample with the shortest round trip: it is the least skewed
+  for (int i = 0; i < samples * 4 && got < samples; i++) {
+    m = (struct tsync_msg) {TSYNC_REQ, (uint8_t) i, 0, 0, 0};
+    m.a = (uint32_t) (t1 = now_us());
+    if ((t4 = exchange(fd, &m, TSYNC_REPLY, &r)) < 0 || r.a != m.a) continue;
+    tsync_sample(t1, r.b, r.c, t4, &offset, &delay);
+    printf("seq %3d: delay %6lld us, offset %lld us\n", i, (long long) delay,
+           (long long) offset);
+    if (delay < best) best = delay, best_offset = offset;
+    got++;
+  }
+  if (got == 0) {
+    fprintf(stderr, "No replies. Long press the button, and try again\n");
+    return EXIT_FAILURE;
+  }
+
+  // Local time of day at the start of the next watch millisecond
+  m = (struct tsync_msg) {TSYNC_SET, 0xff, 0, 0, 0};
+  m.a = tsync_watch_time(now_us(), best_offset, &host);
+  sec = (time_t) (host / 1000000);
+  localtime_r(&sec, &tm);
+  m.b = (uint32_t) ((tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec) * 1000 +
+                    (host % 1000000 + 500) / 1000);
+  if (m.b >= DAY_MS) m.b -= DAY_MS;  // Rounded up to midnight
+  if (exchange(fd, &m, TSYNC_ACK, &r) < 0) {
+    fprintf(stderr, "No reply to set time\n");
+    return EXIT_FAILURE;
+  }
+  printf("Set %02u:%02u:%02u.%03u, delay %lld us\n", r.b / 3600000,
+         r.b / 60000 % 60, r.b / 1000 % 60, r.b % 1000, (long long) best);
+  close(fd);
+  return EXIT_SUCCESS;
+}
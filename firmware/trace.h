@@ -0,0 +1,103 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Event trace, for when a press is misread on the wrist. A fixed ring of
+// timestamped records in RAM keeps the last TRACE_SIZE events: button edges
+// and debounced levels, state changes, LED masks, boots and deep sleeps.
+// Adding one is a few stores, from the main loop or an interrupt handler,
+// so unlike log output it does not change the timing it records:
+//
+//   trace_add(&t, (uint32_t) now_ms(), TRACE_LEDS, mask);
+//
+// The watch sends the ring over the UART on request, see tsync.h, and the
+// host saves it as text, a record per line: time since boot in ms, event
+// name and value. The unix build replays such files against the firmware,
+// see arch/unix/replay.c
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_SIZE 128  // Records kept, must be a power of two
+
+enum {
+  TRACE_BOOT = 1,   // Reset: 0 - cold boot, wake-up by 1 - button, 2 - RTC
+  TRACE_EDGE,       // Button interrupt: pin level
+  TRACE_BUTTON,     // Button level after debounce: 1 - pressed
+  TRACE_STATE,      // Watch state set
+  TRACE_LEDS,       // LED mask shown, when it changes
+  TRACE_SLEEP,      // Deep sleep mode, when it changes: 1 - STOP2, 2 - Standby
+  TRACE_CLOCK,      // Time of day on boot, and when synced, ms
+  TRACE_DUMP,       // Dump only: time of day at the dump, ms
+  TRACE_TIMEOUT,    // Dump only: display timeout setting, ms
+  TRACE_CLICK_GAP,  // Dump only: click gap setting, ms
+  TRACE_NUM_TYPES
+};
+
+struct trace_rec {
+  uint32_t time;   // Milliseconds since boot, truncated
+  uint32_t value;  // Depends on type
+  uint8_t type;
+};
+
+struct trace {
+  struct trace_rec recs[TRACE_SIZE];
+  atomic_uint head;  // Records ever added. The last TRACE_SIZE are kept
+};
+
+// Take a slot atomically: an interrupt handler may add one meanwhile
+static inline void trace_add(struct trace *t, uint32_t time, uint8_t type,
+                             uint32_t value) {
+  unsigned i = atomic_fetch_add_explicit(&t->head, 1, memory_order_relaxed);
+  struct trace_rec *r = &t->recs[i & (TRACE_SIZE - 1)];
+  r->time = time, r->value = value, r->type = type;
+}
+
+// Oldest record kept, and the one after the newest
+static inline unsigned trace_first(struct trace *t) {
+  unsigned head = atomic_load_explicit(&t->head, memory_order_relaxed);
+  return head < TRACE_SIZE ? 0 : head - TRACE_SIZE;
+}
+
+static inline unsigned trace_end(struct trace *t) {
+  return atomic_load_explicit(&t->head, memory_order_relaxed);
+}
+
+static inline const struct trace_rec *trace_get(const struct trace *t,
+                                                unsigned i) {
+  return &t->recs[i & (TRACE_SIZE - 1)];
+}
+
+static inline const char *trace_name(unsigned type) {
+  static const char *names[TRACE_NUM_TYPES] = {
+      "?",     "boot",  "edge", "button",  "state", "leds",
+      "sleep", "clock", "dump", "timeout", "gap"};
+  return names[type < TRACE_NUM_TYPES ? type : 0];
+}
+
+// Host side. Text line of a record, like "1234 leds 0x88"
+static inline int trace_format(char *buf, size_t len, uint32_t time,
+                               unsigned type, uint32_t value) {
+  const char *fmt = type == TRACE_LEDS ? "%lu %s %#lx\n" : "%lu %s %lu\n";
+  return snprintf(buf, len, fmt, (unsigned long) time, trace_name(type),
+                  (unsigned long) value);
+}
+
+// Host side. Parse a text line. Return false for comments, blank lines,
+// and lines that are not records
+static inline bool trace_parse(const char *line, uint32_t *time,
+                               unsigned *type, uint32_t *value) {
+  char name[16], num[16];
+  unsigned long t;
+  if (sscanf(line, "%lu %15s %15s", &t, name, num) != 3) return false;
+  for (*type = 1; *type < TRACE_NUM_TYPES; (*type)++) {
+    if (strcmp(name, trace_name(*type)) == 0) break;
+  }
+  *time = (uint32_t) t, *value = (uint32_t) strtoul(num, NULL, 0);
+  return *type < TRACE_NUM_TYPES;
+}
@@ -0,0 +1,124 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Time sync protocol on the debug UART. The host sends requests, and the
+// watch answers with the times it received the request and sent the reply,
+// like NTP does. From the four timestamps, the host gets the round trip
+// delay, and the offset of the watch clock from its own:
+//
+//   host  t1 ---- request ---> t2  watch    delay = (t4 - t1) - (t3 - t2)
+//         t4 <--- reply ------ t3           offset = (t2 - t1 + t3 - t4) / 2
+//
+// Requests and replies have the same length, so time on the wire cancels
+// out of the offset. The host keeps the sample with the shortest delay,
+// then tells the watch the time of day at a given watch time. Settings are
+// changed the same way, and kept by the watch over resets. The event trace
+// is fetched too. Frames share the wire with log output, so they start
+// with a magic and end with a CRC:
+//
+//   a5 5a type seq a:u32 b:u32 c:u32 crc8   (little endian)
+//
+// Host times are microseconds, watch times are milliseconds since boot,
+// truncated to 32 bits
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TSYNC_FRAME_SIZE 17
+#define TSYNC_MAGIC0 0xa5
+#define TSYNC_MAGIC1 0x5a
+
+enum {
+  TSYNC_REQ = 1,  // Host: a = t1, echoed back
+  TSYNC_REPLY,    // Watch: a = t1, b = t2, c = t3
+  TSYNC_SET,      // Host: a = watch time, b = time of day at a, ms
+  TSYNC_ACK,      // Watch: to SET as SET, to CONF a = setting, b = value
+  TSYNC_CONF,     // Host: a = setting, b = value
+  TSYNC_TRACE,    // Host: send the trace. Watch: a = time, b = event, c =
+                  // value, see trace.h. Then ACK, a = number of records
+};
+
+enum { TSYNC_TIMEOUT_MS, TSYNC_CLICK_GAP_MS };  // Settings
+
+struct tsync_msg {
+  uint8_t type, seq;
+  uint32_t a, b, c;
+};
+
+struct tsync_parser {
+  uint8_t buf[TSYNC_FRAME_SIZE];
+  size_t len;
+};
+
+static inline uint8_t tsync_crc8(const uint8_t *buf, size_t len) {
+  uint8_t crc = 0;  // Polynomial 0x07
+  while (len-- > 0) {
+    crc ^= *buf++;
+    for (int i = 0; i < 8; i++) {
+      crc = (uint8_t) (crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1);
+    }
+  }
+  return crc;
+}
+
+static inline void tsync_put32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t) v, p[1] = (uint8_t) (v >> 8);
+  p[2] = (uint8_t) (v >> 16), p[3] = (uint8_t) (v >> 24);
+}
+
+static inline uint32_t tsync_get32(const uint8_t *p) {
+  return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+         (uint32_t) p[3] << 24;
+}
+
+static inline void tsync_encode(const struct tsync_msg *m, uint8_t *buf) {
+  buf[0] = TSYNC_MAGIC0, buf[1] = TSYNC_MAGIC1, buf[2] = m->type;
+  buf[3] = m->seq;
+  tsync_put32(buf + 4, m->a);
+  tsync_put32(buf + 8, m->b);
+  tsync_put32(buf + 12, m->c);
+  buf[16] = tsync_crc8(buf, 16);
+}
+
+// Feed a received byte. Return -1 if the byte is not part of a frame, 0 if
+// it is, and a message type when it completes a valid frame. Frames with a
+// bad CRC are dropped
+static inline int tsync_feed(struct tsync_parser *p, uint8_t byte,
+                             struct tsync_msg *m) {
+  if (p->len == 0 && byte != TSYNC_MAGIC0) return -1;
+  if (p->len == 1 && byte != TSYNC_MAGIC1) {
+    p->len = 0;  // Not a frame after all
+    return tsync_feed(p, byte, m);
+  }
+  p->buf[p->len++] = byte;
+  if (p->len < TSYNC_FRAME_SIZE) return 0;
+  p->len = 0;
+  if (tsync_crc8(p->buf, 16) != p->buf[16] || p->buf[2] == 0) return 0;
+  m->type = p->buf[2], m->seq = p->buf[3];
+  m->a = tsync_get32(p->buf + 4);
+  m->b = tsync_get32(p->buf + 8);
+  m->c = tsync_get32(p->buf + 12);
+  return m->type;
+}
+
+// Host side. Offset of the watch clock from the host clock, and round trip
+// delay, in microseconds, from host times t1, t4 and watch times t2, t3
+static inline void tsync_sample(int64_t t1, uint32_t t2, uint32_t t3,
+                                int64_t t4, int64_t *offset, int64_t *delay) {
+  int64_t w2 = (int64_t) t2 * 1000, w3 = (int64_t) t3 * 1000;
+  *delay = (t4 - t1) - (w3 - w2);
+  *offset = ((w2 - t1) + (w3 - t4)) / 2;
+}
+
+// Host side. The first watch time at or after host time now, and the host
+// time it starts at. Watch times are whole milliseconds, read half a
+// millisecond short on average, and the offset is short by as much
+static inline uint32_t tsync_watch_time(int64_t now, int64_t offset,
+                                        int64_t *host) {
+  int64_t ms = (now + offset + 500 + 999) / 1000;
+  *host = ms * 1000 - offset - 500;
+  return (uint32_t) ms;
+}
@@ -2,32 +2,141 @@
 // SPDX-License-Identifier: MIT
 
 #include "hal.h"
+#include "anim.h"
+#include "clock.h"
+#include "drift.h"
+#include "evq.h"
+#include "fmt.h"
+#include "fsm.h"
+#include "gesture.h"
+#include "kv.h"
+#include "logt.h"
+#include "mem.h"
+#include "mono.h"
+#include "power.h"
+#include "prof.h"
+#include "ring.h"
+#include "sched.h"
+#include "trace.h"
+#include "tsync.h"
+#include "wclock.h"
 
 #define UART_DEBUG USART1    // Debug output UART channel
 #define BTN_PIN PIN('A', 2)  // Button pin
 #define TIMEOUT_MS 2500      // How long LEDs stay on after button press
-#define NEXT_PRESS_MS 500    // Time within next button press is expected
+#define DEBOUNCE_MS 20       // Button level must settle for that long
+#define NEXT_PRESS_MS 400    // Time within next button press is expected
+#define LONG_PRESS_MS 800    // Press that lasts that long is a long press
+#define HOLD_REPEAT_MS 250   // Repeat period while held after a long press
 #define LOG_PERIOD_MS 1000   // For periodic debug messages
+#define LOG_BUF_SIZE 512     // Log output buffer size, must be power of two
+#define LOG_BLOCK 0          // If log buffer is full: 1 - wait, 0 - drop
+#define RX_BUF_SIZE 64       // UART receive buffer size, power of two
+#define RX_WINDOW_MS 10000   // UART receiver stays on after the last byte
+
+#define STANDBY_IDLE_MS 10000  // Idle that long, then go to Standby
+#ifndef DEBUG
+#define DEBUG 0  // 1 - paint RAM on every boot, for stack telemetry
+#endif
 
-#define SECONDS_IN_DAY (24 * 60 * 60)
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
-// Watch states
+// Watch states. The last ones hold what the states they enclose share, see
+// s_fsm. The watch is always in one of the first ones
 static enum watch_state {
-  STATE_SLEEP,        // Sleeping, drawing minimum energy possible
-  STATE_SHOW_TIME,    // Showing current time - after single button press
-  STATE_SET_HOURS,    // Setting hours - after a triple button press
-  STATE_SET_MINUTES,  // Setting minutes - after a quad button press
+  STATE_SLEEP,              // Sleeping, drawing minimum energy possible
+  STATE_SHOW_TIME,          // Showing current time - after single button press
+  STATE_SET_HOURS,          // Setting hours - after a triple button press
+  STATE_SET_MINUTES,        // Setting minutes - after a quad button press
+  STATE_SET_TIMER,          // Setting countdown minutes - after a double press
+  STATE_SET_ALARM_HOURS,    // Setting alarm hours - after 5 presses
+  STATE_SET_ALARM_MINUTES,  // Setting alarm minutes - after 6 presses
+  STATE_RINGING,            // Alarm or countdown went off
+  STATE_DISPLAY,            // Display is on: showing time, or setting it
+  STATE_SETTING,            // Setting time, alarm, or countdown
+  NUM_STATES
 } s_state = STATE_SLEEP;
 
-// Timestamp is millis when the LEDs should be turned off and we sleep again
-static uint64_t s_timeout;
+// Time of day. Starts at 00:00 on boot, or at the time last saved
+static struct wclock s_wclock;
+
+// Time and settings that must survive a power loss, in the last flash
+// pages, see kv.h. Time of day is saved when set, and every hour, so that
+// after a reset it is off by the time the watch was down, and an hour
+// at most. Settings are changed over the UART, see tsync.h
+enum { KV_TIME, KV_DRIFT, KV_TIMEOUT, KV_CLICK_GAP, KV_ALARM };
+#define KV_TIME_PERIOD_MS (60 * 60 * 1000UL)
+static struct kv s_kv;
 
-// Time in a day in milliseconds at device boot
-static uint64_t s_time_in_millis_at_boot;
+// Alarm and countdown. RTC alarm A and wakeup timer keep them: those count
+// on in STOP2 and Standby, and wake us up when they fire, so nothing runs
+// until then. The alarm is a time of day, kept in flash. The RTC calendar
+// is not the time of day, see rtc_init(), so alarm A is set to when the
+// wall clock gets there, every time the time is saved. The countdown is a
+// number of minutes, the RTC counts them alone
+#define ALARM_OFF 0x24  // Alarm hours when there is no alarm
+static uint8_t s_alarm_hours = ALARM_OFF, s_alarm_minutes;  // Packed BCD
+static uint8_t s_countdown;            // Minutes, packed BCD, 0 if none
+static volatile unsigned s_rtc_fired;  // RTC_ALARM, RTC_WAKEUP, see hal.h
+
+static void alarm_arm(void) {
+  uint32_t tod, until;
+  if (s_alarm_hours >= ALARM_OFF) {
+    rtc_alarm_off();
+    return;
+  }
+  wclock_update(&s_wclock, now_ms());
+  tod = (uint32_t) (bcd_to_bin(s_alarm_hours) * WCLOCK_HOUR_MS +
+                    bcd_to_bin(s_alarm_minutes) * WCLOCK_MINUTE_MS);
+  until = (tod + WCLOCK_DAY_MS - wclock_tod_ms(&s_wclock)) % WCLOCK_DAY_MS;
+  rtc_alarm_set((uint32_t) ((rtc_ms() + until + 999) / 1000 %
+                            (WCLOCK_DAY_MS / 1000)));
+}
 
-// Milliseconds since boot
-volatile uint64_t g_ticks;
+static void time_save(void) {  // The RTC alarm moves with the clock
+  wclock_update(&s_wclock, now_ms());
+  if (!kv_set(&s_kv, KV_TIME, wclock_tod_ms(&s_wclock))) {
+    LOG("Flash write failed\n");
+  }
+  alarm_arm();
+}
+
+static void time_task(void *arg) {
+  (void) arg;
+  time_save();
+}
+static struct timer s_time_timer = {.fn = time_task};
+
+// Oscillator drift correction, learned from time syncs. It is kept in RTC
+// backup registers, which survive a reset, with a check word, and in flash
+#define BKP_DRIFT_MAGIC 0xd71f7c0dU
+enum { BKP_DRIFT, BKP_DRIFT_CHECK };
+static struct drift s_drift;
+
+static void drift_set(int32_t ppb) {
+  s_drift.ppb = ppb;
+  s_wclock.trim = drift_trim(ppb);
+  bkp_write(BKP_DRIFT, (uint32_t) ppb);
+  bkp_write(BKP_DRIFT_CHECK, (uint32_t) ppb ^ BKP_DRIFT_MAGIC);
+  kv_set(&s_kv, KV_DRIFT, (uint32_t) ppb);
+}
+
+static bool drift_bkp(int32_t *ppb) {  // Correction in backup registers
+  *ppb = (int32_t) bkp_read(BKP_DRIFT);
+  return ((uint32_t) *ppb ^ BKP_DRIFT_MAGIC) == bkp_read(BKP_DRIFT_CHECK);
+}
+
+static void drift_setup(void) {  // Take the correction the last boot left
+  uint32_t ppb;
+  int32_t bkp;
+  if (drift_bkp(&bkp)) {
+    drift_set(bkp);
+    LOG("Drift: %ld ppb\n", (long) s_drift.ppb);
+  } else if (kv_get(&s_kv, KV_DRIFT, &ppb)) {  // Power was lost
+    drift_set((int32_t) ppb);
+    LOG("Drift: %ld ppb, from flash\n", (long) s_drift.ppb);
+  }
+}
 
 // LEDs geometry on the PCB:                    Example:
 // ----------------------------------
@@ -37,168 +146,1071 @@ volatile uint64_t g_ticks;
 // red     red     red     red      1           o o     - o
 // ----------------------------------
 // HOUR    HOUR    MINUTE  MINUTE               1 3  :  4 9
-static const uint16_t s_leds[] = {
-    PIN('A', 3),  PIN('A', 4),  PIN('A', 5),  PIN('A', 6),  // red
-    PIN('A', 11), PIN('A', 12), PIN('A', 15), PIN('B', 7),  // orange
-    PIN('A', 7),  PIN('A', 8),  PIN('B', 0),  PIN('B', 1),  // green
-    PIN('B', 3),  PIN('B', 4),  PIN('B', 5),  PIN('B', 6),  // blue
-};
+#define LEDS_RED PIN('A', 3), PIN('A', 4), PIN('A', 5), PIN('A', 6)
+#define LEDS_ORANGE PIN('A', 11), PIN('A', 12), PIN('A', 15), PIN('B', 7)
+#define LEDS_GREEN PIN('A', 7), PIN('A', 8), PIN('B', 0), PIN('B', 1)
+#define LEDS_BLUE PIN('B', 3), PIN('B', 4), PIN('B', 5), PIN('B', 6)
+#define LED_BANKS 2  // LEDs are on GPIOA and GPIOB
+static const uint16_t s_leds[] = {LEDS_RED, LEDS_ORANGE, LEDS_GREEN, LEDS_BLUE};
+
+// Frame compiler tables, built at compile time from the pin lists above.
+// For every GPIO bank, LED row, and 4-bit row value, a BSRR word that sets
+// lit LEDs and resets the rest. OR-ing rows together gives a whole frame
+#define LED_BSRR(pin, bank, on) \
+  (PINBANK(pin) == (bank) ? BIT(PINNO(pin)) << ((on) ? 0 : 16) : 0)
+#define ROW_BSRR(bank, v, a, b, c, d)                                  \
+  (uint32_t) (LED_BSRR(a, bank, (v) & 1) | LED_BSRR(b, bank, (v) & 2) | \
+              LED_BSRR(c, bank, (v) & 4) | LED_BSRR(d, bank, (v) & 8))
+#define ROW_TABLE(bank, ...)                                                 \
+  {ROW_BSRR(bank, 0, __VA_ARGS__),  ROW_BSRR(bank, 1, __VA_ARGS__),         \
+   ROW_BSRR(bank, 2, __VA_ARGS__),  ROW_BSRR(bank, 3, __VA_ARGS__),         \
+   ROW_BSRR(bank, 4, __VA_ARGS__),  ROW_BSRR(bank, 5, __VA_ARGS__),         \
+   ROW_BSRR(bank, 6, __VA_ARGS__),  ROW_BSRR(bank, 7, __VA_ARGS__),         \
+   ROW_BSRR(bank, 8, __VA_ARGS__),  ROW_BSRR(bank, 9, __VA_ARGS__),         \
+   ROW_BSRR(bank, 10, __VA_ARGS__), ROW_BSRR(bank, 11, __VA_ARGS__),        \
+   ROW_BSRR(bank, 12, __VA_ARGS__), ROW_BSRR(bank, 13, __VA_ARGS__),        \
+   ROW_BSRR(bank, 14, __VA_ARGS__), ROW_BSRR(bank, 15, __VA_ARGS__)}
+#define BANK_TABLE(bank)                                           \
+  {ROW_TABLE(bank, LEDS_RED), ROW_TABLE(bank, LEDS_ORANGE),        \
+   ROW_TABLE(bank, LEDS_GREEN), ROW_TABLE(bank, LEDS_BLUE)}
+static const uint32_t s_led_bsrr[LED_BANKS][4][16] = {BANK_TABLE(0),
+                                                      BANK_TABLE(1)};
 
 uint32_t SystemCoreClock;  // Required by CMSIS. Holds system core cock value
 void SystemInit(void) {    // Called automatically by startup code
-  stack_fill();
+  SystemCoreClock = BOOT_HZ;  // Until clock_init(). The wake-up runs at it
+  prof_init();  // Counts cycles from reset, see wake_show()
+  if (DEBUG || !standby_wakeup()) stack_fill();  // All free RAM: slow
+}
+
+// Memory telemetry, see mem.h. The stack may grow down to the MPU guard,
+// which sits right above .bss
+static struct mem s_mem;
+static uint32_t *s_mem_logged;            // High-water mark last reported
+static NOINIT struct mem_crash s_crash;  // Left by the previous boot
+
+void fault_handler(uint32_t pc, uint32_t lr, uint32_t sp, uint32_t cfsr,
+                   uint32_t addr) {
+  mem_crash_save(&s_crash, pc, lr, sp, cfsr, addr);
+  cpu_reset();
 }
 
-void SysTick_Handler(void) {  // SyStick IRQ handler, triggered every 1ms
-  g_ticks++;
+// Guard the stack, report the last crash. If RAM was not painted, nothing
+// below the stack pointer is known to be free, and scans stay off
+static void mem_setup(bool painted) {
+  uintptr_t guard = ((uintptr_t) ram_end() + MEM_GUARD_SIZE - 1) &
+                    ~(uintptr_t) (MEM_GUARD_SIZE - 1);
+  uint32_t *bottom = (uint32_t *) (guard + MEM_GUARD_SIZE);
+  mpu_guard((void *) guard, MEM_GUARD_SIZE);
+  mem_init(&s_mem, painted ? bottom : stack_sp(), stack_top(), stack_sp());
+  s_mem_logged = s_mem.low;
+  if (mem_crash_valid(&s_crash)) {
+    LOG("Crash: pc %#lx, lr %#lx, sp %#lx, cfsr %#lx, addr %#lx\n",
+        (unsigned long) s_crash.pc, (unsigned long) s_crash.lr,
+        (unsigned long) s_crash.sp, (unsigned long) s_crash.cfsr,
+        (unsigned long) s_crash.addr);
+    s_crash.magic = 0;
+  }
+}
+
+// Event trace, see trace.h. Sent over the UART on request
+static struct trace s_trace;
+
+static void trace_event(uint8_t type, uint32_t value) {
+  trace_add(&s_trace, (uint32_t) now_ms(), type, value);
 }
 
-static void set_state(int new_state) {
+static void set_state(uint8_t new_state) {  // On every state transition
   s_state = new_state;
-  printf("%s -> %d, tick %lu\n", __func__, s_state, (unsigned long) g_ticks);
+  trace_event(TRACE_STATE, s_state);
+  LOG("%s -> %d, tick %lu\n", __func__, s_state, (unsigned long) now_ms());
 }
 
-// Set LEDs to a given state. There are 16 LEDs in 4 columns.
-// Each column is: red = 1, orange = 2, green = 4, blue = 8
-static void set_leds(uint16_t mask) {
-  for (size_t i = 0; i < ARRAY_SIZE(s_leds); i++) {
-    gpio_write(s_leds[i], mask & BIT(i));
+// Compile an LED mask into one BSRR word per GPIO bank
+static void led_frame(uint16_t mask, uint32_t *bsrr) {
+  for (int i = 0; i < LED_BANKS; i++) {
+    const uint32_t(*rows)[16] = s_led_bsrr[i];
+    bsrr[i] = rows[0][mask & 15] | rows[1][(mask >> 4) & 15] |
+              rows[2][(mask >> 8) & 15] | rows[3][mask >> 12];
   }
-  // printf("%s -> %#04hx\n", __func__, mask);
 }
 
-static inline uint16_t time_to_led_mask(unsigned hours, unsigned minutes) {
-  uint8_t a[] = {hours / 10, hours % 10, minutes / 10, minutes % 10};
-  uint16_t mask = 0;
-  for (int i = 0; i < 4; i++) {    // columns
-    for (int j = 0; j < 4; j++) {  // rows
-      uint16_t x = (a[i] & (1 << j)) ? 1 : 0;
-      mask |= x << (j * 4 + i);
+static void leds_init(void) {  // All LEDs to outputs, a GPIO bank at a time
+  uint32_t bsrr[LED_BANKS];
+  led_frame(0xffff, bsrr);  // Low halves: the pins to set
+  for (int i = 0; i < LED_BANKS; i++) {
+    gpio_output_bank((uint8_t) i, (uint16_t) bsrr[i]);
+  }
+}
+
+// Dimming. A PWM period is split into PWM_STEPS slots, and a timer-driven
+// DMA writes one precomputed frame per slot into the GPIO banks. A row is
+// lit for as many slots as its duty. Rows get different duties to even out
+// LED efficiencies. At full brightness, LEDs are driven statically without
+// PWM and compensation, and the CPU can stay in STOP2
+#define PWM_STEPS 16  // Brightness levels
+#define PWM_HZ 200    // PWM periods per second, above visible flicker
+#define LED_ROW(i) (0xfU << ((i) * 4))  // LED mask of row i
+#define LED_BRIGHTNESS PWM_STEPS        // Brightness at boot
+static uint8_t s_brightness = LED_BRIGHTNESS;  // 0 .. PWM_STEPS
+static const uint8_t s_color_gain[] = {60, 75, 100, 100};  // Percent, by row
+static uint32_t s_pwm[LED_BANKS][PWM_STEPS];  // DMA buffers, BSRR words
+static uint16_t s_led_mask;                   // What set_leds() shows
+
+// Estimated LED current. Every LED has a 1k series resistor
+#define LED_R_OHM 1000
+#define VDD_MV 3000  // Nominal coin cell voltage
+static const uint16_t s_led_vf_mv[] = {1900, 2000, 2100, 2800};  // By row
+
+// Battery power policy, see power.h. Every level down dims the LEDs and
+// shortens the display timeout more, and past the knee the log goes quiet.
+// On the last one, the time comes after a low battery sign
+static const struct power_level s_power_levels[] = {
+    {2800, UINT16_MAX, PWM_STEPS, true, false},  // Flat part of the curve
+    {2650, 2000, 12, true, false},
+    {2500, 1500, 8, false, false},  // Past the knee
+    {0, 1000, 6, false, true},
+};
+static unsigned s_power;  // Level, see s_power_levels
+
+static uint8_t brightness(void) {  // As set, as far as the battery allows
+  uint8_t max = s_power_levels[s_power].brightness;
+  return s_brightness < max ? s_brightness : max;
+}
+
+// Number of PWM slots row i is lit for. Rounded up: dim rows stay visible
+static unsigned row_duty(int i) {
+  return (brightness() * s_color_gain[i] + 99U) / 100U;
+}
+
+static inline unsigned led_ua(int row) {  // Current of a single lit LED in a row
+  return (VDD_MV - s_led_vf_mv[row]) * 1000U / LED_R_OHM;
+}
+
+// Set LEDs to a given state. There are 16 LEDs in 4 columns.
+// Each column is: red = 1, orange = 2, green = 4, blue = 8
+// The whole frame is written with one BSRR store per GPIO bank
+static void set_leds(uint16_t mask) {
+  PROF_BEGIN(set_leds);
+  uint32_t bsrr[LED_BANKS];
+  uint8_t level = brightness();
+  if (mask != s_led_mask) trace_event(TRACE_LEDS, mask);
+  s_led_mask = mask;
+  if (mask == 0 || level == 0 || level >= PWM_STEPS) {
+    pwm_stop();
+    led_frame(level == 0 ? 0 : mask, bsrr);
+    for (int i = 0; i < LED_BANKS; i++) gpio_write_bank((uint8_t) i, bsrr[i]);
+  } else {
+    for (unsigned k = 0; k < PWM_STEPS; k++) {
+      uint16_t lit = 0;
+      for (int i = 0; i < 4; i++) lit |= row_duty(i) > k ? LED_ROW(i) : 0;
+      led_frame(mask & lit, bsrr);
+      for (int i = 0; i < LED_BANKS; i++) s_pwm[i][k] = bsrr[i];
     }
+    pwm_start(s_pwm[0], s_pwm[1], PWM_STEPS, PWM_HZ * PWM_STEPS);
   }
-  return mask;
+  PROF_END(set_leds);
+  // LOG("%s -> %#04hx\n", __func__, mask);
 }
 
-static inline unsigned hours(uint64_t milliseconds) {
-  return ((milliseconds / 1000) % SECONDS_IN_DAY) / 3600;
+// Set brightness, 0 .. PWM_STEPS, and redraw LEDs
+static void set_brightness(uint8_t level) {
+  s_brightness = level > PWM_STEPS ? PWM_STEPS : level;
+  set_leds(s_led_mask);
 }
 
-static inline unsigned minutes(uint64_t milliseconds) {
-  return ((milliseconds / 1000) % 3600) / 60;
+// Operating points. The CPU mostly waits in STOP2, and what little it does
+// when awake fits in 2 MHz at the low power voltage range. UART at 115200
+// baud needs a faster clock, so that one is used only while log output is
+// pending. LPTIM runs from LSE, so the timebase does not care
+enum { OP_LOW, OP_LOG };
+static const struct clock_op s_ops[] = {
+    [OP_LOW] = {CLOCK_MSI, 5, 0, 2, 0},       // MSI 2 MHz, range 2
+    [OP_LOG] = {CLOCK_MSI, 7, 0, 2, 115200},  // MSI 8 MHz, range 2
+};
+static int s_op = -1;  // Current operating point, none at boot
+
+// Switch to an operating point. Call when UART is idle. LED PWM timer
+// is clocked from the CPU clock, so its period is recomputed
+static void set_op(int op) {
+  if (op == s_op) return;
+  struct clock_plan plan = clock_plan(&s_ops[op]);
+  s_op = op;
+  clock_set(s_ops[op].src, s_ops[op].msi_range, s_ops[op].pll_n,
+            s_ops[op].vos, plan.flash_ws, plan.hz);
+  if (plan.brr > 0) uart_set_brr(UART_DEBUG, plan.brr);
+  if (pwm_active()) set_leds(s_led_mask);
 }
 
-// Button press handler
-// When button is pressed, we set the time in the future until which the
-// press should be considered "active". The LED task will pick it and
-// turn on LEDs
-static volatile uint64_t s_next_press_timeout;
-static volatile int s_press_count;
+// Button handler
+// The IRQ handler masks the line on the first edge, so contact bounces do
+// not wake us up, and pushes a timestamped event to the queue. The LED task
+// starts a DEBOUNCE_MS timer, which reads the settled level, unmasks the
+// line, and passes a state change to the gesture recognizer
+static struct evq s_evq;
+static int s_press_count;  // Presses in setting mode
 
 void EXTI2_IRQHandler(void) {
+  PROF_BEGIN(exti2_irq);
+  mem_irq_enter(&s_mem, stack_sp());
   uint8_t n = (uint8_t) (PINNO(BTN_PIN));
-  EXTI->PR1 = BIT(n);  // Clear interrupt
-  s_next_press_timeout = g_ticks + NEXT_PRESS_MS;
+  struct event ev = {.time = (uint32_t) now_ms(), .type = EV_BTN_EDGE};
+  EXTI->PR1 = BIT(n);           // Clear interrupt
+  exti_enable(BTN_PIN, false);  // Ignore bounces until the level settles
+  evq_push(&s_evq, &ev);
+  trace_event(TRACE_EDGE, gpio_read(BTN_PIN));
+  mem_irq_exit(&s_mem);
+  PROF_END(exti2_irq);
+}
+
+// Software timers. Tasks register deadlines, loop() runs expired ones
+static struct sched s_sched;
+static uint64_t s_active;  // Last button event, or display off
+
+static void display_timeout(void);
+
+// LED animations. Each ends with holding the last frame for the display
+// timeout, TIMEOUT_MS unless set otherwise
+static struct anim s_anim = {.sched = &s_sched, .show = set_leds,
+                             .done = display_timeout};
+static struct frame s_blink1[] = {
+    {0xffff, 200}, {0, 200}, {0, TIMEOUT_MS}};
+static struct frame s_blink2[] = {
+    {0xffff, 200}, {0, 200}, {0xffff, 200}, {0, 200}, {0, TIMEOUT_MS}};
+static struct frame s_blink_timer[] = {  // Minute columns
+    {0xcccc, 200}, {0, 200}, {0, TIMEOUT_MS}};
+static struct frame s_blink_alarm1[] = {  // Hour columns
+    {0x3333, 200}, {0, 200}, {0, TIMEOUT_MS}};
+static struct frame s_blink_alarm2[] = {
+    {0xcccc, 200}, {0, 200}, {0xcccc, 200}, {0, 200}, {0, TIMEOUT_MS}};
+static struct frame s_show[] = {{0, TIMEOUT_MS}};  // Mask is set at runtime
+static struct frame s_show_low[] = {  // Red lights at the lowest voltage
+    {0x000f, 150}, {0, 150}, {0x000f, 150}, {0, 150}, {0, TIMEOUT_MS}};
+
+// Ringing: a double flash every second, for 16 seconds
+#define RING_BEEP {0xffff, 100}, {0, 100}, {0xffff, 100}, {0, 700}
+#define RING_BEEP4 RING_BEEP, RING_BEEP, RING_BEEP, RING_BEEP
+static const struct frame s_ring[] = {RING_BEEP4, RING_BEEP4, RING_BEEP4,
+                                      RING_BEEP4};
+
+static void show(uint16_t mask) {  // Show mask, restart display timeout
+  s_show[0].mask = mask;
+  anim_play(&s_anim, s_show, ARRAY_SIZE(s_show), now_ms());
+}
+
+static void show_clock(uint16_t mask) {  // Time, after the low battery sign
+  if (!s_power_levels[s_power].low) {
+    show(mask);
+  } else {
+    s_show_low[ARRAY_SIZE(s_show_low) - 1].mask = mask;
+    anim_play(&s_anim, s_show_low, ARRAY_SIZE(s_show_low), now_ms());
+  }
+}
+
+// State entry and exit actions, and transition actions. Event argument is
+// the gesture time, see handle_gesture()
+static void sleep_entry(void *arg) {
+  (void) arg;
+  s_active = now_ms();
+}
+
+static void leds_off(void *arg) {
+  (void) arg;
+  set_leds(0);
+}
+
+static void show_time(void *arg) {
+  (void) arg;
+  wclock_update(&s_wclock, now_ms());
+  if (!anim_running(&s_anim)) {  // Unless shown since the wake-up already
+    show_clock(wclock_led_mask(s_wclock.hours, s_wclock.minutes));
+  }
+}
+
+static void setting_entry(void *arg) {
+  (void) arg;
+  s_press_count = 0;
+}
+
+static void setting_exit(void *arg) {
+  (void) arg;
+  time_save();
+}
+
+static void blink_hours(void *arg) {
+  (void) arg;
+  anim_play(&s_anim, s_blink1, ARRAY_SIZE(s_blink1), now_ms());
+}
+
+static void blink_minutes(void *arg) {
+  (void) arg;
+  anim_play(&s_anim, s_blink2, ARRAY_SIZE(s_blink2), now_ms());
+}
+
+static void blink_timer(void *arg) {
+  (void) arg;
+  anim_play(&s_anim, s_blink_timer, ARRAY_SIZE(s_blink_timer), now_ms());
+}
+
+static void blink_alarm_hours(void *arg) {
+  (void) arg;
+  anim_play(&s_anim, s_blink_alarm1, ARRAY_SIZE(s_blink_alarm1), now_ms());
+}
+
+static void blink_alarm_minutes(void *arg) {
+  (void) arg;
+  anim_play(&s_anim, s_blink_alarm2, ARRAY_SIZE(s_blink_alarm2), now_ms());
+}
+
+static void ring(void *arg) {
+  (void) arg;
+  anim_play(&s_anim, s_ring, ARRAY_SIZE(s_ring), now_ms());
+}
+
+static void ring_stop(void *arg) {
+  (void) arg;
+  anim_stop(&s_anim);
+  set_leds(0);
+}
+
+static uint64_t handle_press(void *arg) {  // Press, or repeat while held
+  uint64_t time = *(uint64_t *) arg;
   s_press_count++;
-  printf("%s -> %d %lu\n", __func__, s_press_count, (unsigned long) g_ticks);
-}
-
-static void blink_all(int num_times) {
-  for (int i = 0; i < num_times; i++) {
-    set_leds(0xffff);
-    delay_ms(200);
-    set_leds(0);
-    delay_ms(200);
-  }
-}
-
-static void led_task(void) {
-  static int saved_press_count;
-
-  if (s_state == STATE_SLEEP) {
-    if (s_press_count > 0 && g_ticks > s_next_press_timeout) {
-      if (s_press_count == 1) {
-        uint64_t now = g_ticks + s_time_in_millis_at_boot;
-        set_state(STATE_SHOW_TIME);
-        s_timeout = g_ticks + TIMEOUT_MS;
-        set_leds(time_to_led_mask(hours(now), minutes(now)));
-      } else if (s_press_count == 4) {
-        blink_all(2);
-        set_state(STATE_SET_MINUTES);
-        s_timeout = g_ticks + TIMEOUT_MS;
-      } else if (s_press_count == 3) {
-        blink_all(1);
-        set_state(STATE_SET_HOURS);
-        s_timeout = g_ticks + TIMEOUT_MS;
-      }
-      s_press_count = 0;
+  LOG("%s -> %d %lu\n", __func__, s_press_count, (unsigned long) time);
+  return time;
+}
+
+static uint64_t time_press(void *arg) {  // Setting the time by hand
+  uint64_t time = handle_press(arg);
+  wclock_update(&s_wclock, time);
+  drift_restart(&s_drift);  // Time set by hand is no reference
+  return time;
+}
+
+// The first press sets 1, every next one increments, wrapping around.
+// Show the current value, and shift the timeout
+static void set_hours(void *arg) {
+  uint8_t hours;
+  time_press(arg);
+  hours = s_press_count == 1 ? 0 : s_wclock.hours;
+  s_wclock.hours = bcd_inc(hours, 0x24);
+  show(wclock_led_mask(s_wclock.hours, 0));
+  LOG("Setting hours: %02x, tick %lu\n", s_wclock.hours,
+      (unsigned long) now_ms());
+}
+
+static void set_minutes(void *arg) {
+  uint64_t time = time_press(arg);
+  uint8_t minutes = s_press_count == 1 ? 0 : s_wclock.minutes;
+  wclock_set(&s_wclock, s_wclock.hours, bcd_inc(minutes, 0x60), time);
+  show(wclock_led_mask(0, s_wclock.minutes));
+  LOG("Setting minutes: %02x, tick: %lu\n", s_wclock.minutes,
+      (unsigned long) now_ms());
+}
+
+// Countdown minutes. 0 turns it off
+static void set_countdown(void *arg) {
+  handle_press(arg);
+  s_countdown = bcd_inc(s_press_count == 1 ? 0 : s_countdown, 0x60);
+  show(wclock_led_mask(0, s_countdown));
+}
+
+static void countdown_start(void *arg) {  // Unless left untouched
+  (void) arg;
+  if (s_press_count == 0) return;
+  if (s_countdown == 0) {
+    rtc_wakeup_off();
+  } else {
+    rtc_wakeup_set(bcd_to_bin(s_countdown) * 60U);
+  }
+  LOG("Countdown: %02x min, tick %lu\n", s_countdown,
+      (unsigned long) now_ms());
+}
+
+// Alarm hours go on to ALARM_OFF, shown as 24, after 23
+static void set_alarm_hours(void *arg) {
+  handle_press(arg);
+  s_alarm_hours = bcd_inc(s_press_count == 1 ? 0 : s_alarm_hours,
+                          ALARM_OFF + 1);
+  show(wclock_led_mask(s_alarm_hours, 0));
+}
+
+static void set_alarm_minutes(void *arg) {
+  handle_press(arg);
+  s_alarm_minutes = bcd_inc(s_press_count == 1 ? 0 : s_alarm_minutes, 0x60);
+  show(wclock_led_mask(0, s_alarm_minutes));
+}
+
+static void alarm_save(void *arg) {  // Then setting_exit() arms it
+  (void) arg;
+  if (s_press_count == 0) return;
+  kv_set(&s_kv, KV_ALARM, (uint32_t) s_alarm_hours << 8 | s_alarm_minutes);
+  LOG("Alarm: %02x:%02x\n", s_alarm_hours, s_alarm_minutes);
+}
+
+static void rx_open(void *arg);
+
+// State machine, see fsm.h. Sleeping: clicks pick a mode, long press turns
+// on the UART receiver. Setting: every press, and every repeat while the
+// button is held, increments. Display timeout goes back to sleep, and
+// saves the time if it was set. A wake-up from Standby shows the time while
+// sleeping, so sleep takes the timeout too. The alarm and the countdown
+// ring over anything, until a press, or the ring is over
+enum {
+  ON_CLICK,         // Single click
+  ON_DOUBLE_CLICK,  // Two clicks
+  ON_TRIPLE_CLICK,  // Three clicks
+  ON_QUAD_CLICK,    // Four clicks
+  ON_FIVE_CLICKS,   // Five clicks
+  ON_SIX_CLICKS,    // Six clicks
+  ON_LONG_PRESS,    // Long press
+  ON_PRESS,         // Press, or repeat while held
+  ON_TIMEOUT,       // Display animation is over
+  ON_ALARM,         // RTC alarm or countdown fired
+  NUM_EVENTS
+};
+
+static const struct fsm_state s_states[NUM_STATES] = {
+    [STATE_SLEEP] = {FSM_NONE, sleep_entry, NULL},
+    [STATE_DISPLAY] = {FSM_NONE, NULL, NULL},
+    [STATE_SHOW_TIME] = {STATE_DISPLAY, show_time, NULL},
+    [STATE_SETTING] = {STATE_DISPLAY, setting_entry, setting_exit},
+    [STATE_SET_HOURS] = {STATE_SETTING, blink_hours, NULL},
+    [STATE_SET_MINUTES] = {STATE_SETTING, blink_minutes, NULL},
+    [STATE_SET_TIMER] = {STATE_SETTING, blink_timer, countdown_start},
+    [STATE_SET_ALARM_HOURS] = {STATE_SETTING, blink_alarm_hours, alarm_save},
+    [STATE_SET_ALARM_MINUTES] = {STATE_SETTING, blink_alarm_minutes,
+                                 alarm_save},
+    [STATE_RINGING] = {STATE_DISPLAY, ring, NULL},
+};
+
+static const struct fsm_tr s_transitions[NUM_STATES][NUM_EVENTS] = {
+    [STATE_SLEEP][ON_CLICK] = FSM_GO(STATE_SHOW_TIME, NULL),
+    [STATE_SLEEP][ON_DOUBLE_CLICK] = FSM_GO(STATE_SET_TIMER, NULL),
+    [STATE_SLEEP][ON_TRIPLE_CLICK] = FSM_GO(STATE_SET_HOURS, NULL),
+    [STATE_SLEEP][ON_QUAD_CLICK] = FSM_GO(STATE_SET_MINUTES, NULL),
+    [STATE_SLEEP][ON_FIVE_CLICKS] = FSM_GO(STATE_SET_ALARM_HOURS, NULL),
+    [STATE_SLEEP][ON_SIX_CLICKS] = FSM_GO(STATE_SET_ALARM_MINUTES, NULL),
+    [STATE_SLEEP][ON_LONG_PRESS] = FSM_DO(rx_open),
+    [STATE_SLEEP][ON_TIMEOUT] = FSM_GO(STATE_SLEEP, leds_off),
+    [STATE_SLEEP][ON_ALARM] = FSM_GO(STATE_RINGING, NULL),
+    [STATE_DISPLAY][ON_TIMEOUT] = FSM_GO(STATE_SLEEP, leds_off),
+    [STATE_DISPLAY][ON_ALARM] = FSM_GO(STATE_RINGING, NULL),
+    [STATE_SET_HOURS][ON_PRESS] = FSM_DO(set_hours),
+    [STATE_SET_MINUTES][ON_PRESS] = FSM_DO(set_minutes),
+    [STATE_SET_TIMER][ON_PRESS] = FSM_DO(set_countdown),
+    [STATE_SET_ALARM_HOURS][ON_PRESS] = FSM_DO(set_alarm_hours),
+    [STATE_SET_ALARM_MINUTES][ON_PRESS] = FSM_DO(set_alarm_minutes),
+    [STATE_RINGING][ON_PRESS] = FSM_GO(STATE_SLEEP, ring_stop),
+};
+
+static struct fsm s_fsm = {s_states, &s_transitions[0][0], NUM_EVENTS,
+                           STATE_SLEEP, set_state};
+
+static void power_check(void);
+
+static void display_timeout(void) {
+  power_check();
+  fsm_dispatch(&s_fsm, ON_TIMEOUT, NULL);
+}
+
+static void handle_gesture(uint8_t type, unsigned count, uint64_t time) {
+  static const uint8_t clicks[] = {NUM_EVENTS,      ON_CLICK,
+                                   ON_DOUBLE_CLICK, ON_TRIPLE_CLICK,
+                                   ON_QUAD_CLICK,   ON_FIVE_CLICKS,
+                                   ON_SIX_CLICKS};
+  uint8_t event = NUM_EVENTS;  // None
+  if (type == GESTURE_CLICKS && count < ARRAY_SIZE(clicks)) {
+    event = clicks[count];
+  }
+  if (type == GESTURE_LONG) event = ON_LONG_PRESS;
+  if (type == GESTURE_PRESS || type == GESTURE_HOLD) event = ON_PRESS;
+  if (event < NUM_EVENTS) fsm_dispatch(&s_fsm, event, &time);
+}
+
+// RTC alarm and wakeup timer interrupts. They take the flags, the main
+// loop rings
+static void rtc_irq(void) {
+  mem_irq_enter(&s_mem, stack_sp());
+  s_rtc_fired |= rtc_fired();
+  mem_irq_exit(&s_mem);
+}
+
+void RTC_Alarm_IRQHandler(void) {
+  rtc_irq();
+}
+
+void RTC_WKUP_IRQHandler(void) {
+  rtc_irq();
+}
+
+static void rtc_task(void) {
+  unsigned fired;
+  irq_disable();
+  fired = s_rtc_fired, s_rtc_fired = 0;
+  irq_enable();
+  if (fired & RTC_WAKEUP) {  // Countdown is over. The timer would reload
+    rtc_wakeup_off();
+    s_countdown = 0;
+  }
+  if (fired != 0) {
+    LOG("Ring: %s, tick %lu\n", fired & RTC_ALARM ? "alarm" : "countdown",
+        (unsigned long) now_ms());
+    fsm_dispatch(&s_fsm, ON_ALARM, NULL);
+  }
+}
+
+static struct gesture_cfg s_gesture_cfg = {
+    .click_gap_ms = NEXT_PRESS_MS,
+    .long_ms = LONG_PRESS_MS,
+    .hold_ms = HOLD_REPEAT_MS,
+};
+static struct gesture s_gesture = {
+    .cfg = &s_gesture_cfg, .sched = &s_sched, .fn = handle_gesture};
+
+// Settings, by tsync.h setting number: flash key, default, and limits
+static const struct setting {
+  uint8_t key;
+  uint16_t def, min, max;
+} s_settings[] = {
+    [TSYNC_TIMEOUT_MS] = {KV_TIMEOUT, TIMEOUT_MS, 500, 60000},
+    [TSYNC_CLICK_GAP_MS] = {KV_CLICK_GAP, NEXT_PRESS_MS, 100, 2000},
+};
+
+static uint16_t setting(unsigned id) {  // Value in flash, or the default
+  const struct setting *s = &s_settings[id];
+  uint32_t v;
+  return kv_get(&s_kv, s->key, &v) && v >= s->min && v <= s->max
+             ? (uint16_t) v
+             : s->def;
+}
+
+static void settings_apply(void) {  // Within what the battery allows
+  uint16_t timeout = setting(TSYNC_TIMEOUT_MS);
+  if (timeout > s_power_levels[s_power].timeout_ms) {
+    timeout = s_power_levels[s_power].timeout_ms;
+  }
+  s_blink1[ARRAY_SIZE(s_blink1) - 1].duration = timeout;
+  s_blink2[ARRAY_SIZE(s_blink2) - 1].duration = timeout;
+  s_blink_timer[ARRAY_SIZE(s_blink_timer) - 1].duration = timeout;
+  s_blink_alarm1[ARRAY_SIZE(s_blink_alarm1) - 1].duration = timeout;
+  s_blink_alarm2[ARRAY_SIZE(s_blink_alarm2) - 1].duration = timeout;
+  s_show[0].duration = timeout;
+  s_show_low[ARRAY_SIZE(s_show_low) - 1].duration = timeout;
+  s_gesture_cfg.click_gap_ms = setting(TSYNC_CLICK_GAP_MS);
+}
+
+static bool s_btn_pressed;   // Debounced button state
+static uint64_t s_btn_edge;  // When the first edge of a change came
+
+static void debounce_done(void *arg);
+static struct timer s_debounce_timer = {.fn = debounce_done};
+
+static void debounce_done(void *arg) {  // Button level has settled
+  bool pressed = gpio_read(BTN_PIN) == 0;
+  (void) arg;
+  trace_event(TRACE_BUTTON, pressed);
+  exti_enable(BTN_PIN, true);
+  if ((gpio_read(BTN_PIN) == 0) != pressed) {  // Edge came while masked
+    exti_enable(BTN_PIN, false);
+    sched_add(&s_sched, &s_debounce_timer, now_ms() + DEBOUNCE_MS, 0);
+  }
+  if (pressed != s_btn_pressed) {
+    s_btn_pressed = pressed;
+    gesture_input(&s_gesture, pressed, s_btn_edge);
+  }
+}
+
+static void led_task(void) {  // Handle button events queued by the IRQ
+  PROF_BEGIN(led_task);
+  static unsigned dropped;
+  struct event ev;
+  while (evq_pop(&s_evq, &ev)) {
+    uint64_t now = now_ms();  // After the pop: not older than the event
+    if (ev.type != EV_BTN_EDGE) continue;
+    s_btn_edge = now - elapsed(ev.time, (uint32_t) now);  // Back to 64 bits
+    s_active = now;
+    sched_add(&s_sched, &s_debounce_timer, s_btn_edge + DEBOUNCE_MS, 0);
+  }
+  if (dropped != s_evq.dropped) {
+    dropped = s_evq.dropped;
+    LOG("Button events dropped: %u\n", dropped);
+  }
+  PROF_END(led_task);
+}
+
+// Log transport. LOG() output is queued, and the UART interrupt handler
+// sends it in the background
+static uint8_t s_log_buf[LOG_BUF_SIZE];
+static struct ring s_log = {.buf = s_log_buf, .size = sizeof(s_log_buf)};
+static unsigned s_log_dropped;  // Bytes dropped because buffer was full
+
+// UART receiver. The interrupt handler queues received bytes, and notes
+// when the last one came: that is the receive time of a time sync request
+static uint8_t s_rx_buf[RX_BUF_SIZE];
+static struct ring s_rx = {.buf = s_rx_buf, .size = sizeof(s_rx_buf)};
+static volatile uint32_t s_rx_time;  // When the last byte came, ms
+static unsigned s_rx_dropped;        // Bytes dropped because buffer was full
+
+void USART1_IRQHandler(void) {  // Take received bytes, feed the transmitter
+  PROF_BEGIN(uart_irq);
+  uint8_t byte;
+  mem_irq_enter(&s_mem, stack_sp());
+  while (uart_read_ready(UART_DEBUG)) {
+    byte = uart_read_byte(UART_DEBUG);
+    s_rx_time = (uint32_t) now_ms();
+    s_rx_dropped += 1U - (unsigned) ring_write(&s_rx, &byte, 1);
+  }
+  while (uart_tx_ready(UART_DEBUG) && ring_get(&s_log, &byte)) {
+    uart_tx_byte(UART_DEBUG, byte);
+  }
+  // When buffer is drained, wait for the last byte to leave the wire
+  if (ring_empty(&s_log)) {
+    uart_tx_irq(UART_DEBUG, false, !uart_tx_done(UART_DEBUG));
+  }
+  mem_irq_exit(&s_mem);
+  PROF_END(uart_irq);
+}
+
+static bool log_busy(void) {
+  return !ring_empty(&s_log) || !uart_tx_done(UART_DEBUG);
+}
+
+// Queue log output for the UART. Also the newlib hook, if anything calls it
+int _write(int fd, char *ptr, int len) {
+  if (fd == 1) {
+    set_op(OP_LOG);  // Before anything goes out on the wire
+    size_t n = ring_write(&s_log, ptr, (size_t) len);
+    while (LOG_BLOCK && n < (size_t) len) {  // Drain synchronously, then retry
+      irq_disable();
+      USART1_IRQHandler();
+      irq_enable();
+      n += ring_write(&s_log, ptr + n, (size_t) len - n);
     }
-  } else if (s_state == STATE_SHOW_TIME) {
-  } else if (s_state == STATE_SET_MINUTES) {
-    // On click, increment and show the current minute and shift the timeout
-    if (saved_press_count != s_press_count) {
-      s_time_in_millis_at_boot =
-          (s_time_in_millis_at_boot / 3600000) * 3600000 +
-          s_press_count * 60000;
-      set_leds(time_to_led_mask(0, s_press_count));
-      s_timeout = g_ticks + TIMEOUT_MS;
-      saved_press_count = s_press_count;
-      printf("Setting minutes: %d. Offset: %ld, tick: %lu\n", s_press_count,
-             (long) s_time_in_millis_at_boot, (unsigned long) g_ticks);
+    s_log_dropped += (unsigned) ((size_t) len - n);
+    irq_disable();  // CR1 is also modified by the IRQ handler
+    uart_tx_irq(UART_DEBUG, true, false);
+    irq_enable();
+  }
+  return len;
+}
+
+// Tokenized log records must not be cut short: drop them as a whole
+void logt_send(uint32_t id, const struct logt_arg *args, size_t nargs) {
+  uint8_t buf[LOGT_MAX_RECORD];
+  size_t len;
+  if (!s_power_levels[s_power].log) return;  // Battery is low
+  len = logt_encode(buf, id, now_ms(), args, nargs);
+  if (LOG_BLOCK || LOG_BUF_SIZE - ring_len(&s_log) >= len) {
+    _write(1, (char *) buf, (int) len);
+  } else {
+    s_log_dropped += (unsigned) len;
+  }
+}
+
+static void log_out(const char *buf, size_t len, void *arg) {
+  (void) arg;
+  _write(1, (char *) buf, (int) len);
+}
+
+int log_printf(const char *fmt, ...) {  // Formatter output goes to _write()
+  va_list ap;
+  size_t n;
+  if (!s_power_levels[s_power].log) return 0;  // Battery is low
+  va_start(ap, fmt);
+  n = fmt_vformat(log_out, NULL, fmt, ap);
+  va_end(ap);
+  return (int) n;
+}
+
+// Runs every LOG_PERIOD_MS. Memory is checked every time, but reported
+// only when the stack grows, so the UART stays off
+static void log_task(void *arg) {
+  PROF_BEGIN(log_task);
+  (void) arg;
+  mem_scan(&s_mem);
+  mem_tick(&s_mem);
+  if (s_mem.low != s_mem_logged) {
+    s_mem_logged = s_mem.low;
+    LOG("Stack: %lu used, %lu free, lost %lu, IRQ depth %u\n",
+        (unsigned long) mem_stack_used(&s_mem),
+        (unsigned long) mem_stack_free(&s_mem),
+        (unsigned long) mem_trend(&s_mem), s_mem.irq_depth_max);
+  }
+  PROF_END(log_task);
+}
+static struct timer s_log_timer = {.fn = log_task};
+
+// Profiler output. Send 'p' to the debug UART to print all probes. One
+// probe is printed per wake-up, when the previous one is sent, so the log
+// buffer does not overflow
+#if PROF
+static size_t s_prof_next = PROF_NUM_PROBES;  // Next probe to print
+#endif
+
+static void prof_task(bool start) {
+#if PROF
+  if (start) s_prof_next = 0;
+  if (s_prof_next < PROF_NUM_PROBES && !log_busy()) prof_print(s_prof_next++);
+#else
+  (void) start;
+#endif
+}
+
+// Commands and time sync on the debug UART, see tsync.h. The receiver is
+// off in STOP2, and off baud at the low power operating point: bytes that
+// come then are lost, and the host retries. A long press, or any byte
+// received, keeps the receiver on for RX_WINDOW_MS. Replies wait until log
+// output is sent, so that the transmit time is the time the reply goes out
+static bool s_rx_on;                 // Receiver is kept on
+static struct tsync_parser s_tsync;  // Frames from received bytes
+static struct tsync_msg s_reply;     // Reply to send, if type is set
+
+static void rx_close(void *arg) {
+  (void) arg;
+  s_rx_on = false;
+}
+static struct timer s_rx_timer = {.fn = rx_close};
+
+static void rx_open(void *arg) {
+  (void) arg;
+  s_rx_on = true;
+  set_op(OP_LOG);
+  sched_add(&s_sched, &s_rx_timer, now_ms() + RX_WINDOW_MS, 0);
+}
+
+static void tsync_send(const struct tsync_msg *m) {
+  uint8_t buf[TSYNC_FRAME_SIZE];
+  tsync_encode(m, buf);
+  _write(1, (char *) buf, sizeof(buf));
+}
+
+// Event trace dump. The time of day and the settings go first, for a
+// replay, then the records, oldest first. As many frames as fit in the log
+// buffer go out per wake-up, once log output is sent. Records added after
+// the request are left for the next dump
+#define TRACE_BATCH (LOG_BUF_SIZE / TSYNC_FRAME_SIZE)  // Frames per wake-up
+static int s_trace_seq = -1;  // Request being answered, -1 if none
+static unsigned s_trace_next, s_trace_end, s_trace_count;  // Records to send
+
+static void trace_send(uint8_t type, uint32_t time, uint32_t value) {
+  struct tsync_msg m = {TSYNC_TRACE, (uint8_t) s_trace_seq, time, type, value};
+  tsync_send(&m);
+}
+
+static void trace_task(void) {
+  uint64_t now = now_ms();
+  unsigned n = 0;
+  if (s_trace_seq < 0 || log_busy()) return;
+  if (s_trace_end - s_trace_next == s_trace_count) {  // Nothing sent yet
+    wclock_update(&s_wclock, now);
+    trace_send(TRACE_DUMP, (uint32_t) now, wclock_tod_ms(&s_wclock));
+    trace_send(TRACE_TIMEOUT, (uint32_t) now, setting(TSYNC_TIMEOUT_MS));
+    trace_send(TRACE_CLICK_GAP, (uint32_t) now, setting(TSYNC_CLICK_GAP_MS));
+    n = 3;
+  }
+  for (; n + 1 < TRACE_BATCH && s_trace_next != s_trace_end; n++) {
+    const struct trace_rec *r = trace_get(&s_trace, s_trace_next++);
+    trace_send(r->type, r->time, r->value);
+  }
+  if (s_trace_next == s_trace_end) {
+    struct tsync_msg ack = {TSYNC_ACK, (uint8_t) s_trace_seq, s_trace_count,
+                            0, 0};
+    tsync_send(&ack);
+    s_trace_seq = -1;
+  }
+}
+
+static void tsync_handle(const struct tsync_msg *m) {
+  uint64_t now = now_ms();
+  if (m->type == TSYNC_REQ) {
+    s_reply = (struct tsync_msg) {TSYNC_REPLY, m->seq, m->a, s_rx_time, 0};
+  } else if (m->type == TSYNC_SET && m->b < WCLOCK_DAY_MS) {
+    // Time of day is for watch time a, move it to now
+    int32_t since = (int32_t) ((uint32_t) now - m->a), error;
+    uint32_t tod = (uint32_t) ((m->b + WCLOCK_DAY_MS + since) % WCLOCK_DAY_MS);
+    wclock_update(&s_wclock, now);
+    error = (int32_t) (tod - wclock_tod_ms(&s_wclock));  // Nearest way round
+    if (error > (int32_t) WCLOCK_DAY_MS / 2) error -= (int32_t) WCLOCK_DAY_MS;
+    if (error < -(int32_t) WCLOCK_DAY_MS / 2) error += (int32_t) WCLOCK_DAY_MS;
+    if (drift_sync(&s_drift, error, now)) {
+      drift_set(s_drift.ppb);
+      LOG("Drift: %ld ppb, error %ld ms\n", (long) s_drift.ppb, (long) error);
     }
-  } else if (s_state == STATE_SET_HOURS) {
-    // On click, increment and show the current hour and shift the timeout
-    if (saved_press_count != s_press_count) {
-      s_time_in_millis_at_boot =
-          s_press_count * 3600000 + (s_time_in_millis_at_boot % (3600000));
-      set_leds(time_to_led_mask(s_press_count, 0));
-      s_timeout = g_ticks + TIMEOUT_MS;
-      saved_press_count = s_press_count;
-      printf("Setting hours: %d. Offset: %ld, tick %lu\n", s_press_count,
-             (long) s_time_in_millis_at_boot, (unsigned long) g_ticks);
+    wclock_set_ms(&s_wclock, tod, now);
+    trace_event(TRACE_CLOCK, tod);
+    time_save();
+    s_reply = (struct tsync_msg) {TSYNC_ACK, m->seq, (uint32_t) now, tod, 0};
+    LOG("Time set: %02x:%02x, ms %lu, tick %lu\n", s_wclock.hours,
+        s_wclock.minutes, (unsigned long) s_wclock.ms, (unsigned long) now);
+  } else if (m->type == TSYNC_CONF && m->a < ARRAY_SIZE(s_settings)) {
+    const struct setting *s = &s_settings[m->a];
+    if (m->b >= s->min && m->b <= s->max && kv_set(&s_kv, s->key, m->b)) {
+      settings_apply();
     }
+    s_reply = (struct tsync_msg) {TSYNC_ACK, m->seq, m->a, setting(m->a), 0};
+    LOG("Setting %lu: %u\n", (unsigned long) m->a, setting(m->a));
+  } else if (m->type == TSYNC_TRACE) {
+    s_trace_seq = m->seq;
+    s_trace_next = trace_first(&s_trace), s_trace_end = trace_end(&s_trace);
+    s_trace_count = s_trace_end - s_trace_next;
   }
+}
 
-  // On timeout in any state, go back to sleep
-  if (s_state != STATE_SLEEP && g_ticks > s_timeout) {
-    set_leds(0);
-    set_state(STATE_SLEEP);
-    s_press_count = 0;
-    saved_press_count = 0;
+static void rx_task(void) {
+  static unsigned dropped;
+  struct tsync_msg m;
+  uint8_t byte;
+  bool prof = false;
+  while (ring_get(&s_rx, &byte)) {
+    int type = tsync_feed(&s_tsync, byte, &m);
+    if (type > 0) tsync_handle(&m);
+    if (type < 0 && byte == 'p') prof = true;
+    rx_open(NULL);
+  }
+  if (s_reply.type != 0 && !log_busy()) {
+    if (s_reply.type == TSYNC_REPLY) s_reply.c = (uint32_t) now_ms();
+    tsync_send(&s_reply);
+    s_reply.type = 0;
+  }
+  trace_task();
+  if (dropped != s_rx_dropped) {
+    dropped = s_rx_dropped;
+    LOG("UART bytes dropped: %u\n", dropped);
   }
+  prof_task(prof);
 }
 
-// retargeting printf() to UART
-int _write(int fd, char *ptr, int len) {
-  if (fd == 1) uart_write_buf(UART_DEBUG, ptr, (size_t) len);
-  return len;
+// Standby. When the watch has been idle for STANDBY_IDLE_MS, it goes from
+// STOP2 to Standby, where only the RTC runs, and periodic tasks do not.
+// A button press wakes it up with a reset. RAM is lost, so the time of day
+// and the drift interval are left in backup registers, with the RTC time
+// they were taken at. On wake-up, setup() shows the time first thing, from
+// those and the RTC time now. Clocks, UART and flash come after, RAM is
+// not painted unless DEBUG=1, and the press is taken as the first click of
+// a gesture. Cycles from reset to LEDs on are logged, and with PROF=1 go to
+// the wake probe. The hardware wake-up time comes on top: the CPU cannot
+// count that
+#define BKP_STANDBY_MAGIC 0x5b7e0a11U
+enum {
+  BKP_TOD = BKP_DRIFT_CHECK + 1,  // Time of day, ms
+  BKP_RTC_LO,                     // RTC time it was taken at, ms
+  BKP_RTC_HI,
+  BKP_SYNC_AGE,    // Drift interval, ms, or UINT32_MAX if none
+  BKP_SYNC_ERROR,  // Clock errors summed over it, ms
+  BKP_STANDBY_CHECK
+};
+static bool s_woken;            // This boot is a wake-up from Standby
+static uint32_t s_wake_cycles;  // Cycles from reset to LEDs on
+static uint64_t s_standby_ms;   // Time spent in Standby
+
+static bool standby_ready(uint64_t now) {
+  return s_state == STATE_SLEEP && !anim_running(&s_anim) &&
+         !s_btn_pressed && !timer_active(&s_debounce_timer) &&
+         !timer_active(&s_gesture.timer) && !s_rx_on && !log_busy() &&
+         s_trace_seq < 0 && evq_empty(&s_evq) && ring_empty(&s_rx) &&
+         s_rtc_fired == 0 && now - s_active >= STANDBY_IDLE_MS;
+}
+
+static void standby(void) {
+  uint64_t now, rtc, age;
+  uint32_t v[BKP_STANDBY_CHECK - BKP_TOD], check = BKP_STANDBY_MAGIC;
+  time_save();  // In case power is lost
+  now = now_ms(), rtc = rtc_ms(), age = now - s_drift.start;
+  wclock_update(&s_wclock, now);
+  v[0] = wclock_tod_ms(&s_wclock);
+  v[1] = (uint32_t) rtc, v[2] = (uint32_t) (rtc >> 32);
+  v[3] = s_drift.started && age < UINT32_MAX ? (uint32_t) age : UINT32_MAX;
+  v[4] = (uint32_t) s_drift.error;
+  for (unsigned i = 0; i < ARRAY_SIZE(v); i++) {
+    bkp_write(BKP_TOD + i, v[i]);
+    check ^= v[i];
+  }
+  bkp_write(BKP_STANDBY_CHECK, check);
+  cpu_standby();
 }
 
-static void log_task(void) {  // Print a log every LOG_PERIOD_MS
-  static uint64_t timer = 0;
-  if (timer_expired(&timer, LOG_PERIOD_MS, g_ticks)) {
-    // printf("tick: %5lu, heap used: %ld, stack used: %ld\n",
-    //        (unsigned long) g_ticks, ram_used(), stack_used());
+static bool power_bkp(void);
+
+// First thing on a wake-up: restore the clock, and show the time at the
+// battery level the last boot left
+static bool wake_show(void) {
+  uint32_t v[BKP_STANDBY_CHECK - BKP_TOD], check = BKP_STANDBY_MAGIC;
+  uint64_t now = now_ms(), rtc = rtc_ms(), then;
+  int32_t ppb;
+  for (unsigned i = 0; i < ARRAY_SIZE(v); i++) {
+    v[i] = bkp_read(BKP_TOD + i);
+    check ^= v[i];
+  }
+  then = (uint64_t) v[2] << 32 | v[1];
+  if (check != bkp_read(BKP_STANDBY_CHECK) || v[0] >= WCLOCK_DAY_MS ||
+      rtc < then) {
+    return false;  // Cold boot path sets the clock from flash
+  }
+  s_standby_ms = rtc - then;
+  if (drift_bkp(&ppb)) s_wclock.trim = drift_trim(ppb);
+  wclock_set_ms(&s_wclock, v[0], now - s_standby_ms);
+  wclock_update(&s_wclock, now);
+  trace_event(TRACE_CLOCK, wclock_tod_ms(&s_wclock));
+  power_bkp();
+  leds_init();
+  set_leds(wclock_led_mask(s_wclock.hours, s_wclock.minutes));
+  s_wake_cycles = prof_cycles();
+  if (v[3] != UINT32_MAX) {  // Drift interval goes on over Standby
+    s_drift.started = true, s_drift.error = (int32_t) v[4];
+    s_drift.start = now - s_standby_ms - v[3];
+  }
+  return true;
+}
+
+// Once set up: report, start the display timeout, and pass on the press
+static void wake_press(void) {
+  uint64_t now = now_ms();
+  LOG("Wake: LEDs on %lu us after reset, standby %lu s\n",
+      (unsigned long) ((uint64_t) s_wake_cycles * 1000000 / BOOT_HZ),
+      (unsigned long) (s_standby_ms / 1000));
+#if PROF
+  prof_record(&s_prof[PROF_wake], s_wake_cycles);
+#endif
+  show_clock(s_led_mask);
+  s_active = now;
+  gesture_input(&s_gesture, true, now);
+  if (!s_btn_pressed) gesture_input(&s_gesture, false, now);  // Short tap
+}
+
+static void trace_sleep(uint32_t mode) {  // 1 - STOP2, 2 - Standby
+  static uint32_t last;
+  if (mode != last) trace_event(TRACE_SLEEP, mode);
+  last = mode;
+}
+
+// Sleep in STOP2 until the next deadline, or until a button press. If the
+// deadline is too close to sleep, return and let loop() poll again.
+// UART and LED PWM do not run in STOP2, so while they are busy, sleep lightly
+static void sleep_task(void) {
+  if (!log_busy() && !s_rx_on) set_op(OP_LOW);
+  irq_disable();
+  if (standby_ready(now_ms())) {
+    trace_sleep(2);
+    standby();  // Returns only if an interrupt is pending
+  } else if (evq_empty(&s_evq) && ring_empty(&s_rx) && s_rtc_fired == 0 &&
+             timebase_set_alarm(sched_next(&s_sched))) {
+    bool deep = !log_busy() && !pwm_active() && !s_rx_on;
+    if (deep) trace_sleep(1);
+    cpu_sleep(deep);
+  }
+  irq_enable();
+}
+
+// Battery. VDD is sampled at the end of a display, under the LED load a
+// worn cell sags most at, and at most every POWER_PERIOD_MS: a sample
+// takes an ADC calibration. A cold boot samples right away. The level, and
+// the RTC second of the sample, are kept in backup registers over Standby
+#define POWER_PERIOD_MS (60 * 60 * 1000UL)
+#define BKP_POWER_MAGIC 0xba77e2a1U
+enum { BKP_POWER = BKP_STANDBY_CHECK + 1, BKP_POWER_AT, BKP_POWER_CHECK };
+static uint32_t s_power_at;  // RTC second of the last sample
+
+static void power_sample(void) {
+  uint16_t mv = power_vdd_mv(adc_vrefint(), VREFINT_CAL);
+  unsigned level = power_level(s_power_levels, ARRAY_SIZE(s_power_levels),
+                               s_power, mv);
+  s_power_at = (uint32_t) (rtc_ms() / 1000);
+  if (level != s_power) {  // Logged before the log may go quiet
+    LOG("Battery: %u mV, level %u\n", (unsigned) mv, level);
+    s_power = level;
+    settings_apply();
   }
+  bkp_write(BKP_POWER, s_power);
+  bkp_write(BKP_POWER_AT, s_power_at);
+  bkp_write(BKP_POWER_CHECK, s_power ^ s_power_at ^ BKP_POWER_MAGIC);
+}
+
+static void power_check(void) {  // At the end of a display
+  uint32_t now = (uint32_t) (rtc_ms() / 1000);
+  if (now - s_power_at >= POWER_PERIOD_MS / 1000) power_sample();
+}
+
+static bool power_bkp(void) {  // Take the level the last boot left
+  uint32_t level = bkp_read(BKP_POWER), at = bkp_read(BKP_POWER_AT);
+  if ((level ^ at ^ BKP_POWER_MAGIC) != bkp_read(BKP_POWER_CHECK) ||
+      level >= ARRAY_SIZE(s_power_levels)) {
+    return false;
+  }
+  s_power = level, s_power_at = at;
+  return true;
+}
+
+static void power_setup(void) {
+  if (power_bkp()) {
+    settings_apply();
+  } else {
+    power_sample();
+  }
+}
+
+static void kv_setup(void) {  // Restore what the last power cycle left
+  uint32_t tod, alarm;
+  s_kv = (struct kv) {.base = flash_kv_base(),
+                      .page_size = FLASH_PAGE_SIZE,
+                      .npages = flash_kv_pages(),
+                      .erase = flash_erase,
+                      .write = flash_write,
+                      .read = flash_read};
+  kv_init(&s_kv);
+  if (!s_woken && kv_get(&s_kv, KV_TIME, &tod) && tod < WCLOCK_DAY_MS) {
+    wclock_set_ms(&s_wclock, tod, now_ms());
+  }
+  settings_apply();
+  if (kv_get(&s_kv, KV_ALARM, &alarm) && (alarm >> 8) <= ALARM_OFF &&
+      (alarm & 0xff) < 0x60) {
+    s_alarm_hours = (uint8_t) (alarm >> 8), s_alarm_minutes = (uint8_t) alarm;
+  }
+  alarm_arm();
+  LOG("Flash: page %u, seq %lu, %u reads, time %02x:%02x\n", s_kv.page,
+      (unsigned long) s_kv.seq, s_kv.reads, s_wclock.hours, s_wclock.minutes);
+  sched_add(&s_sched, &s_time_timer, now_ms() + KV_TIME_PERIOD_MS,
+            KV_TIME_PERIOD_MS);
 }
 
 void setup() {
+  bool standby = standby_wakeup();
+  unsigned fired = rtc_fired();  // Woken by the RTC, or it fired meanwhile
+  lptim_init();  // Time since boot starts here, trace and wake_show() read it
+  trace_event(TRACE_BOOT, standby ? (fired ? 2U : 1U) : 0U);
+  s_woken = standby && wake_show();  // Before anything else but time
+  standby_clear();
   clock_init();
   uart_init(UART_DEBUG, 115200);
-  printf("CPU %lu MHz. Initialising firmware\n",
-         (unsigned long) (SystemCoreClock / 1000000));
+  uart_rx_irq(UART_DEBUG, true);
+  set_op(OP_LOG);
+  LOG("CPU %lu MHz. Initialising firmware\n",
+      (unsigned long) (SystemCoreClock / 1000000));
+  mem_setup(DEBUG || !standby);
+  kv_setup();
+  drift_setup();
+  power_setup();
+  if (!s_woken) trace_event(TRACE_CLOCK, wclock_tod_ms(&s_wclock));
 
-  // Initialise LEDs: set output mode, and turn them off
-  for (size_t i = 0; i < ARRAY_SIZE(s_leds); i++) {
-    gpio_output(s_leds[i]);
-    gpio_write(s_leds[i], 0);
-  }
+  // Initialise LEDs: set output mode, brightness, and turn them off. On a
+  // wake-up, they show the time already
+  if (!s_woken) leds_init();
+  set_brightness(LED_BRIGHTNESS);
 
   // Initialise user button
   gpio_input(BTN_PIN);
   attach_external_irq(BTN_PIN);
+  s_btn_pressed = gpio_read(BTN_PIN) == 0;
+  if (s_woken && !fired) wake_press();
+  s_rtc_fired = fired;  // Rings from the main loop
+
+  sched_add(&s_sched, &s_log_timer, now_ms() + LOG_PERIOD_MS, LOG_PERIOD_MS);
 }
 
 void loop(void) {
-  log_task();
   led_task();
+  rtc_task();
+  sched_run(&s_sched, now_ms());
+  rx_task();
+  sleep_task();
 }
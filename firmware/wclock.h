@@ -0,0 +1,102 @@
+// Copyright (c) 2025 Sergey Lyubka
+// SPDX-License-Identifier: MIT
+
+// Wall clock. Hours and minutes are kept as packed BCD, like the RTC
+// registers keep them: 0x23 is 23 hours. Time is moved forward lazily,
+// when the clock is read, by the milliseconds elapsed since the last
+// read. That takes subtractions and BCD increments, and no 64-bit
+// divisions, which are library calls on Cortex-M4. A trim corrects for
+// the oscillator drift, see drift.h: elapsed time is scaled by it, and the
+// fractions of a millisecond carry over to the next update. Each digit then
+// maps straight to an LED column:
+//
+//   struct wclock c = {0};
+//   wclock_set(&c, 0x12, 0x34, now_ms());
+//   ...
+//   wclock_update(&c, now_ms());
+//   show(wclock_led_mask(c.hours, c.minutes));
+
+#pragma once
+
+#include <stdint.h>
+
+#define WCLOCK_MINUTE_MS 60000UL
+#define WCLOCK_HOUR_MS (60 * WCLOCK_MINUTE_MS)
+#define WCLOCK_DAY_MS (24 * WCLOCK_HOUR_MS)
+
+struct wclock {
+  uint8_t hours, minutes;  // Packed BCD, 0x00 .. 0x23 and 0x00 .. 0x59
+  uint32_t ms;             // Milliseconds into the current minute
+  uint64_t synced;         // Time since boot this clock was last moved at
+  int32_t trim;            // Drift correction, 2^-32 ms per ms
+  uint32_t frac;           // Correction carried over, 2^-32 ms
+};
+
+// Increment a packed BCD number, wrap to 0 when it reaches end, also BCD
+static inline uint8_t bcd_inc(uint8_t bcd, uint8_t end) {
+  bcd = (bcd & 0xf) == 9 ? (uint8_t) ((bcd & 0xf0) + 0x10) : bcd + 1;
+  return bcd == end ? 0 : bcd;
+}
+
+static inline uint8_t bcd_from_bin(unsigned n) {  // n < 100, init time only
+  return (uint8_t) (((n / 10) << 4) | (n % 10));
+}
+
+static inline unsigned bcd_to_bin(uint8_t bcd) {
+  return (bcd >> 4) * 10U + (bcd & 15);
+}
+
+static inline void wclock_inc_minute(struct wclock *c) {
+  c->minutes = bcd_inc(c->minutes, 0x60);
+  if (c->minutes == 0) c->hours = bcd_inc(c->hours, 0x24);
+}
+
+// Move the clock to now. A long sleep takes at most a few dozen steps per
+// day slept: whole days are skipped, then hours, then minutes
+static inline void wclock_update(struct wclock *c, uint64_t now) {
+  int64_t trim = (int64_t) (now - c->synced) * c->trim + c->frac;
+  uint64_t elapsed = now - c->synced + (uint64_t) (trim >> 32) + c->ms;
+  c->synced = now, c->frac = (uint32_t) trim;
+  while (elapsed >= WCLOCK_DAY_MS) elapsed -= WCLOCK_DAY_MS;
+  while (elapsed >= WCLOCK_HOUR_MS) {
+    elapsed -= WCLOCK_HOUR_MS;
+    c->hours = bcd_inc(c->hours, 0x24);
+  }
+  while (elapsed >= WCLOCK_MINUTE_MS) {
+    elapsed -= WCLOCK_MINUTE_MS;
+    wclock_inc_minute(c);
+  }
+  c->ms = (uint32_t) elapsed;
+}
+
+// Set time. Seconds start from zero
+static inline void wclock_set(struct wclock *c, uint8_t hours,
+                              uint8_t minutes, uint64_t now) {
+  c->hours = hours, c->minutes = minutes, c->ms = 0, c->synced = now;
+}
+
+// Set time from milliseconds into the day, under WCLOCK_DAY_MS
+static inline void wclock_set_ms(struct wclock *c, uint32_t ms, uint64_t now) {
+  uint32_t minutes = ms / WCLOCK_MINUTE_MS;  // 32-bit divisions, on sync only
+  wclock_set(c, bcd_from_bin(minutes / 60), bcd_from_bin(minutes % 60), now);
+  c->ms = ms % WCLOCK_MINUTE_MS;
+}
+
+// Milliseconds into the day
+static inline uint32_t wclock_tod_ms(const struct wclock *c) {
+  return (uint32_t) (bcd_to_bin(c->hours) * WCLOCK_HOUR_MS +
+                     bcd_to_bin(c->minutes) * WCLOCK_MINUTE_MS + c->ms);
+}
+
+// LED mask of a BCD digit in column 0: bit j of the digit lights row j
+static const uint16_t s_wclock_column[16] = {
+    0x0000, 0x0001, 0x0010, 0x0011, 0x0100, 0x0101, 0x0110, 0x0111,
+    0x1000, 0x1001, 0x1010, 0x1011, 0x1100, 0x1101, 0x1110, 0x1111};
+
+// Hours go to columns 0 and 1, minutes to columns 2 and 3
+static inline uint16_t wclock_led_mask(uint8_t hours, uint8_t minutes) {
+  return (uint16_t) (s_wclock_column[hours >> 4] |
+                     s_wclock_column[hours & 15] << 1 |
+                     s_wclock_column[minutes >> 4] << 2 |
+                     s_wclock_column[minutes & 15] << 3);
+}